@@ -92,3 +92,1232 @@ int idxstats_pbam(std::string bam_file, int n_threads_to_use = 1, bool verbose =
   }
   return(0);
 }
+
+// The following functions check pbam1_t against the raw BAM records of a file.
+// Each returns the number of reads that fail the check (0 if all pass), or -1
+//   if the BAM file cannot be read
+
+// Checks that realized copies of reads hold the whole record, including the
+//   last tag
+// [[Rcpp::export]]
+int check_realize_pbam(std::string bam_file, int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  pbam_in inbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  
+  int n_fail = 0;
+  while(0 == inbam.fillReads()) {
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_really_use) schedule(static,1) reduction(+:n_fail)
+    #endif
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      pbam1_t read(inbam.supplyRead(i));
+      while(read.validate()) {
+        const char * rec = read.record();
+        
+        // Realized by realize(), the copy constructor and copy assignment
+        pbam1_t realized(read);
+        realized.realize();
+        pbam1_t copied(realized);
+        pbam1_t assigned;
+        assigned = copied;
+        
+        pbam1_t * copies[3] = {&realized, &copied, &assigned};
+        for(unsigned int k = 0; k < 3; k++) {
+          pbam1_t & copy = *copies[k];
+          if(!copy.isReal() || copy.block_size() != read.block_size() ||
+              memcmp(copy.record(), rec, read.block_size() + 4) != 0) {
+            n_fail++;
+            break;
+          }
+        }
+        read = inbam.supplyRead(i);
+      }
+    }
+  }
+  if(inbam.GetErrorState() == -1) return(-1);
+  return(n_fail);
+}
+
+// Walks the tags of the record at rec (starting at its block_size field) and
+//   checks the type, subtype and value given by the pbam1_t tag getters
+int check_read_tags(pbam1_t & read, const char * rec) {
+  uint32_t block_size, l_seq;
+  uint16_t n_cigar_op;
+  memcpy(&block_size, rec, 4);
+  memcpy(&n_cigar_op, rec + 16, 2);
+  memcpy(&l_seq, rec + 20, 4);
+  const uint8_t l_read_name = (uint8_t)rec[12];
+  const char * tag = rec + 36 + l_read_name + 4 * n_cigar_op + 
+    (l_seq + 1) / 2 + l_seq;
+  const char * end = rec + 4 + block_size;
+  
+  while(tag + 3 <= end) {
+    const std::string name(tag, 2);
+    const char type = tag[2];
+    const char * val = tag + 3;
+    char subtype = '\0';
+    size_t val_size = 0;
+    switch(type) {
+      case 'A': case 'c': case 'C': val_size = 1; break;
+      case 's': case 'S': val_size = 2; break;
+      case 'i': case 'I': case 'f': val_size = 4; break;
+      case 'Z': case 'H': val_size = strlen(val) + 1; break;
+      case 'B': {
+        subtype = val[0];
+        uint32_t n_vals;
+        memcpy(&n_vals, val + 1, 4);
+        size_t elem_size = (subtype == 'c' || subtype == 'C') ? 1 :
+          (subtype == 's' || subtype == 'S') ? 2 : 4;
+        val_size = 5 + elem_size * n_vals;
+        break;
+      }
+      default:
+        return(1);
+    }
+    if(read.Tag_Type(name) != type) return(1);
+    if(read.Tag_Subtype(name) != subtype) return(1);
+    
+    // Compare values with those read directly from the record
+    int8_t v_c; uint8_t v_C; int16_t v_s; uint16_t v_S;
+    int32_t v_i; uint32_t v_I;
+    bool same = true;
+    switch(type) {
+      case 'A': same = read.tagVal_A(name) == val[0]; break;
+      case 'c': memcpy(&v_c, val, 1); same = read.tagVal_c(name) == v_c; break;
+      case 'C': memcpy(&v_C, val, 1); same = read.tagVal_C(name) == v_C; break;
+      case 's': memcpy(&v_s, val, 2); same = read.tagVal_s(name) == v_s; break;
+      case 'S': memcpy(&v_S, val, 2); same = read.tagVal_S(name) == v_S; break;
+      case 'i': memcpy(&v_i, val, 4); same = read.tagVal_i(name) == v_i; break;
+      case 'I': memcpy(&v_I, val, 4); same = read.tagVal_I(name) == v_I; break;
+      case 'Z': {
+        std::string z;
+        read.tagVal_Z(name, z);
+        // As with tag_length, the string includes the terminating '\0'
+        same = z == std::string(val, val_size);
+        break;
+      }
+      default: {
+        // For B tags, p_tagVal() points past the subtype and length
+        const size_t skip = type == 'B' ? 5 : 0;
+        const char * p = read.p_tagVal(name);
+        same = p && memcmp(p, val + skip, val_size - skip) == 0;
+      }
+    }
+    if(!same) return(1);
+    tag = val + val_size;
+  }
+  return(tag == end ? 0 : 1);
+}
+
+// Checks the tag getters against the tags read directly from the record
+// [[Rcpp::export]]
+int check_tags_pbam(std::string bam_file, int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  pbam_in inbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  
+  int n_fail = 0;
+  while(0 == inbam.fillReads()) {
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_really_use) schedule(static,1) reduction(+:n_fail)
+    #endif
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      pbam1_t read(inbam.supplyRead(i));
+      while(read.validate()) {
+        n_fail += check_read_tags(read, read.record());
+        read = inbam.supplyRead(i);
+      }
+    }
+  }
+  if(inbam.GetErrorState() == -1) return(-1);
+  return(n_fail);
+}
+
+// Rewrites each read as a long read, whose cigar is held in a "CG" tag behind
+//   a placeholder cigar of kSmN, and checks that the cigar getters return the
+//   original cigar. Also checks that a read with a cigar of kSmN but no "CG"
+//   tag keeps its own cigar
+// [[Rcpp::export]]
+int check_long_cigar_pbam(std::string bam_file, int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  pbam_in inbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  
+  int n_fail = 0;
+  while(0 == inbam.fillReads()) {
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_really_use) schedule(static,1) reduction(+:n_fail)
+    #endif
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      std::vector<char> buffer;
+      pbam_cigar_geometry geom, long_geom;
+      pbam1_t read(inbam.supplyRead(i));
+      while(read.validate()) {
+        const uint32_t n_ops = read.n_cigar_op();
+        const uint32_t l_seq = read.l_seq();
+        if(n_ops == 0 || l_seq == 0) {
+          read = inbam.supplyRead(i);
+          continue;
+        }
+        const char * rec = read.record();
+        const size_t cigar_start = 36 + read.l_read_name();
+        const size_t cigar_end = cigar_start + 4 * n_ops;
+        const size_t rec_end = read.block_size() + 4;
+        read.cigar_geometry(geom);
+        
+        // Record with cigar kSmN, followed by CG:B:I holding the cigar
+        const uint32_t placeholder[2] = {
+          (l_seq << 4) | 4, (geom.ref_span << 4) | 3
+        };
+        const uint16_t two_ops = 2;
+        buffer.assign(rec, rec + cigar_start);
+        buffer.insert(buffer.end(), (const char *)placeholder, 
+          (const char *)placeholder + 8);
+        buffer.insert(buffer.end(), rec + cigar_end, rec + rec_end);
+        const size_t no_cg_size = buffer.size();
+        const char cg_header[4] = {'C', 'G', 'B', 'I'};
+        buffer.insert(buffer.end(), cg_header, cg_header + 4);
+        buffer.insert(buffer.end(), (const char *)&n_ops, 
+          (const char *)&n_ops + 4);
+        buffer.insert(buffer.end(), rec + cigar_start, rec + cigar_end);
+        const uint32_t block_size = (uint32_t)buffer.size() - 4;
+        memcpy(buffer.data(), &block_size, 4);
+        memcpy(buffer.data() + 16, &two_ops, 2);
+        
+        std::string cigar_str, long_cigar_str;
+        read.cigar(cigar_str);
+        pbam1_t long_read(buffer.data(), true);
+        long_read.cigar(long_cigar_str);
+        long_read.cigar_geometry(long_geom);
+        bool pass = long_read.cigar_size() == n_ops &&
+          memcmp(long_read.cigar(), read.cigar(), 4 * n_ops) == 0 &&
+          long_cigar_str == cigar_str &&
+          long_geom.ref_end == geom.ref_end &&
+          long_geom.blocks.size() == geom.blocks.size() &&
+          long_geom.junctions.size() == geom.junctions.size();
+        
+        // The same record without the CG tag
+        const uint32_t no_cg_block_size = (uint32_t)no_cg_size - 4;
+        memcpy(buffer.data(), &no_cg_block_size, 4);
+        pbam1_t short_read(buffer.data(), true);
+        if(short_read.cigar_size() != 2 || 
+            short_read.cigar_op(0) != 'S' || short_read.cigar_op(1) != 'N') {
+          pass = false;
+        }
+        if(!pass) n_fail++;
+        read = inbam.supplyRead(i);
+      }
+    }
+  }
+  if(inbam.GetErrorState() == -1) return(-1);
+  return(n_fail);
+}
+
+// The following functions check pbam_in queries against a full scan of the
+//   BAM file. Each returns the number of queries that fail the check (0 if
+//   all pass), or -1 if the BAM file cannot be read
+
+// A read supplied by pbam_in, as compared between scans
+struct test_read {
+  int32_t refID;
+  int32_t pos;
+  uint32_t end;         // As pbam_in: pos + reference span (at least 1)
+  uint32_t size;        // block_size() + 4
+  uint64_t hash;        // FNV-1a hash of the whole record
+};
+
+test_read make_test_read(pbam1_t & read, pbam_cigar_geometry & geom) {
+  test_read t;
+  t.refID = read.refID();
+  t.pos = read.pos();
+  t.size = read.block_size() + 4;
+  uint32_t span = 0;
+  if(!(read.flag() & 0x4)) {
+    read.cigar_geometry(geom);
+    span = geom.ref_span;
+  }
+  t.end = (uint32_t)std::max(t.pos, 0) + std::max(span, 1u);
+  t.hash = 14695981039346656037ULL;
+  const unsigned char * rec = (const unsigned char *)read.record();
+  for(uint32_t i = 0; i < t.size; i++) {
+    t.hash = (t.hash ^ rec[i]) * 1099511628211ULL;
+  }
+  return(t);
+}
+
+/*
+  Appends the reads of the last fillReads() batch of inbam to reads. Each 
+    thread is supplied a run of consecutive reads, so the reads are appended
+    in file order.
+*/
+void collect_batch(pbam_in & inbam, const unsigned int n_threads, 
+    std::vector<test_read> & reads) {
+  std::vector< std::vector<test_read> > thread_reads(n_threads);
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_threads) schedule(static,1)
+  #endif
+  for(unsigned int i = 0; i < n_threads; i++) {
+    pbam_cigar_geometry geom;
+    pbam1_t read(inbam.supplyRead(i));
+    while(read.validate()) {
+      thread_reads.at(i).push_back(make_test_read(read, geom));
+      read = inbam.supplyRead(i);
+    }
+  }
+  for(unsigned int i = 0; i < n_threads; i++) {
+    reads.insert(reads.end(), thread_reads.at(i).begin(), 
+      thread_reads.at(i).end());
+  }
+}
+
+/*
+  Appends the reads supplied by inbam to reads until fillReads() returns 1.
+  Returns 0 if success, or -1 if error
+*/
+int collect_reads(pbam_in & inbam, const unsigned int n_threads, 
+    std::vector<test_read> & reads) {
+  int ret;
+  while(0 == (ret = inbam.fillReads())) {
+    collect_batch(inbam, n_threads, reads);
+  }
+  if(ret == -1 || inbam.GetErrorState() == -1) return(-1);
+  return(0);
+}
+
+// Whether reads equals the reads of expected from index start, in order
+bool same_reads_in_order(const std::vector<test_read> & reads, 
+    const std::vector<test_read> & expected, const size_t start) {
+  if(start > expected.size()) return(false);
+  if(reads.size() != expected.size() - start) return(false);
+  for(size_t i = 0; i < reads.size(); i++) {
+    if(reads.at(i).hash != expected.at(start + i).hash) return(false);
+  }
+  return(true);
+}
+
+// Whether two lists hold the same reads, regardless of order
+bool same_reads(const std::vector<test_read> & a, 
+    const std::vector<test_read> & b) {
+  if(a.size() != b.size()) return(false);
+  std::vector<uint64_t> hash_a, hash_b;
+  for(size_t i = 0; i < a.size(); i++) hash_a.push_back(a.at(i).hash);
+  for(size_t i = 0; i < b.size(); i++) hash_b.push_back(b.at(i).hash);
+  std::sort(hash_a.begin(), hash_a.end());
+  std::sort(hash_b.begin(), hash_b.end());
+  return(hash_a == hash_b);
+}
+
+// Writes a BAI (min_shift = 0) or CSI index of a coordinate-sorted BAM file,
+//   built by pbam_in::BuildIndex() while reading the file
+// [[Rcpp::export]]
+int write_index_pbam(std::string bam_file, std::string index_file,
+    int min_shift = 0, int depth = 5, int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  pbam_in inbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(inbam.BuildIndex(min_shift, depth) != 0) return(-1);
+  std::vector<test_read> reads;
+  if(collect_reads(inbam, n_threads_to_really_use, reads) != 0) return(-1);
+  return(inbam.WriteIndex(index_file));
+}
+
+/*
+  Checks region queries of a coordinate-sorted BAM file, using the given index,
+    against the reads of a full scan that overlap the regions:
+  - Whole chromosomes, and regions of random sizes
+  - A region spanning more reads than a BGZF block can hold, which therefore
+      crosses a BGZF block boundary
+  - A region of a chromosome without reads
+  - Several overlapping regions, given out of order, in one query
+*/
+// [[Rcpp::export]]
+int check_regions_pbam(std::string bam_file, std::string index_file,
+    int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  std::vector<test_read> all_reads;
+  pbam_in scan;
+  if(scan.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(collect_reads(scan, n_threads_to_really_use, all_reads) != 0) return(-1);
+  scan.closeFile();
+
+  pbam_in inbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  std::vector<std::string> chr_names;
+  std::vector<uint32_t> chr_lens;
+  if(inbam.obtainChrs(chr_names, chr_lens) <= 0) return(-1);
+  if(inbam.LoadIndex(index_file) != 0) return(-1);
+
+  // Reads of each chromosome, in order of position (as in the file)
+  std::vector< std::vector<size_t> > chr_reads(chr_names.size());
+  uint32_t min_size = 65536;
+  for(size_t i = 0; i < all_reads.size(); i++) {
+    const test_read & t = all_reads.at(i);
+    if(t.refID >= 0 && t.pos >= 0) chr_reads.at(t.refID).push_back(i);
+    min_size = std::min(min_size, t.size);
+  }
+  
+  // Each query is a list of regions (refID, start, end)
+  std::vector< std::vector<pbam_region> > queries;
+  size_t busiest = 0;
+  for(size_t j = 0; j < chr_names.size(); j++) {
+    if(chr_reads.at(j).size() > chr_reads.at(busiest).size()) busiest = j;
+    if(chr_reads.at(j).size() > 0 && queries.size() < 5) {
+      pbam_region r; r.refID = j; r.start = 0; r.end = chr_lens.at(j);
+      queries.push_back(std::vector<pbam_region>(1, r));
+    }
+  }
+  
+  // A BGZF block holds at most 65536 bytes, so at most 65536 / min_size reads
+  const std::vector<size_t> & busy = chr_reads.at(busiest);
+  const size_t span = 65536 / min_size + 1;
+  if(busy.size() > span) {
+    pbam_region r; r.refID = busiest;
+    r.start = all_reads.at(busy.at(busy.size() / 2 - span / 2)).pos;
+    r.end = all_reads.at(busy.at(busy.size() / 2 + span / 2)).pos + 1;
+    queries.push_back(std::vector<pbam_region>(1, r));
+  }
+
+  for(size_t j = 0; j < chr_names.size(); j++) {
+    if(chr_reads.at(j).size() == 0) {
+      pbam_region r; r.refID = j; r.start = 0; r.end = chr_lens.at(j);
+      queries.push_back(std::vector<pbam_region>(1, r));
+      break;
+    }
+  }
+  
+  // Random regions, around random reads of chromosomes with reads
+  uint64_t seed = 12345;
+  std::vector<pbam_region> multi;
+  for(unsigned int q = 0; q < 60 && all_reads.size() > 0; q++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    const test_read & t = all_reads.at((seed >> 33) % all_reads.size());
+    if(t.refID < 0 || t.pos < 0) continue;
+    const uint32_t width = 1u << ((seed >> 20) % 17);
+    pbam_region r; r.refID = t.refID;
+    r.start = (uint32_t)t.pos > width / 2 ? t.pos - width / 2 : 0;
+    r.end = std::min(r.start + width, chr_lens.at(t.refID));
+    if(q < 50) {
+      queries.push_back(std::vector<pbam_region>(1, r));
+    } else {
+      multi.push_back(r);
+    }
+  }
+  std::reverse(multi.begin(), multi.end());
+  if(multi.size() > 0) queries.push_back(multi);
+
+  int n_fail = 0;
+  for(size_t q = 0; q < queries.size(); q++) {
+    const std::vector<pbam_region> & query = queries.at(q);
+    std::vector<std::string> chrs;
+    std::vector<uint32_t> starts, ends;
+    for(size_t k = 0; k < query.size(); k++) {
+      chrs.push_back(chr_names.at(query.at(k).refID));
+      starts.push_back(query.at(k).start);
+      ends.push_back(query.at(k).end);
+    }
+    if(inbam.SetRegions(chrs, starts, ends) != 0) return(-1);
+    std::vector<test_read> region_reads;
+    if(collect_reads(inbam, n_threads_to_really_use, region_reads) != 0) {
+      return(-1);
+    }
+    
+    std::vector<test_read> expected;
+    for(size_t i = 0; i < all_reads.size(); i++) {
+      const test_read & t = all_reads.at(i);
+      for(size_t k = 0; k < query.size(); k++) {
+        if(t.refID == query.at(k).refID && t.pos >= 0 &&
+            (uint32_t)t.pos < query.at(k).end && t.end > query.at(k).start) {
+          expected.push_back(t);
+          break;
+        }
+      }
+    }
+    if(!same_reads(region_reads, expected)) n_fail++;
+  }
+  return(n_fail);
+}
+
+/*
+  Checks that a scan resumed with Seek(), from a virtual offset returned by
+    Tell() between fillReads() batches, supplies the rest of the reads of a
+    full scan. Small buffers are used, so that the file is read in several
+    batches. With mate batching, the reads with the last name of each batch
+    are held back, so that most batches end within a BGZF block. Unsupplied
+    reads of a batch are discarded by Seek().
+*/
+// [[Rcpp::export]]
+int check_seek_pbam(std::string bam_file, int n_threads_to_use = 1,
+    bool pipelined = false){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  std::vector<test_read> all_reads;
+  pbam_in scan;
+  if(scan.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(collect_reads(scan, n_threads_to_really_use, all_reads) != 0) return(-1);
+  scan.closeFile();
+
+  // The virtual offset after each batch, and the number of reads before it
+  std::vector<uint64_t> voffsets;
+  std::vector<size_t> n_reads;
+  std::vector<test_read> reads;
+  pbam_in inbam(1100000, 1100000, 1);
+  inbam.SetPipelined(pipelined);
+  inbam.SetMateBatching(true);
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  int ret;
+  while(0 == (ret = inbam.fillReads())) {
+    collect_batch(inbam, n_threads_to_really_use, reads);
+    voffsets.push_back(inbam.Tell());
+    n_reads.push_back(reads.size());
+  }
+  if(ret == -1 || inbam.GetErrorState() == -1) return(-1);
+  inbam.closeFile();
+
+  int n_fail = 0;
+  if(voffsets.size() < 3) n_fail++;
+  if(!same_reads_in_order(reads, all_reads, 0)) n_fail++;
+  for(size_t k = 0; k < voffsets.size(); k++) {
+    pbam_in resumed(1100000, 1100000, 1);
+    resumed.SetPipelined(pipelined);
+    if(resumed.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+    // Seek from the middle of a batch, leaving its reads unsupplied
+    if(k % 2 == 1 && resumed.fillReads() != 0) return(-1);
+    if(resumed.Seek(voffsets.at(k)) != 0) return(-1);
+    std::vector<test_read> rest;
+    if(collect_reads(resumed, n_threads_to_really_use, rest) != 0) return(-1);
+    if(!same_reads_in_order(rest, all_reads, n_reads.at(k))) n_fail++;
+  }
+  return(n_fail);
+}
+
+/*
+  Checks that byte-range shards, splitting the file into n_ranges slices of
+    equal size, together supply the reads of a full scan, each exactly once
+    and in file order
+*/
+// [[Rcpp::export]]
+int check_byte_ranges_pbam(std::string bam_file, int n_ranges = 4,
+    int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+  if(n_ranges < 1) return(-1);
+
+  std::vector<test_read> all_reads;
+  pbam_in scan;
+  if(scan.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(collect_reads(scan, n_threads_to_really_use, all_reads) != 0) return(-1);
+  const size_t file_size = scan.GetFileSize();
+  scan.closeFile();
+
+  std::vector<test_read> reads;
+  for(int i = 0; i < n_ranges; i++) {
+    pbam_in inbam;
+    if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+    const size_t begin = file_size * i / n_ranges;
+    const size_t end = file_size * (i + 1) / n_ranges;
+    if(inbam.SetByteRange(begin, end) != 0) return(-1);
+    if(collect_reads(inbam, n_threads_to_really_use, reads) != 0) return(-1);
+  }
+  if(!same_reads_in_order(reads, all_reads, 0)) return(1);
+  return(0);
+}
+
+/*
+  Checks that pbam_multi_in supplies the reads of each file, in file order, as
+    a pbam_in reading the file alone. Files smaller than small_file_size are
+    filled side by side, and files are opened while their buffers fit in
+    memory_cap
+*/
+// [[Rcpp::export]]
+int check_multi_in_pbam(std::vector<std::string> bam_files, 
+    int n_threads_to_use = 1, double memory_cap = 2e9, 
+    double small_file_size = 67108864){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  std::vector< std::vector<test_read> > file_reads(bam_files.size());
+  for(size_t f = 0; f < bam_files.size(); f++) {
+    pbam_in scan;
+    if(scan.openFile(bam_files.at(f), n_threads_to_really_use) != 0) return(-1);
+    if(collect_reads(scan, n_threads_to_really_use, file_reads.at(f)) != 0) {
+      return(-1);
+    }
+  }
+
+  pbam_multi_in inbams((size_t)memory_cap);
+  inbams.SetSmallFileSize((size_t)small_file_size);
+  if(inbams.openFiles(bam_files, n_threads_to_really_use) != 0) return(-1);
+  std::vector< std::vector<test_read> > multi_reads(bam_files.size());
+  std::vector< std::vector<test_read> > thread_reads(n_threads_to_really_use);
+  int ret;
+  while(0 == (ret = inbams.fillReads())) {
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_really_use) schedule(static,1)
+    #endif
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      pbam_cigar_geometry geom;
+      thread_reads.at(i).clear();
+      pbam1_t read(inbams.supplyRead(i));
+      while(read.validate()) {
+        thread_reads.at(i).push_back(make_test_read(read, geom));
+        read = inbams.supplyRead(i);
+      }
+    }
+    // The threads given reads of the same file hold consecutive runs of reads
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      const int f = inbams.GetFileIndex(i);
+      if(f < 0) continue;
+      multi_reads.at(f).insert(multi_reads.at(f).end(), 
+        thread_reads.at(i).begin(), thread_reads.at(i).end());
+    }
+  }
+  if(ret == -1 || inbams.GetErrorState() == -1) return(-1);
+
+  int n_fail = 0;
+  for(size_t f = 0; f < bam_files.size(); f++) {
+    if(!same_reads_in_order(multi_reads.at(f), file_reads.at(f), 0)) n_fail++;
+  }
+  return(n_fail);
+}
+
+// A read of a merged scan, and the index of its file
+struct merged_read {
+  test_read read;
+  int file_idx;
+};
+
+// Orders reads as pbam_merge_in: by refID (unmapped last), then position
+bool merge_order(const merged_read & a, const merged_read & b) {
+  if(a.read.refID != b.read.refID) {
+    return((uint32_t)a.read.refID < (uint32_t)b.read.refID);
+  }
+  return((uint32_t)a.read.pos < (uint32_t)b.read.pos);
+}
+
+/*
+  Checks that pbam_merge_in supplies the reads of coordinate-sorted BAM files
+    in coordinate order, with reads of earlier files first at equal
+    positions, and that each read comes from the file given by 
+    GetFileIndex()
+*/
+// [[Rcpp::export]]
+int check_merge_pbam(std::vector<std::string> bam_files, 
+    int n_threads_to_use = 1, bool pipelined = false){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  // A stable sort of the reads of all files gives the merged order
+  std::vector<merged_read> expected;
+  for(size_t f = 0; f < bam_files.size(); f++) {
+    pbam_in scan;
+    if(scan.openFile(bam_files.at(f), n_threads_to_really_use) != 0) return(-1);
+    std::vector<test_read> reads;
+    if(collect_reads(scan, n_threads_to_really_use, reads) != 0) return(-1);
+    for(size_t i = 0; i < reads.size(); i++) {
+      merged_read m; m.read = reads.at(i); m.file_idx = (int)f;
+      expected.push_back(m);
+    }
+  }
+  std::stable_sort(expected.begin(), expected.end(), merge_order);
+
+  pbam_merge_in mergebam;
+  mergebam.SetPipelined(pipelined);
+  if(mergebam.openFiles(bam_files, n_threads_to_really_use) != 0) return(-1);
+  std::vector<merged_read> merged;
+  std::vector< std::vector<merged_read> > thread_reads(n_threads_to_really_use);
+  int ret;
+  while(0 == (ret = mergebam.fillReads())) {
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_really_use) schedule(static,1)
+    #endif
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      pbam_cigar_geometry geom;
+      thread_reads.at(i).clear();
+      pbam1_t read(mergebam.supplyRead(i));
+      while(read.validate()) {
+        merged_read m;
+        m.read = make_test_read(read, geom);
+        m.file_idx = mergebam.GetFileIndex(i);
+        thread_reads.at(i).push_back(m);
+        read = mergebam.supplyRead(i);
+      }
+    }
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      merged.insert(merged.end(), thread_reads.at(i).begin(), 
+        thread_reads.at(i).end());
+    }
+  }
+  if(ret == -1 || mergebam.GetErrorState() == -1) return(-1);
+
+  if(merged.size() != expected.size()) return(1);
+  int n_fail = 0;
+  for(size_t i = 0; i < merged.size(); i++) {
+    if(merged.at(i).read.hash != expected.at(i).read.hash ||
+        merged.at(i).file_idx != expected.at(i).file_idx) n_fail++;
+  }
+  return(n_fail);
+}
+
+/*
+  Checks that pbam_in::supplyBatch() hands over the reads of each batch as 
+    supplyRead() would, and is refused once reads are partitioned by key
+*/
+// [[Rcpp::export]]
+int check_supply_batch_pbam(std::string bam_file, int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  std::vector<test_read> all_reads;
+  pbam_in scan;
+  if(scan.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(collect_reads(scan, n_threads_to_really_use, all_reads) != 0) return(-1);
+  scan.closeFile();
+
+  std::vector<test_read> reads;
+  pbam_in inbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  pbam_cigar_geometry geom;
+  int ret;
+  while(0 == (ret = inbam.fillReads())) {
+    char * batch;
+    size_t batch_size;
+    if(inbam.supplyBatch(batch, batch_size) != 0) return(-1);
+    for(size_t pos = 0; pos < batch_size; ) {
+      pbam1_t read(batch + pos, false);
+      if(!read.validate()) return(-1);
+      reads.push_back(make_test_read(read, geom));
+      pos += read.block_size() + 4;
+    }
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      if(inbam.remainingThreadReadsBuffer(i) != 0) return(-1);
+    }
+  }
+  if(ret == -1 || inbam.GetErrorState() == -1) return(-1);
+  inbam.closeFile();
+
+  int n_fail = 0;
+  if(!same_reads_in_order(reads, all_reads, 0)) n_fail++;
+
+  // Reads partitioned by key are not a single run
+  pbam_in part;
+  if(part.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(part.SetPartitionKey("QNAME") != 0) return(-1);
+  if(part.fillReads() != 0) return(-1);
+  char * batch;
+  size_t batch_size;
+  if(part.supplyBatch(batch, batch_size) == 0) n_fail++;
+  return(n_fail);
+}
+
+// The partition key of a read, as a string: the read name, the refID, or the
+//   value of a tag (integers by value, whatever their type; "" if absent)
+std::string read_partition_key(pbam1_t & read, const std::string & key) {
+  std::string val;
+  if(key == "QNAME") {
+    read.read_name(val);
+    return(val);
+  }
+  if(key == "RNAME") return(std::to_string(read.refID()));
+  switch(read.Tag_Type(key)) {
+    case '\0': return("");
+    case 'c': return(std::to_string(read.tagVal_c(key)));
+    case 'C': return(std::to_string(read.tagVal_C(key)));
+    case 's': return(std::to_string(read.tagVal_s(key)));
+    case 'S': return(std::to_string(read.tagVal_S(key)));
+    case 'i': return(std::to_string(read.tagVal_i(key)));
+    case 'I': return(std::to_string(read.tagVal_I(key)));
+    case 'Z': read.tagVal_Z(key, val); return(val);
+    default: return(std::string(read.p_tagVal(key), read.Tag_Size(key)));
+  }
+}
+
+/*
+  Checks reads partitioned by SetPartitionKey(key) against a full scan:
+  - Every read is supplied to exactly one thread
+  - Reads with the same key are supplied to the same thread, in all batches
+  - Reads of each thread are in file order
+*/
+// [[Rcpp::export]]
+int check_partition_pbam(std::string bam_file, std::string key,
+    int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  std::vector<test_read> all_reads;
+  pbam_in scan;
+  if(scan.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(collect_reads(scan, n_threads_to_really_use, all_reads) != 0) return(-1);
+  scan.closeFile();
+  std::map<uint64_t, size_t> read_index;
+  for(size_t i = 0; i < all_reads.size(); i++) {
+    read_index.insert(std::make_pair(all_reads.at(i).hash, i));
+  }
+
+  pbam_in inbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(inbam.SetPartitionKey(key) != 0) return(-1);
+  std::vector<test_read> reads;
+  std::map<std::string, unsigned int> key_thread;
+  std::vector< std::vector<test_read> > thread_reads(n_threads_to_really_use);
+  std::vector< std::vector<std::string> > thread_keys(n_threads_to_really_use);
+  int n_fail = 0;
+  int ret;
+  while(0 == (ret = inbam.fillReads())) {
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_really_use) schedule(static,1)
+    #endif
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      pbam_cigar_geometry geom;
+      thread_reads.at(i).clear();
+      thread_keys.at(i).clear();
+      pbam1_t read(inbam.supplyRead(i));
+      while(read.validate()) {
+        thread_reads.at(i).push_back(make_test_read(read, geom));
+        thread_keys.at(i).push_back(read_partition_key(read, key));
+        read = inbam.supplyRead(i);
+      }
+    }
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      size_t last_index = 0;
+      for(size_t j = 0; j < thread_reads.at(i).size(); j++) {
+        std::map<std::string, unsigned int>::iterator it = 
+          key_thread.insert(std::make_pair(thread_keys.at(i).at(j), i)).first;
+        if(it->second != i) n_fail++;
+        const size_t index = read_index[thread_reads.at(i).at(j).hash];
+        if(j > 0 && index < last_index) n_fail++;
+        last_index = index;
+      }
+      reads.insert(reads.end(), thread_reads.at(i).begin(), 
+        thread_reads.at(i).end());
+    }
+  }
+  if(ret == -1 || inbam.GetErrorState() == -1) return(-1);
+  if(!same_reads(reads, all_reads)) n_fail++;
+  // With several threads, the reads must not all go to one thread
+  if(n_threads_to_really_use > 1 && key_thread.size() > 1) {
+    std::vector<bool> used(n_threads_to_really_use, false);
+    for(std::map<std::string, unsigned int>::iterator it = key_thread.begin();
+        it != key_thread.end(); it++) used.at(it->second) = true;
+    if(std::count(used.begin(), used.end(), true) < 2) n_fail++;
+  }
+  return(n_fail);
+}
+
+/*
+  Checks that with SetChromosomeBatching(), all reads of each batch have the
+    refID given by GetBatchRefID(), and that the batches together supply the
+    reads of a full scan in order
+*/
+// [[Rcpp::export]]
+int check_chrom_batches_pbam(std::string bam_file, int n_threads_to_use = 1,
+    bool pipelined = false){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  std::vector<test_read> all_reads;
+  pbam_in scan;
+  if(scan.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(collect_reads(scan, n_threads_to_really_use, all_reads) != 0) return(-1);
+  scan.closeFile();
+
+  pbam_in inbam;
+  inbam.SetPipelined(pipelined);
+  inbam.SetChromosomeBatching(true);
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  std::vector<test_read> reads;
+  int n_fail = 0;
+  int ret;
+  while(0 == (ret = inbam.fillReads())) {
+    const size_t batch_start = reads.size();
+    collect_batch(inbam, n_threads_to_really_use, reads);
+    if(reads.size() == batch_start) n_fail++;
+    const int32_t batch_refID = inbam.GetBatchRefID();
+    for(size_t i = batch_start; i < reads.size(); i++) {
+      if(reads.at(i).refID != batch_refID) n_fail++;
+    }
+  }
+  if(ret == -1 || inbam.GetErrorState() == -1) return(-1);
+  if(!same_reads_in_order(reads, all_reads, 0)) n_fail++;
+  return(n_fail);
+}
+
+// Whether two cigar geometries are the same, including blocks and junctions
+bool same_geometry(const pbam_cigar_geometry & a, 
+    const pbam_cigar_geometry & b) {
+  if(a.ref_start != b.ref_start || a.ref_end != b.ref_end ||
+      a.ref_span != b.ref_span || a.query_length != b.query_length ||
+      a.aligned_length != b.aligned_length ||
+      a.soft_clip_start != b.soft_clip_start ||
+      a.soft_clip_end != b.soft_clip_end ||
+      a.hard_clip_start != b.hard_clip_start ||
+      a.hard_clip_end != b.hard_clip_end) return(false);
+  if(a.blocks.size() != b.blocks.size() ||
+      a.junctions.size() != b.junctions.size()) return(false);
+  for(size_t i = 0; i < a.blocks.size(); i++) {
+    if(a.blocks.at(i).start != b.blocks.at(i).start ||
+      a.blocks.at(i).end != b.blocks.at(i).end) return(false);
+  }
+  for(size_t i = 0; i < a.junctions.size(); i++) {
+    if(a.junctions.at(i).start != b.junctions.at(i).start ||
+      a.junctions.at(i).end != b.junctions.at(i).end) return(false);
+  }
+  return(true);
+}
+
+// Returns 0 if the getters of view match those of read, or 1 if not
+int check_view(pbam_view & view, pbam1_t & read) {
+  if(view.block_size() != read.block_size()) return(1);
+  if(memcmp(view.record(), read.record(), read.block_size() + 4) != 0) {
+    return(1);
+  }
+  if(view.refID() != read.refID() || view.pos() != read.pos() ||
+      view.l_read_name() != read.l_read_name() || 
+      view.mapq() != read.mapq() || view.bin() != read.bin() ||
+      view.n_cigar_op() != read.n_cigar_op() || view.flag() != read.flag() ||
+      view.l_seq() != read.l_seq() || 
+      view.next_refID() != read.next_refID() ||
+      view.next_pos() != read.next_pos() || view.tlen() != read.tlen()) {
+    return(1);
+  }
+  if(view.read_name() - view.record() != read.read_name() - read.record() ||
+      (const char *)view.cigar() - view.record() != 
+        36 + view.l_read_name() ||
+      (const char *)view.seq() - view.record() != 
+        (char *)read.seq() - read.record() ||
+      view.qual() - view.record() != read.qual() - read.record()) {
+    return(1);
+  }
+  // Only pbam1_t::cigar() gives the cigar held in the "CG" tag of long reads
+  if(read.Tag_Type("CG") == '\0' && 
+      (char *)read.cigar() - read.record() != 36 + view.l_read_name()) {
+    return(1);
+  }
+  // Tags run from the end of the qualities to the end of the record
+  if(view.tags() != view.qual() + view.l_seq() ||
+      view.tags() + view.tag_size() != 
+        view.record() + view.block_size() + 4) return(1);
+
+  const uint32_t l_seq = read.l_seq();
+  std::vector<char> view_seq(l_seq), read_seq(l_seq);
+  view.seq(view_seq.data());
+  read.seq(read_seq.data());
+  if(view_seq != read_seq) return(1);
+  view.seq_revcomp(view_seq.data());
+  read.seq_revcomp(read_seq.data());
+  if(view_seq != read_seq) return(1);
+
+  pbam_cigar_geometry view_geom, read_geom;
+  if(view.cigar_geometry(view_geom) != read.cigar_geometry(read_geom)) {
+    return(1);
+  }
+  if(!same_geometry(view_geom, read_geom)) return(1);
+
+  // Conversions between pbam_view and pbam1_t view the same record
+  pbam1_t copy = view.toRead(true);
+  if(!copy.validate() || pbam_view(copy).block_size() != read.block_size() ||
+      memcmp(pbam_view(copy).record(), read.record(), 
+        read.block_size() + 4) != 0) return(1);
+  if(pbam_view(read).record() != read.record()) return(1);
+  return(0);
+}
+
+/*
+  Checks that supplyView() supplies the same reads as supplyRead(), read for
+    read, with the same values from all getters. Two pbam_in read the same
+    file, one using each function, optionally partitioned by key
+*/
+// [[Rcpp::export]]
+int check_views_pbam(std::string bam_file, std::string key = "",
+    int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+
+  pbam_in inbam, viewbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(viewbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  if(inbam.SetPartitionKey(key) != 0) return(-1);
+  if(viewbam.SetPartitionKey(key) != 0) return(-1);
+  
+  int n_fail = 0;
+  int ret;
+  while(0 == (ret = inbam.fillReads())) {
+    if(viewbam.fillReads() != 0) return(-1);
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_really_use) schedule(static,1) reduction(+:n_fail)
+    #endif
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      pbam1_t read(inbam.supplyRead(i));
+      pbam_view view(viewbam.supplyView(i));
+      while(read.validate() && view.valid()) {
+        n_fail += check_view(view, read);
+        read = inbam.supplyRead(i);
+        view = viewbam.supplyView(i);
+      }
+      // Both run out of reads at the same time
+      if(read.validate() || view.valid()) n_fail++;
+    }
+  }
+  if(ret == -1 || inbam.GetErrorState() == -1) return(-1);
+  if(viewbam.fillReads() != 1) n_fail++;
+  return(n_fail);
+}
+
+// Decodes a packed sequence one base at a time, as pbam1_t did before the
+//   sequence kernels were added
+std::string seq_to_str(const uint8_t * seq, const uint32_t l_seq) {
+  static const char seq_chars[] = "=ACMGRSVTWYHKDBN";
+  std::string str(l_seq, ' ');
+  for(uint32_t i = 0; i < l_seq; i++) {
+    str[i] = seq_chars[(seq[i / 2] >> (i % 2 == 0 ? 4 : 0)) & 0x0F];
+  }
+  return(str);
+}
+
+// Reverse complement of a decoded sequence, including ambiguity codes
+std::string revcomp_str(const std::string & str) {
+  static const std::string bases = "=ACMGRSVTWYHKDBN";
+  static const std::string comps = "=TGKCYSBAWRDMHVN";
+  std::string rc(str.rbegin(), str.rend());
+  for(size_t i = 0; i < rc.size(); i++) rc[i] = comps[bases.find(rc[i])];
+  return(rc);
+}
+
+/*
+  Checks pbam_seq_decode() and pbam_seq_revcomp() (which use SIMD kernels 
+    where available) against seq_to_str(), for random sequences of every 
+    length up to max_len, using all 16 base codes, at several alignments of
+    the packed sequence. Also checks that nothing is written past l_seq
+    characters, and that the SSSE3 / AVX2 kernels supported by the CPU
+    decode whole 16 / 32 byte blocks
+*/
+// [[Rcpp::export]]
+int check_seq_decode_pbam(int max_len = 300){
+  int n_fail = 0;
+  uint64_t seed = 12345;
+  std::vector<uint8_t> packed(max_len / 2 + 8);
+  std::vector<char> dest(max_len + 16);
+  for(uint32_t l_seq = 0; l_seq <= (uint32_t)max_len; l_seq++) {
+    for(size_t offset = 0; offset < 4; offset++) {
+      for(size_t i = 0; i < packed.size(); i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        packed.at(i) = (uint8_t)(seed >> 56);
+      }
+      const uint8_t * seq = packed.data() + offset;
+      const std::string expected = seq_to_str(seq, l_seq);
+
+      std::fill(dest.begin(), dest.end(), '#');
+      pbam_seq_decode(seq, l_seq, dest.data());
+      if(std::string(dest.data(), l_seq) != expected || 
+        dest.at(l_seq) != '#') n_fail++;
+
+      std::fill(dest.begin(), dest.end(), '#');
+      pbam_seq_revcomp(seq, l_seq, dest.data());
+      if(std::string(dest.data(), l_seq) != revcomp_str(expected) || 
+        dest.at(l_seq) != '#') n_fail++;
+
+      #ifdef OMPBAM_X86_SIMD
+      // The kernels decode bytes holding two bases: the first (decode) or
+      //   last (reverse complement) n_bytes of the sequence
+      const size_t n_bytes = l_seq / 2;
+      const std::string whole = seq_to_str(seq, 2 * n_bytes);
+      const std::string whole_rc = revcomp_str(whole);
+      size_t n_done;
+      if(pbam_cpu_has_ssse3()) {
+        n_done = pbam_seq_decode_ssse3(seq, n_bytes, dest.data());
+        if(n_done != n_bytes / 16 * 16 ||
+          std::string(dest.data(), 2 * n_done) != whole.substr(0, 2 * n_done)) {
+          n_fail++;
+        }
+        n_done = pbam_seq_revcomp_ssse3(seq, n_bytes, dest.data());
+        if(n_done != n_bytes / 16 * 16 || std::string(dest.data(), 2 * n_done) 
+          != whole_rc.substr(0, 2 * n_done)) n_fail++;
+      }
+      if(pbam_cpu_has_avx2()) {
+        n_done = pbam_seq_decode_avx2(seq, n_bytes, dest.data());
+        if(n_done != n_bytes / 32 * 32 ||
+          std::string(dest.data(), 2 * n_done) != whole.substr(0, 2 * n_done)) {
+          n_fail++;
+        }
+        n_done = pbam_seq_revcomp_avx2(seq, n_bytes, dest.data());
+        if(n_done != n_bytes / 32 * 32 || std::string(dest.data(), 2 * n_done) 
+          != whole_rc.substr(0, 2 * n_done)) n_fail++;
+      }
+      #endif
+    }
+  }
+  return(n_fail);
+}
+
+// Base quality statistics of a read, from plain loops. Reads without 
+//   qualities (all 0xFF) count as reads of no bases
+struct plain_qual {
+  bool missing = true;
+  uint32_t n_bases = 0;
+  uint64_t sum = 0;
+  uint8_t min = 0;
+  uint8_t max = 0;
+  uint32_t n_below = 0;
+  double expected_errors = 0;
+  uint32_t trim_pos = 0;
+};
+
+plain_qual plain_qual_stats(const uint8_t * qual, const uint32_t l_seq,
+    const uint8_t threshold, const uint32_t window) {
+  plain_qual p;
+  p.trim_pos = l_seq;
+  for(uint32_t i = 0; i < l_seq; i++) {
+    if(qual[i] != 0xFF) p.missing = false;
+  }
+  if(p.missing) return(p);
+  p.n_bases = l_seq;
+  p.min = qual[0];
+  p.max = qual[0];
+  for(uint32_t i = 0; i < l_seq; i++) {
+    p.sum += qual[i];
+    p.min = std::min(p.min, qual[i]);
+    p.max = std::max(p.max, qual[i]);
+    if(qual[i] < threshold) p.n_below++;
+    p.expected_errors += pow(10.0, -(double)qual[i] / 10.0);
+  }
+  // The first window (or the whole read, if shorter) of mean below threshold
+  const uint32_t w = std::min(window, l_seq);
+  for(uint32_t start = 0; start + w <= l_seq; start++) {
+    double mean = 0;
+    for(uint32_t i = start; i < start + w; i++) mean += qual[i];
+    if(mean / w < threshold) {
+      p.trim_pos = start;
+      break;
+    }
+  }
+  return(p);
+}
+
+bool near(const double a, const double b) {
+  return(fabs(a - b) <= 1e-9 * std::max(1.0, fabs(b)));
+}
+
+// Returns 0 if the quality kernels agree with the plain loops for a read
+int check_qual_read(const uint8_t * qual, const uint32_t l_seq, 
+    const uint8_t threshold, const uint32_t window) {
+  const plain_qual p = plain_qual_stats(qual, l_seq, threshold, window);
+  pbam_qual_stats stats;
+  pbam_qual_summary(qual, l_seq, threshold, stats);
+  if(pbam_qual_missing(qual, l_seq) != p.missing) return(1);
+  if(stats.n_bases != p.n_bases || stats.sum != p.sum || 
+      stats.min != p.min || stats.max != p.max || 
+      stats.n_below != p.n_below) return(1);
+  if(!near(pbam_qual_expected_errors(qual, l_seq), p.expected_errors)) {
+    return(1);
+  }
+  if(pbam_qual_trim_pos(qual, l_seq, window, threshold) != p.trim_pos) {
+    return(1);
+  }
+  return(0);
+}
+
+/*
+  Checks the base quality kernels against plain loops, for each read of a
+    BAM file (reads without qualities have all qualities set to 0xFF), and
+    for random qualities of every length up to 300 and a range of
+    thresholds. Per-thread pbam_qual_qc,
+    merged at the end, and pbam_qual_histogram() are checked against a
+    histogram of all qualities
+*/
+// [[Rcpp::export]]
+int check_qual_pbam(std::string bam_file, int n_threads_to_use = 1){
+  unsigned int n_threads_to_really_use = use_threads(n_threads_to_use);
+  const uint8_t threshold = 20;
+  const uint32_t window = 10;
+
+  int n_fail = 0;
+  uint64_t seed = 12345;
+  std::vector<uint8_t> qual(300);
+  for(uint32_t l_seq = 0; l_seq <= 300; l_seq++) {
+    for(uint32_t i = 0; i < l_seq; i++) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      // Mostly high qualities, with runs of low ones
+      qual.at(i) = (uint8_t)((seed >> 33) % ((seed >> 60) < 3 ? 15 : 42));
+    }
+    for(unsigned int t : {0, 1, 20, 41, 255}) {
+      n_fail += check_qual_read(qual.data(), l_seq, (uint8_t)t, window);
+    }
+  }
+
+  pbam_in inbam;
+  if(inbam.openFile(bam_file, n_threads_to_really_use) != 0) return(-1);
+  std::vector<pbam_qual_qc> thread_qc(n_threads_to_really_use);
+  std::vector< std::vector<uint64_t> > thread_hist(n_threads_to_really_use,
+    std::vector<uint64_t>(256, 0));
+  std::vector< std::vector<uint64_t> > thread_plain_hist(
+    n_threads_to_really_use, std::vector<uint64_t>(256, 0));
+  std::vector<uint64_t> thread_missing(n_threads_to_really_use, 0);
+  std::vector<uint64_t> thread_reads(n_threads_to_really_use, 0);
+  std::vector<double> thread_errors(n_threads_to_really_use, 0);
+  int ret;
+  while(0 == (ret = inbam.fillReads())) {
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_really_use) schedule(static,1) reduction(+:n_fail)
+    #endif
+    for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+      pbam1_t read(inbam.supplyRead(i));
+      while(read.validate()) {
+        const uint8_t * q = (const uint8_t *)read.qual();
+        const uint32_t l_seq = read.l_seq();
+        n_fail += check_qual_read(q, l_seq, threshold, window);
+        thread_qc.at(i).add(read);
+        pbam_qual_histogram(q, l_seq, thread_hist.at(i).data());
+
+        const plain_qual p = plain_qual_stats(q, l_seq, threshold, window);
+        if(p.missing) {
+          thread_missing.at(i)++;
+        } else {
+          thread_reads.at(i)++;
+          thread_errors.at(i) += p.expected_errors;
+          for(uint32_t j = 0; j < l_seq; j++) thread_plain_hist.at(i).at(q[j])++;
+        }
+        read = inbam.supplyRead(i);
+      }
+    }
+  }
+  if(ret == -1 || inbam.GetErrorState() == -1) return(-1);
+
+  pbam_qual_qc qc;
+  std::vector<uint64_t> hist(256, 0), plain_hist(256, 0);
+  uint64_t n_missing = 0, n_reads = 0;
+  double errors = 0;
+  for(unsigned int i = 0; i < n_threads_to_really_use; i++) {
+    qc.merge(thread_qc.at(i));
+    for(unsigned int q = 0; q < 256; q++) {
+      hist.at(q) += thread_hist.at(i).at(q);
+      plain_hist.at(q) += thread_plain_hist.at(i).at(q);
+    }
+    n_missing += thread_missing.at(i);
+    n_reads += thread_reads.at(i);
+    errors += thread_errors.at(i);
+  }
+  if(hist != plain_hist) n_fail++;
+  std::vector<uint64_t> qc_hist;
+  qc.histogram(qc_hist);
+  if(qc_hist != plain_hist) n_fail++;
+  if(qc.reads() != n_reads || qc.reads_missing() != n_missing) n_fail++;
+  
+  uint64_t n_bases = 0, sum = 0;
+  int q_min = -1, q_max = 0;
+  for(unsigned int q = 0; q < 256; q++) {
+    if(plain_hist.at(q) == 0) continue;
+    n_bases += plain_hist.at(q);
+    sum += q * plain_hist.at(q);
+    if(q_min < 0) q_min = q;
+    q_max = q;
+  }
+  if(qc.bases() != n_bases) n_fail++;
+  if(!near(qc.mean(), n_bases > 0 ? (double)sum / n_bases : 0)) n_fail++;
+  if(qc.min() != std::max(q_min, 0) || qc.max() != q_max) n_fail++;
+  for(unsigned int t = 0; t <= 256; t += 8) {
+    const uint8_t t8 = (uint8_t)std::min(t, 255u);
+    uint64_t below = 0;
+    for(unsigned int q = 0; q < t8; q++) below += plain_hist.at(q);
+    if(qc.n_below(t8) != below) n_fail++;
+  }
+  if(!near(qc.expected_errors(), errors)) n_fail++;
+  return(n_fail);
+}
@@ -26,22 +26,59 @@ SOFTWARE.  */
 #include <fstream>    // std::ifstream
 
 // [[Rcpp::depends(zlibbioc)]]
-#include <zlib.h>     // For BAM decompression
-#include <zconf.h>
+#ifdef OMPBAM_USE_ZLIBNG
+  #include <zlib-ng.h>  // For BAM decompression (zlib-ng native API)
+#else
+  #include <zlib.h>     // For BAM decompression
+  #include <zconf.h>
+#endif
+
+#ifdef OMPBAM_USE_LIBDEFLATE
+  #include <libdeflate.h> // Optional faster BGZF block decompression
+#endif
 
 #include <string>    
 #include <cstring>    // To compare between strings
 #include <vector>     // For vector types
 #include <iostream>   // For cout
-#include <map>        // For std::map functions in pbam1_t
+#include <map>        // For std::map functions in pbam_index
+#include <algorithm>  // For std::sort
+#include <cmath>      // For pow() in pbam_qual
+#include <unordered_map>  // For pbam_mate_pairer
+#include <chrono>     // For ompBAM_inflate_benchmark()
+#include <thread>     // For pipelined decompression in pbam_in
+#include <type_traits>  // For std::is_trivially_copyable
 
 #ifdef _OPENMP
   #include <omp.h>    // For OpenMP
 #endif
 
+// POSIX file I/O: positional reads (pread) and memory-mapped input
+//   (pbam_in::openFile(..., use_mmap = true))
+#if !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+  #define OMPBAM_HAS_POSIX_IO
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <cerrno>
+  #ifndef OMPBAM_NO_MMAP
+    #define OMPBAM_HAS_MMAP
+  #endif
+#endif
+
 #include "pbam_defs.hpp"
+#include "pbam_inflate.hpp"
+#include "pbam_index.hpp"
+#include "pbam_seq.hpp"
+#include "pbam_cigar.hpp"
 #include "pbam1_t.hpp"
+#include "pbam_view.hpp"
+#include "pbam_qual.hpp"
+#include "pbam_mate_pairer.hpp"
 #include "pbam_in.hpp"
+#include "pbam_multi_in.hpp"
+#include "pbam_merge_in.hpp"
 
 inline void ompBAM_version() {
   std::string version = "0.99.0";
@@ -58,5 +95,97 @@ inline void is_compiled_with_OpenMP() {
   #endif
 }
 
+/*
+  Inflates the BGZF blocks contained in the first max_bytes of the given BAM
+    file using a single thread, once for each compiled-in backend, and prints
+    the decompression throughput (MB/s of decompressed data per core).
+    The throughput of CRC32 verification is printed separately.
+  Returns 0 if success, -1 if the file could not be read.
+*/
+inline int ompBAM_inflate_benchmark(
+    const std::string bam_file, const size_t max_bytes = 100000000
+) {
+  std::ifstream IN(bam_file, std::ios::in | std::ifstream::binary);
+  if(IN.fail()) {
+    cout << "Unable to open " << bam_file << "\n";
+    return(-1);
+  }
+  std::vector<char> buf(max_bytes);
+  IN.read(buf.data(), max_bytes);
+  size_t buf_len = (size_t)IN.gcount();
+  IN.close();
+
+  // Index complete BGZF blocks
+  std::vector<size_t> block_pos;
+  size_t total_out = 0;
+  size_t cursor = 0;
+  uint16_t * u16; uint32_t * u32;
+  while(cursor + 28 <= buf_len) {
+    if(strncmp(bamGzipHead, buf.data() + cursor, bamGzipHeadLength) != 0) break;
+    u16 = (uint16_t*)(buf.data() + cursor + 16);
+    if(cursor + *u16 + 1 > buf_len) break;
+    u32 = (uint32_t*)(buf.data() + cursor + *u16 + 1 - 4);
+    if(*u32 > 0) {
+      block_pos.push_back(cursor);
+      total_out += *u32;
+    }
+    cursor += *u16 + 1;
+  }
+  if(block_pos.size() == 0) {
+    cout << "No BGZF blocks found in " << bam_file << "\n";
+    return(-1);
+  }
+
+  std::vector<char> dest(65536);
+  const int backends[2] = {PBAM_INFLATE_ZLIB, PBAM_INFLATE_LIBDEFLATE};
+  cout << "Inflating " << block_pos.size() << " BGZF blocks ("
+    << total_out / 1000000.0 << " MB) using 1 thread\n";
+  for(unsigned int b = 0; b < 2; b++) {
+    if(!pbam_inflate_available(backends[b])) continue;
+    pbam_inflater inf;
+    if(inf.init(backends[b]) != 0) continue;
+    
+    std::chrono::steady_clock::time_point start = 
+      std::chrono::steady_clock::now();
+    bool error_occurred = false;
+    for(size_t i = 0; i < block_pos.size() && !error_occurred; i++) {
+      char * src = buf.data() + block_pos.at(i);
+      u16 = (uint16_t*)(src + 16);
+      u32 = (uint32_t*)(src + *u16 + 1 - 4);
+      if(inf.inflate_block(src, *u16 + 1, dest.data(), *u32, false) != 0) {
+        error_occurred = true;
+      }
+    }
+    double secs = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    if(error_occurred) {
+      cout << pbam_inflate_name(backends[b]) << ":\tdecompression failed\n";
+    } else {
+      cout << pbam_inflate_name(backends[b]) << ":\t"
+        << (total_out / 1000000.0) / secs << " MB/s per core\n";
+    }
+  }
+
+  // CRC32 throughput, over a buffer the size of each decompressed block
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  volatile uint32_t crc = 0;
+  for(size_t i = 0; i < block_pos.size(); i++) {
+    char * src = buf.data() + block_pos.at(i);
+    u16 = (uint16_t*)(src + 16);
+    u32 = (uint32_t*)(src + *u16 + 1 - 4);
+    crc = crc ^ pbam_crc32(dest.data(), *u32);
+  }
+  double secs = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  #ifdef OMPBAM_X86_SIMD
+  std::string crc_kernel = pbam_cpu_has_pclmul() ? "pclmul" : "zlib";
+  #else
+  std::string crc_kernel = "zlib";
+  #endif
+  cout << "crc32 (" << crc_kernel << "):\t" 
+    << (total_out / 1000000.0) / secs << " MB/s per core\n";
+  return(0);
+}
+
 #endif
 
@@ -37,11 +37,40 @@ struct pbam_core_32{
   int32_t tlen;
 };
 
+/*
+  A 2-character tag name, held as a 16-bit key (its two bytes in BAM order).
+  - Tag getters take a pbam_tag_key, which converts from "NH" or a std::string
+  - pbam_tag<'N','H'>() gives the key of "NH" at compile time, e.g.:
+      static const pbam_tag<'C','B'> CB;
+      read.tagVal_Z(CB, barcode);
+  - Tag names that are not 2 characters long give a key that matches no tag
+*/
+struct pbam_tag_key{
+  uint16_t key;
+  
+  pbam_tag_key(const char * tag) {
+    key = (tag && tag[0] && tag[1] && !tag[2]) ? 
+      (uint16_t)((uint8_t)tag[0] | ((uint8_t)tag[1] << 8)) : 0;
+  };
+  pbam_tag_key(const std::string & tag) {
+    key = tag.size() == 2 ? 
+      (uint16_t)((uint8_t)tag[0] | ((uint8_t)tag[1] << 8)) : 0;
+  };
+  explicit pbam_tag_key(const uint16_t tag_key) : key(tag_key) {};
+};
+
+template<char c1, char c2>
+struct pbam_tag : public pbam_tag_key{
+  static const uint16_t value = (uint16_t)((uint8_t)c1 | ((uint8_t)c2 << 8));
+  pbam_tag() : pbam_tag_key(value) {};
+};
+
 // Tag type: acCsSiIfZB
-// B Tag subtype: cCsSiIf
-// Number of bytes from beginning of read_buffer
+// B Tag subtype: cCsSiIf ('\0' for other types)
 // Number of bytes from beginning of read_buffer
+// Number of values (for Z tags, the string length including its '\0')
 struct pbam_tag_index{
+  uint16_t key;
   char type;       
   char subtype;    
   uint32_t tag_pos;   
@@ -49,27 +78,33 @@ struct pbam_tag_index{
 };
 
 class pbam1_t{
+  friend class pbam_view;
   private:
     // Variables
     char * read_buffer;
     bool realized = false;
     pbam_core_32 * core;
     uint32_t block_size_val; uint32_t tag_size_val;
-    std::map< std::string, pbam_tag_index > tag_index;
+
+    // Tag index: the first pbamTagIndexSize tags of the read, built on the
+    //   first tag query. Tags past these are found by scanning the tag data
+    pbam_tag_index tag_index[pbamTagIndexSize];
+    uint32_t tag_index_n = 0;       // Number of tags in the index
+    uint32_t tag_index_end = 0;     // Position after the last indexed tag
+    bool tag_index_built = false;
+    pbam_tag_index tag_found;       // Holds a tag found past the index
     
     // Internal Functions
     void reset();
     
-    void seq_to_str(const uint8_t val, std::string & dest);
     char cigar_op_to_char(uint32_t cigar_op);
+    bool cigar_in_tag();
     void cigar_to_str(const uint32_t val, std::string & dest);
     
+    uint32_t tag_start();
+    uint32_t read_tag(const uint32_t tag_pos, pbam_tag_index & entry);
     void build_tag_index();
-    
-    char search_tag_type(const std::string tag);
-    char search_tag_subtype(const std::string tag);
-    uint32_t search_tag_pos(const std::string tag);
-    uint32_t search_tag_length(const std::string tag);
+    const pbam_tag_index * search_tag(const uint16_t key);
   public:
     pbam1_t();
     ~pbam1_t();
@@ -118,6 +153,11 @@ class pbam1_t{
     // For long reads, the cigar is stored as a "CG" tag of type B,I
     // If "CG" tag exists, return its length; otherwise return n_cigar_op
     uint32_t cigar_size();
+
+    // Fills geom with the reference span, aligned blocks, junctions and
+    //   clips of the alignment (using the "CG" tag for long reads)
+    // - Returns cigar_size() if success, or 0 if fail to validate
+    int cigar_geometry(pbam_cigar_geometry & geom);
     
     /* 
       Buffer-based getters for variable-length data:
@@ -126,6 +166,7 @@ class pbam1_t{
       - Be careful not to use these pointers to write to the read buffer
           otherwise you may corrupt the data.
     */
+    char * record();                        // Whole record, from block_size
     char * read_name();                     // Direct char pointer
     uint32_t * cigar();                     // Direct uint32_t pointer
     uint8_t * seq();                        // Direct uint8_t pointer       
@@ -162,6 +203,16 @@ class pbam1_t{
     // - Returns length of sequence if success, or zero if fail to validate
     int seq(std::string & dest);
 
+    // Writes the read sequence to a buffer of at least l_seq() chars
+    //   (not terminated by '\0')
+    // - Returns length of sequence if success, or zero if fail to validate
+    int seq(char * dest);
+
+    // As seq(), but gives the reverse complement of the read sequence
+    //   (e.g. to recover the original sequence of reverse-strand reads)
+    int seq_revcomp(std::string & dest);
+    int seq_revcomp(char * dest);
+
     // Returns a vector of uint8_t of per-base quality scores
     // - returns l_seq if success or 0 if fail
     int qual(std::vector<uint8_t> & dest); 
@@ -192,41 +243,48 @@ class pbam1_t{
     // - Tag_Size() returns 0 if the tag doesn't exist
     // - Tag_Type() returns '\0' if the tag doesn't exist
     // - Tag_Subtype() returns '\0' if the tag doesn't exist or is not of type 'B'
-    char Tag_Type(const std::string tag);
-    char Tag_Subtype(const std::string tag);
-    uint32_t Tag_Size(const std::string tag);
+    char Tag_Type(const pbam_tag_key tag);
+    char Tag_Subtype(const pbam_tag_key tag);
+    uint32_t Tag_Size(const pbam_tag_key tag);
 
     // Returns the SAM tag type. A = char, i = integer, f = float, Z = string, B = vector
-    char Tag_Type_SAM(const std::string tag);
+    char Tag_Type_SAM(const pbam_tag_key tag);
     
     // Returns raw char pointer to the beginning of the info stored by the tag
     // - For advanced users
-    char * p_tagVal(const std::string tag);
+    char * p_tagVal(const pbam_tag_key tag);
+
+    // Looks up n_tags tags in a single pass over the read's tags. Sets
+    //   tag_ptrs[i] as p_tagVal(tags[i]), or NULL if the read has no such tag
+    // - If tag_types is given, sets tag_types[i] as Tag_Type(tags[i])
+    // - Returns the number of tags found
+    int p_tagVals(const pbam_tag_key * tags, const unsigned int n_tags,
+      char ** tag_ptrs, char * tag_types = NULL);
 
     // Returns values of fixed length
     // - For tags of type AcCsSiIf
     // Returns '\0' or 0 if fail
-    char tagVal_A(const std::string tag);   
-    int8_t tagVal_c(const std::string tag);
-    uint8_t tagVal_C(const std::string tag);
-    int16_t tagVal_s(const std::string tag);
-    uint16_t tagVal_S(const std::string tag);
-    int32_t tagVal_i(const std::string tag);
-    uint32_t tagVal_I(const std::string tag);
-    float tagVal_f(const std::string tag);
+    char tagVal_A(const pbam_tag_key tag);   
+    int8_t tagVal_c(const pbam_tag_key tag);
+    uint8_t tagVal_C(const pbam_tag_key tag);
+    int16_t tagVal_s(const pbam_tag_key tag);
+    uint16_t tagVal_S(const pbam_tag_key tag);
+    int32_t tagVal_i(const pbam_tag_key tag);
+    uint32_t tagVal_I(const pbam_tag_key tag);
+    float tagVal_f(const pbam_tag_key tag);
 
     // Returns a Z-tag by reference to a string. 
-    int tagVal_Z(const std::string tag, std::string & dest);    // 'Z'
+    int tagVal_Z(const pbam_tag_key tag, std::string & dest);    // 'Z'
 
     // Returns a B-tag by reference to its respective type
     // Returns tag length of string if success, -1 if fail
-    int tagVal_B(const std::string tag, std::vector<int8_t> & dest);   // 'B, c'
-    int tagVal_B(const std::string tag, std::vector<uint8_t> & dest);    // 'B, C'
-    int tagVal_B(const std::string tag, std::vector<int16_t> & dest);    // 'B, s'
-    int tagVal_B(const std::string tag, std::vector<uint16_t> & dest);   // 'B, S'
-    int tagVal_B(const std::string tag, std::vector<int32_t> & dest);    // 'B, i'
-    int tagVal_B(const std::string tag, std::vector<uint32_t> & dest);   // 'B, I'
-    int tagVal_B(const std::string tag, std::vector<float> & dest);      // 'B, f'
+    int tagVal_B(const pbam_tag_key tag, std::vector<int8_t> & dest);   // 'B, c'
+    int tagVal_B(const pbam_tag_key tag, std::vector<uint8_t> & dest);    // 'B, C'
+    int tagVal_B(const pbam_tag_key tag, std::vector<int16_t> & dest);    // 'B, s'
+    int tagVal_B(const pbam_tag_key tag, std::vector<uint16_t> & dest);   // 'B, S'
+    int tagVal_B(const pbam_tag_key tag, std::vector<int32_t> & dest);    // 'B, i'
+    int tagVal_B(const pbam_tag_key tag, std::vector<uint32_t> & dest);   // 'B, I'
+    int tagVal_B(const pbam_tag_key tag, std::vector<float> & dest);      // 'B, f'
 };
 
 #include "pbam1_t_constructors.hpp"
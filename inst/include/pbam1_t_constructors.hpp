@@ -109,8 +109,8 @@ inline pbam1_t::pbam1_t(char * src, bool realize) {
         core->l_read_name + core->n_cigar_op * 4 + 
         core->l_seq + ((core->l_seq + 1) / 2));
     if(realize) {
-      read_buffer = (char*)malloc(block_size_val + 1);
-      memcpy(read_buffer, src, block_size_val);      
+      read_buffer = (char*)malloc(block_size_val + 5);
+      memcpy(read_buffer, src, block_size_val + 4);
       realized = true;
     } else {
       read_buffer = src;
@@ -132,6 +132,7 @@ inline void pbam1_t::reset() {
   realized = false;
   core = NULL;
   block_size_val = 0;   tag_size_val = 0;
+  tag_index_built = false;
 }
 
 
@@ -139,8 +140,8 @@ inline void pbam1_t::reset() {
 inline pbam1_t::pbam1_t(const pbam1_t &t) {
   if(t.isReal()) {
     if(t.validate()) {
-      read_buffer = (char*)malloc(t.block_size_val + 1);
-      memcpy(read_buffer, t.read_buffer, t.block_size_val);
+      read_buffer = (char*)malloc(t.block_size_val + 5);
+      memcpy(read_buffer, t.read_buffer, t.block_size_val + 4);
       block_size_val = t.block_size_val;
       tag_size_val = t.tag_size_val;
       core = (pbam_core_32*)(read_buffer + 4);
@@ -169,10 +170,12 @@ inline pbam1_t & pbam1_t::operator = (const pbam1_t &t)
 {
   // Check for self assignment
   if(this != &t) {
+    // Frees any realized read, and drops the tag index of the previous read
+    reset();
     if(t.isReal()) {
       if(t.validate()) {
-        read_buffer = (char*)malloc(t.block_size_val + 1);
-        memcpy(read_buffer, t.read_buffer, t.block_size_val);
+        read_buffer = (char*)malloc(t.block_size_val + 5);
+        memcpy(read_buffer, t.read_buffer, t.block_size_val + 4);
         block_size_val = t.block_size_val;
         tag_size_val = t.tag_size_val;
         core = (pbam_core_32*)(read_buffer + 4);
@@ -77,22 +77,18 @@ inline int32_t pbam1_t::tlen(){
 // If "CG" tag exists, return its length; otherwise return n_cigar_op
 inline uint32_t pbam1_t::cigar_size() {
   if(!validate()) return(0);
-  if(core->n_cigar_op == 2) {
-    uint32_t* c1 = (uint32_t*)(read_buffer + 36 + core->l_read_name);
-    uint32_t* c2 = (uint32_t*)(read_buffer + 40 + core->l_read_name);
-    if(
-      cigar_op_to_char(*c1) == 'S' &&
-      cigar_op_to_char(*c2) == 'N' &&
-      *c1 >> 4 == core->l_seq
-    ) {
-      uint32_t size = search_tag_length("CG");
-      if(size > 65535) return(size);
-      return(0);
-    }
-  }
+  if(cigar_in_tag()) return(Tag_Size(pbam_tag<'C','G'>()));
   return((uint32_t)core->n_cigar_op);
 }
 
+inline int pbam1_t::cigar_geometry(pbam_cigar_geometry & geom) {
+  geom.clear();
+  if(!validate()) return(0);
+  uint32_t size = cigar_size();
+  geom.build(cigar(), size, core->pos);
+  return(size);
+}
+
 // ************************** Buffer-based  Getters ****************************
 /* 
   Buffer-based getters for variable-length data:
@@ -102,6 +98,12 @@ inline uint32_t pbam1_t::cigar_size() {
       otherwise you may corrupt the data.
 */
 
+// The record is block_size() + 4 bytes long, as stored in the BAM file
+inline char * pbam1_t::record() {
+  if(validate()) return(read_buffer);
+  return(NULL);
+}
+
 inline char * pbam1_t::read_name() {
   if(validate()) return((char*)(read_buffer + 36));
   return(NULL);
@@ -109,7 +111,7 @@ inline char * pbam1_t::read_name() {
 
 inline uint32_t * pbam1_t::cigar() {
   if(validate()) {
-    if(cigar_size() > 65535) return((uint32_t*)p_tagVal("CG"));
+    if(cigar_in_tag()) return((uint32_t*)p_tagVal(pbam_tag<'C','G'>()));
     return((uint32_t*)(read_buffer + 36 + core->l_read_name));
   }
   return(NULL);
@@ -196,19 +198,28 @@ inline int pbam1_t::cigar_ops_and_vals(
 inline int pbam1_t::seq(std::string & dest) {
   dest.clear();
   if(!validate())  return(0);
-  
-  uint8_t *tmp = (uint8_t *)(
-    read_buffer + 36 + core->l_read_name + sizeof(uint32_t) * core->n_cigar_op);
-  uint8_t val;
-  for(unsigned int i = 0; i < core->l_seq; i++) {
-    if(i % 2 == 0) {
-      val = *tmp >> 4;
-    } else {
-      val = *tmp % 16;
-      tmp++;
-    }
-    seq_to_str(val, dest);
-  }
+  dest.resize(core->l_seq);
+  if(core->l_seq > 0) pbam_seq_decode(seq(), core->l_seq, &dest[0]);
+  return(core->l_seq);
+}
+
+inline int pbam1_t::seq(char * dest) {
+  if(!validate())  return(0);
+  pbam_seq_decode(seq(), core->l_seq, dest);
+  return(core->l_seq);
+}
+
+inline int pbam1_t::seq_revcomp(std::string & dest) {
+  dest.clear();
+  if(!validate())  return(0);
+  dest.resize(core->l_seq);
+  if(core->l_seq > 0) pbam_seq_revcomp(seq(), core->l_seq, &dest[0]);
+  return(core->l_seq);
+}
+
+inline int pbam1_t::seq_revcomp(char * dest) {
+  if(!validate())  return(0);
+  pbam_seq_revcomp(seq(), core->l_seq, dest);
   return(core->l_seq);
 }
 
@@ -220,10 +231,7 @@ inline int pbam1_t::qual(std::vector<uint8_t> & dest) {
       (sizeof(uint32_t) * core->n_cigar_op) + 
       ((core->l_seq + 1) / 2)
   );
-  for(unsigned int i = 0; i < core->l_seq; i++) {
-    dest.push_back(*tmp);
-    tmp++;
-  }
+  dest.assign(tmp, tmp + core->l_seq);
   return(core->l_seq);
 }
 
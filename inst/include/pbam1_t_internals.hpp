@@ -25,53 +25,15 @@ SOFTWARE.  */
 
 // ################################ INTERNAL FUNCTIONS #########################
 
-// void seq_to_str(const uint8_t val, std::string & dest);
 // void cigar_op_to_str(uint32_t cigar_op, std::string & dest);
 // void cigar_to_str(const uint32_t val, std::string & dest);
 
-// void build_tag_index();
+// bool cigar_in_tag();
 
-// char search_tag_type(const std::string tag);
-// char search_tag_subtype(const std::string tag);
-// uint32_t search_tag_pos(const std::string tag);
-// uint32_t search_tag_length(const std::string tag);
-
-inline void pbam1_t::seq_to_str(uint8_t val, std::string & dest) {
-  switch(val) {
-    case 1:
-      dest.append("A"); break;
-    case 2:
-      dest.append("C"); break;
-    case 4:
-      dest.append("G"); break;
-    case 8:
-      dest.append("T"); break;
-    case 15:
-      dest.append("N"); break;
-    case 3:
-      dest.append("M"); break;
-    case 5:
-      dest.append("R"); break;
-    case 6:
-      dest.append("S"); break;
-    case 7:
-      dest.append("V"); break;
-    case 9:
-      dest.append("W"); break;
-    case 10:
-      dest.append("Y"); break;
-    case 11:
-      dest.append("H"); break;
-    case 12:
-      dest.append("K"); break;
-    case 13:
-      dest.append("D"); break;
-    case 14:
-      dest.append("B"); break;
-    case 0:
-      dest.append("="); break;        
-  }
-}
+// uint32_t tag_start();
+// uint32_t read_tag(const uint32_t tag_pos, pbam_tag_index & entry);
+// void build_tag_index();
+// const pbam_tag_index * search_tag(const uint16_t key);
 
 // cigar_op ~ [0,8]
 inline char pbam1_t::cigar_op_to_char(uint32_t cigar_op) {
@@ -100,6 +62,23 @@ inline char pbam1_t::cigar_op_to_char(uint32_t cigar_op) {
   return('\0');
 }
 
+// Long reads with > 65535 operations have a placeholder cigar of kSmN, where
+//   k = l_seq, with the real cigar in a "CG" tag of type B,I
+inline bool pbam1_t::cigar_in_tag() {
+  if(core->n_cigar_op != 2) return(false);
+  uint32_t* c1 = (uint32_t*)(read_buffer + 36 + core->l_read_name);
+  uint32_t* c2 = (uint32_t*)(read_buffer + 40 + core->l_read_name);
+  if(
+    cigar_op_to_char(*c1 & 15) == 'S' &&
+    cigar_op_to_char(*c2 & 15) == 'N' &&
+    *c1 >> 4 == core->l_seq
+  ) {
+    const pbam_tag_index * entry = search_tag(pbam_tag<'C','G'>::value);
+    return(entry && entry->type == 'B' && entry->subtype == 'I');
+  }
+  return(false);
+}
+
 inline void pbam1_t::cigar_to_str(uint32_t val, std::string & dest) {
   uint32_t len = val >> 4;
   uint32_t cigar_op = val & 15;
@@ -109,112 +88,117 @@ inline void pbam1_t::cigar_to_str(uint32_t val, std::string & dest) {
   }
 }
 
-// The first time any tag is queried, run this to index every tag
-inline void pbam1_t::build_tag_index() {  
-
-  if(tag_index.size() == 0 && tag_size_val > 0) {
-  // Ensures tag index is only built once and only when needed
-
-    char null = '\0';
-    uint32_t tag_pos = (36 + 
-      core->l_read_name + 
-      core->n_cigar_op * 4 + 
-      ((core->l_seq + 1) / 2) +
-      core->l_seq
-    );
-    
-    pbam_tag_index tag_index_entry;
-    char *byte; 
-    uint32_t tag_length;
-    
-    while(tag_pos < block_size_val + 4) {
-      std::string tag_name(read_buffer + tag_pos, 2);
-      tag_index_entry.tag_pos = tag_pos;
-      tag_index_entry.type = *(read_buffer + tag_pos + 2);
-      if(tag_index_entry.type == 'B') {
-        tag_index_entry.subtype = *(read_buffer + tag_pos + 3);
-      }
-
-      // Calculate tag length
-      tag_length = 0;
-      switch(tag_index_entry.type) {
-        case 'A': case 'c': case 'C': case 's': case 'S': case 'i': case 'I': case 'f':
-          tag_length = 1; break;
-        case 'Z':
-          tag_length = 1;
-          byte = read_buffer + tag_pos + 2 + tag_length;
-          while(strncmp(&null, byte, 1) != 0) {
-            tag_length++; 
-            byte++;
-          }
-          break;
-        case 'B':
-          tag_length = *((uint32_t*)(read_buffer + tag_pos + 4)); break;
-      }
-      tag_index_entry.tag_length = tag_length;
-      tag_index.insert({tag_name, tag_index_entry});
+// Position of the first tag, after the read's qualities
+inline uint32_t pbam1_t::tag_start() {
+  return(36 + 
+    core->l_read_name + 
+    core->n_cigar_op * 4 + 
+    ((core->l_seq + 1) / 2) +
+    core->l_seq
+  );
+}
 
-      // Increment tag_pos for next entry:
-      switch(tag_index_entry.type) {
-        case 'A': case 'c': case 'C':
-          tag_pos += 4; break;
+// Reads the tag at tag_pos into entry
+// - Returns the position of the next tag, or 0 if the tag is of an unknown
+//     type or runs past the end of the read
+inline uint32_t pbam1_t::read_tag(const uint32_t tag_pos, pbam_tag_index & entry) {
+  const uint32_t end = block_size_val + 4;
+  if(tag_pos + 3 > end) return(0);
+  const char * tag = read_buffer + tag_pos;
+  entry.key = (uint16_t)((uint8_t)tag[0] | ((uint8_t)tag[1] << 8));
+  entry.type = tag[2];
+  entry.subtype = '\0';
+  entry.tag_pos = tag_pos;
+  entry.tag_length = 1;
+  
+  uint64_t next_pos = 0;
+  switch(entry.type) {
+    case 'A': case 'c': case 'C':
+      next_pos = tag_pos + 4; break;
+    case 's': case 'S':
+      next_pos = tag_pos + 5; break;
+    case 'i': case 'I': case 'f':
+      next_pos = tag_pos + 7; break;
+    case 'Z': {
+      const char * str_end = (const char *)memchr(tag + 3, '\0', end - tag_pos - 3);
+      if(!str_end) return(0);
+      // Length includes the terminating '\0'
+      entry.tag_length = (uint32_t)(str_end - tag) - 2;
+      next_pos = tag_pos + 3 + entry.tag_length;
+      break;
+    }
+    case 'B': {
+      if(tag_pos + 8 > end) return(0);
+      entry.subtype = tag[3];
+      memcpy(&entry.tag_length, tag + 4, sizeof(uint32_t));
+      uint64_t elem_size = 0;
+      switch(entry.subtype) {
+        case 'c': case 'C':
+          elem_size = 1; break;
         case 's': case 'S':
-          tag_pos += 5; break;
+          elem_size = 2; break;
         case 'i': case 'I': case 'f':
-          tag_pos += 7; break;
-        case 'Z':
-          tag_pos += 3 + tag_index_entry.tag_length;
-          break;
-        case 'B':
-          switch(tag_index_entry.subtype) {
-            case 'c': case 'C':
-              tag_pos += 8 + tag_index_entry.tag_length; break;
-            case 's': case 'S':
-              tag_pos += 8 + tag_index_entry.tag_length * 2; break;
-            case 'i': case 'I': case 'f':
-              tag_pos += 8 + tag_index_entry.tag_length * 4; break;
-          }
-          break;
+          elem_size = 4; break;
         default:
-          tag_pos = block_size_val + 4;
-          cout << "Tag error - type " << std::string(1, tag_index_entry.type) 
-            << "for tag" << tag_name << "not defined\n";
+          return(0);
       }
-    } // End of while loop to iterate over every tag
+      next_pos = tag_pos + 8 + elem_size * entry.tag_length;
+      break;
+    }
+    default:
+      return(0);
   }
+  if(next_pos > end) return(0);
+  return((uint32_t)next_pos);
 }
 
-inline char pbam1_t::search_tag_type(const std::string tag){
-  if(tag_size_val == 0) return('\0');
-  build_tag_index();
-  std::map< std::string, pbam_tag_index >::iterator it = tag_index.find(tag);
-  if (it == tag_index.end()) return('\0');
-  return(tag_index[tag].type);
-}
-
-inline char pbam1_t::search_tag_subtype(const std::string tag){
-  if(tag_size_val == 0) return('\0');
-  build_tag_index();
-  std::map< std::string, pbam_tag_index >::iterator it = tag_index.find(tag);
-  if (it == tag_index.end()) return('\0');
-  return(tag_index[tag].subtype);
-}
-
-inline uint32_t pbam1_t::search_tag_pos(const std::string tag) {
-  if(tag_size_val == 0) return(0);
-  build_tag_index();
-  std::map< std::string, pbam_tag_index >::iterator it = tag_index.find(tag);
-  if (it == tag_index.end()) return(0);
-  return(tag_index[tag].tag_pos);
+// The first time any tag is queried, run this to index the first 
+//   pbamTagIndexSize tags
+inline void pbam1_t::build_tag_index() {  
+  if(tag_index_built) return;
+  tag_index_built = true;
+  tag_index_n = 0;
+  tag_index_end = block_size_val + 4;
+  if(tag_size_val == 0) return;
+
+  uint32_t tag_pos = tag_start();
+  while(tag_pos < block_size_val + 4) {
+    if(tag_index_n == pbamTagIndexSize) {
+      // Remaining tags are found by search_tag() 
+      tag_index_end = tag_pos;
+      return;
+    }
+    pbam_tag_index & entry = tag_index[tag_index_n];
+    uint32_t next_pos = read_tag(tag_pos, entry);
+    if(next_pos == 0) {
+      cout << "Tag error - type " << std::string(1, *(read_buffer + tag_pos + 2)) 
+        << " for tag " << std::string(read_buffer + tag_pos, 2) 
+        << " not defined\n";
+      return;
+    }
+    tag_index_n++;
+    tag_pos = next_pos;
+  }
 }
 
-inline uint32_t pbam1_t::search_tag_length(const std::string tag) {
-  if(tag_size_val == 0) return(0);
+// Returns the index entry of the first tag with the given key, or NULL if
+//   the read has no such tag
+inline const pbam_tag_index * pbam1_t::search_tag(const uint16_t key) {
+  if(tag_size_val == 0) return(NULL);
   build_tag_index();
-  std::map< std::string, pbam_tag_index >::iterator it = tag_index.find(tag);
-  if (it == tag_index.end()) return(0);
-  return(tag_index[tag].tag_length);
+  for(uint32_t i = 0; i < tag_index_n; i++) {
+    if(tag_index[i].key == key) return(&tag_index[i]);
+  }
+  
+  // Scan tags past the index
+  uint32_t tag_pos = tag_index_end;
+  while(tag_pos < block_size_val + 4) {
+    uint32_t next_pos = read_tag(tag_pos, tag_found);
+    if(next_pos == 0) return(NULL);
+    if(tag_found.key == key) return(&tag_found);
+    tag_pos = next_pos;
+  }
+  return(NULL);
 }
 
-
 #endif
\ No newline at end of file
@@ -25,30 +25,46 @@ SOFTWARE.  */
 
 // TAGS:
 
+// Lists tag names in alphabetical order, each once
 inline int pbam1_t::AvailTags(std::vector<std::string> & tags) {
   tags.clear();
+  if(tag_size_val == 0) return(0);
   build_tag_index();
-  for(std::map< std::string, pbam_tag_index >::iterator tagmap = tag_index.begin(); 
-      tagmap != tag_index.end(); tagmap++) {
-    tags.push_back(tagmap->first);
+  for(uint32_t i = 0; i < tag_index_n; i++) {
+    tags.push_back(std::string(read_buffer + tag_index[i].tag_pos, 2));
   }
-  return(tag_index.size());
+  uint32_t tag_pos = tag_index_end;
+  while(tag_pos < block_size_val + 4) {
+    uint32_t next_pos = read_tag(tag_pos, tag_found);
+    if(next_pos == 0) break;
+    tags.push_back(std::string(read_buffer + tag_pos, 2));
+    tag_pos = next_pos;
+  }
+  std::sort(tags.begin(), tags.end());
+  tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+  return(tags.size());
 }
 
-inline char pbam1_t::Tag_Type(const std::string tag) {
-  return(search_tag_type(tag));
+inline char pbam1_t::Tag_Type(const pbam_tag_key tag) {
+  const pbam_tag_index * entry = search_tag(tag.key);
+  if(!entry) return('\0');
+  return(entry->type);
 }
 
-inline char pbam1_t::Tag_Subtype(const std::string tag) {
-  return(search_tag_subtype(tag));
+inline char pbam1_t::Tag_Subtype(const pbam_tag_key tag) {
+  const pbam_tag_index * entry = search_tag(tag.key);
+  if(!entry) return('\0');
+  return(entry->subtype);
 }
 
-inline uint32_t pbam1_t::Tag_Size(const std::string tag) {
-  return(search_tag_length(tag));
+inline uint32_t pbam1_t::Tag_Size(const pbam_tag_key tag) {
+  const pbam_tag_index * entry = search_tag(tag.key);
+  if(!entry) return(0);
+  return(entry->tag_length);
 }
 
-inline char pbam1_t::Tag_Type_SAM(const std::string tag) {
-  char type = search_tag_type(tag);
+inline char pbam1_t::Tag_Type_SAM(const pbam_tag_key tag) {
+  char type = Tag_Type(tag);
   switch(type) {
     case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
       return('i');
@@ -60,260 +76,260 @@ inline char pbam1_t::Tag_Type_SAM(const std::string tag) {
 // Return a char pointer to the raw value contained in the tag
 // - The user should typecast the pointer before getting the proper value
 // - for advanced users only
-inline char * pbam1_t::p_tagVal(const std::string tag) {
+inline char * pbam1_t::p_tagVal(const pbam_tag_key tag) {
   if(validate()) {
-    char type = search_tag_type(tag);
-    uint32_t tag_pos = search_tag_pos(tag);
-    switch(type) {
-      case 'A': case 'c': case 'C': case 's': case 'S': case 'i': case 'I': case 'f': case 'Z':
-        return(read_buffer + tag_pos + 3);
-      case 'B':
-        // User's responsibility to obtain length of this buffer
-        return(read_buffer + tag_pos + 8);
-      default:
-        return(NULL);
-    }
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(!entry) return(NULL);
+    // For B tags, it is the user's responsibility to obtain the length
+    return(read_buffer + entry->tag_pos + (entry->type == 'B' ? 8 : 3));
   }
   return(NULL);
 }
 
-inline char pbam1_t::tagVal_A(const std::string tag) {
+// Walks the tags once, matching each against all the queried tags
+inline int pbam1_t::p_tagVals(const pbam_tag_key * tags, 
+    const unsigned int n_tags, char ** tag_ptrs, char * tag_types) {
+  for(unsigned int i = 0; i < n_tags; i++) {
+    tag_ptrs[i] = NULL;
+    if(tag_types) tag_types[i] = '\0';
+  }
+  if(!validate() || tag_size_val == 0) return(0);
+
+  unsigned int n_found = 0;
+  pbam_tag_index entry;
+  uint32_t tag_pos = tag_start();
+  while(tag_pos < block_size_val + 4 && n_found < n_tags) {
+    uint32_t next_pos = read_tag(tag_pos, entry);
+    if(next_pos == 0) break;
+    for(unsigned int i = 0; i < n_tags; i++) {
+      if(!tag_ptrs[i] && tags[i].key == entry.key) {
+        tag_ptrs[i] = read_buffer + tag_pos + (entry.type == 'B' ? 8 : 3);
+        if(tag_types) tag_types[i] = entry.type;
+        n_found++;
+      }
+    }
+    tag_pos = next_pos;
+  }
+  return(n_found);
+}
+
+inline char pbam1_t::tagVal_A(const pbam_tag_key tag) {
   if(validate()) {
-    if(search_tag_type(tag) == 'A') {
-      uint32_t tag_pos = search_tag_pos(tag);
-      return(*(read_buffer + tag_pos + 3));
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'A') {
+      char val;
+      memcpy(&val, read_buffer + entry->tag_pos + 3, sizeof(char));
+      return(val);
     }
   }
   return('\0');
 }
 
-inline int8_t pbam1_t::tagVal_c(const std::string tag) {
+inline int8_t pbam1_t::tagVal_c(const pbam_tag_key tag) {
   if(validate()) {
-    if(search_tag_type(tag) == 'c') {
-      int8_t tag_pos = search_tag_pos(tag);
-      char * tmp = read_buffer + tag_pos + 3;
-      return(*(int8_t*)tmp);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'c') {
+      int8_t val;
+      memcpy(&val, read_buffer + entry->tag_pos + 3, sizeof(int8_t));
+      return(val);
     }
   }
   return(0);
 }
 
-inline uint8_t pbam1_t::tagVal_C(const std::string tag) {
+inline uint8_t pbam1_t::tagVal_C(const pbam_tag_key tag) {
   if(validate()) {
-    if(search_tag_type(tag) == 'C') {
-      uint32_t tag_pos = search_tag_pos(tag);
-      char * tmp = read_buffer + tag_pos + 3;
-      return(*(uint8_t*)tmp);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'C') {
+      uint8_t val;
+      memcpy(&val, read_buffer + entry->tag_pos + 3, sizeof(uint8_t));
+      return(val);
     }
   }
   return(0);
 }
 
-inline int16_t pbam1_t::tagVal_s(const std::string tag) {
+inline int16_t pbam1_t::tagVal_s(const pbam_tag_key tag) {
   if(validate()) {
-    if(search_tag_type(tag) == 's') {
-      uint32_t tag_pos = search_tag_pos(tag);
-      char * tmp = read_buffer + tag_pos + 3;
-      return(*(int16_t*)tmp);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 's') {
+      int16_t val;
+      memcpy(&val, read_buffer + entry->tag_pos + 3, sizeof(int16_t));
+      return(val);
     }
   }
   return(0);
 }
 
-
-inline uint16_t pbam1_t::tagVal_S(const std::string tag) {
+inline uint16_t pbam1_t::tagVal_S(const pbam_tag_key tag) {
   if(validate()) {
-    if(search_tag_type(tag) == 'S') {
-      uint32_t tag_pos = search_tag_pos(tag);
-      char * tmp = read_buffer + tag_pos + 3;
-      return(*(uint16_t*)tmp);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'S') {
+      uint16_t val;
+      memcpy(&val, read_buffer + entry->tag_pos + 3, sizeof(uint16_t));
+      return(val);
     }
   }
   return(0);
 }
 
-
-inline int32_t pbam1_t::tagVal_i(const std::string tag) {
+inline int32_t pbam1_t::tagVal_i(const pbam_tag_key tag) {
   if(validate()) {
-    if(search_tag_type(tag) == 'i') {
-      uint32_t tag_pos = search_tag_pos(tag);
-      char * tmp = read_buffer + tag_pos + 3;
-      return(*(int32_t*)tmp);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'i') {
+      int32_t val;
+      memcpy(&val, read_buffer + entry->tag_pos + 3, sizeof(int32_t));
+      return(val);
     }
   }
   return(0);
 }
 
-
-inline uint32_t pbam1_t::tagVal_I(const std::string tag) {
+inline uint32_t pbam1_t::tagVal_I(const pbam_tag_key tag) {
   if(validate()) {
-    if(search_tag_type(tag) == 'I') {
-      uint32_t tag_pos = search_tag_pos(tag);
-      char * tmp = read_buffer + tag_pos + 3;
-      return(*(uint32_t*)tmp);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'I') {
+      uint32_t val;
+      memcpy(&val, read_buffer + entry->tag_pos + 3, sizeof(uint32_t));
+      return(val);
     }
   }
   return(0);
 }
 
-
-inline float pbam1_t::tagVal_f(const std::string tag) {
+inline float pbam1_t::tagVal_f(const pbam_tag_key tag) {
   if(validate()) {
-    if(search_tag_type(tag) == 'f') {
-      uint32_t tag_pos = search_tag_pos(tag);
-      char * tmp = read_buffer + tag_pos + 3;
-      return(*(float*)tmp);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'f') {
+      float val;
+      memcpy(&val, read_buffer + entry->tag_pos + 3, sizeof(float));
+      return(val);
     }
   }
   return(0);
 }
 
-
 // For Z-type tags (contains a string of variable length)
-inline int pbam1_t::tagVal_Z(const std::string tag, std::string & dest) {
+inline int pbam1_t::tagVal_Z(const pbam_tag_key tag, std::string & dest) {
   dest.clear();
   if(validate()) {
-    char type = search_tag_type(tag);
-    if(type == 'Z') {
-      uint32_t tag_length = search_tag_length(tag);
-      uint32_t tag_pos = search_tag_pos(tag);
-      char * tmp = read_buffer + tag_pos + 3;
-      dest.assign(std::string(tmp, tag_length));
-      return(tag_length);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'Z') {
+      dest.assign(read_buffer + entry->tag_pos + 3, entry->tag_length);
+      return(entry->tag_length);
     }
   }
   return(-1);
 }
 
-// For B-type tags of type c
-inline int pbam1_t::tagVal_B(const std::string tag, std::vector<int8_t> & dest) {
+// For B-type tags of subtype c, C, s, S, i, I and f
+inline int pbam1_t::tagVal_B(const pbam_tag_key tag, std::vector<int8_t> & dest) {
   dest.clear();
   if(validate()) {
-    if(search_tag_type(tag) == 'B') {
-      if(search_tag_subtype(tag) == 'c') {
-        uint32_t tag_length = search_tag_length(tag);
-        uint32_t tag_pos = search_tag_pos(tag);
-        int8_t* tmp = (int8_t*)(read_buffer + tag_pos + 8);
-        for(unsigned int i = 0; i < tag_length; i++) {
-          dest.push_back(*tmp);
-          tmp++;
-        }
-        return(tag_length);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'B' && entry->subtype == 'c') {
+      dest.resize(entry->tag_length);
+      if(entry->tag_length > 0) {
+        memcpy(dest.data(), read_buffer + entry->tag_pos + 8, 
+          (size_t)entry->tag_length * sizeof(int8_t));
       }
+      return(entry->tag_length);
     }
   }
   return(-1);
 }
 
-inline int pbam1_t::tagVal_B(const std::string tag, std::vector<uint8_t> & dest) {
+inline int pbam1_t::tagVal_B(const pbam_tag_key tag, std::vector<uint8_t> & dest) {
   dest.clear();
   if(validate()) {
-    if(search_tag_type(tag) == 'B') {
-      if(search_tag_subtype(tag) == 'C') {
-        uint32_t tag_length = search_tag_length(tag);
-        uint32_t tag_pos = search_tag_pos(tag);
-        uint8_t* tmp = (uint8_t*)(read_buffer + tag_pos + 8);
-        for(unsigned int i = 0; i < tag_length; i++) {
-          dest.push_back(*tmp);
-          tmp++;
-        }
-        return(tag_length);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'B' && entry->subtype == 'C') {
+      dest.resize(entry->tag_length);
+      if(entry->tag_length > 0) {
+        memcpy(dest.data(), read_buffer + entry->tag_pos + 8, 
+          (size_t)entry->tag_length * sizeof(uint8_t));
       }
+      return(entry->tag_length);
     }
   }
   return(-1);
 }
 
-inline int pbam1_t::tagVal_B(const std::string tag, std::vector<int16_t> & dest) {
+inline int pbam1_t::tagVal_B(const pbam_tag_key tag, std::vector<int16_t> & dest) {
+  dest.clear();
   if(validate()) {
-    dest.clear();
-    if(search_tag_type(tag) == 'B') {
-      if(search_tag_subtype(tag) == 's') {
-        uint32_t tag_length = search_tag_length(tag);
-        uint32_t tag_pos = search_tag_pos(tag);
-        int16_t* tmp = (int16_t*)(read_buffer + tag_pos + 8);
-        for(unsigned int i = 0; i < tag_length; i++) {
-          dest.push_back(*tmp);
-          tmp++;
-        }
-        return(tag_length);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'B' && entry->subtype == 's') {
+      dest.resize(entry->tag_length);
+      if(entry->tag_length > 0) {
+        memcpy(dest.data(), read_buffer + entry->tag_pos + 8, 
+          (size_t)entry->tag_length * sizeof(int16_t));
       }
+      return(entry->tag_length);
     }
   }
   return(-1);
 }
 
-inline int pbam1_t::tagVal_B(const std::string tag, std::vector<uint16_t> & dest) {
+inline int pbam1_t::tagVal_B(const pbam_tag_key tag, std::vector<uint16_t> & dest) {
+  dest.clear();
   if(validate()) {
-    dest.clear();
-    if(search_tag_type(tag) == 'B') {
-      if(search_tag_subtype(tag) == 'S') {
-        uint32_t tag_length = search_tag_length(tag);
-        uint32_t tag_pos = search_tag_pos(tag);
-        uint16_t* tmp = (uint16_t*)(read_buffer + tag_pos + 8);
-        for(unsigned int i = 0; i < tag_length; i++) {
-          dest.push_back(*tmp);
-          tmp++;
-        }
-        return(tag_length);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'B' && entry->subtype == 'S') {
+      dest.resize(entry->tag_length);
+      if(entry->tag_length > 0) {
+        memcpy(dest.data(), read_buffer + entry->tag_pos + 8, 
+          (size_t)entry->tag_length * sizeof(uint16_t));
       }
+      return(entry->tag_length);
     }
   }
   return(-1);
 }
 
-inline int pbam1_t::tagVal_B(const std::string tag, std::vector<int32_t> & dest) {
+inline int pbam1_t::tagVal_B(const pbam_tag_key tag, std::vector<int32_t> & dest) {
+  dest.clear();
   if(validate()) {
-    dest.clear();
-    if(search_tag_type(tag) == 'B') {
-      if(search_tag_subtype(tag) == 'i') {
-        uint32_t tag_length = search_tag_length(tag);
-        uint32_t tag_pos = search_tag_pos(tag);
-        int32_t* tmp = (int32_t*)(read_buffer + tag_pos + 8);
-        for(unsigned int i = 0; i < tag_length; i++) {
-          dest.push_back(*tmp);
-          tmp++;
-        }
-        return(tag_length);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'B' && entry->subtype == 'i') {
+      dest.resize(entry->tag_length);
+      if(entry->tag_length > 0) {
+        memcpy(dest.data(), read_buffer + entry->tag_pos + 8, 
+          (size_t)entry->tag_length * sizeof(int32_t));
       }
+      return(entry->tag_length);
     }
   }
   return(-1);
 }
 
-inline int pbam1_t::tagVal_B(const std::string tag, std::vector<uint32_t> & dest) {
+inline int pbam1_t::tagVal_B(const pbam_tag_key tag, std::vector<uint32_t> & dest) {
+  dest.clear();
   if(validate()) {
-    dest.clear();
-    if(search_tag_type(tag) == 'B') {
-      if(search_tag_subtype(tag) == 'I') {
-        uint32_t tag_length = search_tag_length(tag);
-        uint32_t tag_pos = search_tag_pos(tag);
-        uint32_t* tmp = (uint32_t*)(read_buffer + tag_pos + 8);
-        for(unsigned int i = 0; i < tag_length; i++) {
-          dest.push_back(*tmp);
-          tmp++;
-        }
-        return(tag_length);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'B' && entry->subtype == 'I') {
+      dest.resize(entry->tag_length);
+      if(entry->tag_length > 0) {
+        memcpy(dest.data(), read_buffer + entry->tag_pos + 8, 
+          (size_t)entry->tag_length * sizeof(uint32_t));
       }
+      return(entry->tag_length);
     }
   }
   return(-1);
 }
 
-inline int pbam1_t::tagVal_B(const std::string tag, std::vector<float> & dest) {
+inline int pbam1_t::tagVal_B(const pbam_tag_key tag, std::vector<float> & dest) {
+  dest.clear();
   if(validate()) {
-    dest.clear();
-    if(search_tag_type(tag) == 'B') {
-      if(search_tag_subtype(tag) == 'f') {
-        uint32_t tag_length = search_tag_length(tag);
-        uint32_t tag_pos = search_tag_pos(tag);
-        float* tmp = (float*)(read_buffer + tag_pos + 8);
-        for(unsigned int i = 0; i < tag_length; i++) {
-          dest.push_back(*tmp);
-          tmp++;
-        }
-        return(tag_length);
+    const pbam_tag_index * entry = search_tag(tag.key);
+    if(entry && entry->type == 'B' && entry->subtype == 'f') {
+      dest.resize(entry->tag_length);
+      if(entry->tag_length > 0) {
+        memcpy(dest.data(), read_buffer + entry->tag_pos + 8, 
+          (size_t)entry->tag_length * sizeof(float));
       }
+      return(entry->tag_length);
     }
   }
   return(-1);
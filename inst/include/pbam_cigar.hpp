@@ -0,0 +1,125 @@
+/* pbam_cigar.hpp pbam_cigar_geometry (reference span, aligned blocks and junctions)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_cigar
+#define _pbam_cigar
+
+// A range of reference positions: 0-based, from start to end (exclusive)
+struct pbam_ref_range{
+  int32_t start;
+  int32_t end;
+};
+
+/*
+  Geometry of an alignment, derived from its cigar in one pass:
+  - Aligned blocks are the reference ranges covered by M, = or X operations.
+      Insertions do not end a block; deletions and skipped regions (N) do.
+  - Junctions are the reference ranges skipped by N operations (introns)
+  - Clips are the lengths of soft (S) and hard (H) clips at each end
+
+  Keep one pbam_cigar_geometry per thread and fill it for each read: its
+    vectors keep their capacity, so they are not reallocated for every read.
+*/
+class pbam_cigar_geometry {
+  public:
+    int32_t ref_start = 0;          // pos()
+    int32_t ref_end = 0;            // ref_start + ref_span (exclusive)
+    uint32_t ref_span = 0;          // Bases of M, D, N, = and X operations
+    uint32_t query_length = 0;      // Bases of M, I, S, = and X operations
+    uint32_t aligned_length = 0;    // Bases of M, = and X operations
+    uint32_t soft_clip_start = 0;
+    uint32_t soft_clip_end = 0;
+    uint32_t hard_clip_start = 0;
+    uint32_t hard_clip_end = 0;
+    std::vector<pbam_ref_range> blocks;
+    std::vector<pbam_ref_range> junctions;
+
+    // Fills the geometry from n_ops cigar operations of an alignment at pos
+    void build(const uint32_t * cigar, const uint32_t n_ops, const int32_t pos);
+
+    void clear();
+};
+
+/*
+  Bit 1: operation consumes the query; bit 2: consumes the reference;
+    bit 4: is aligned (M, = or X); bit 8: ends an aligned block (D or N).
+  Indexed by operation code MIDNSHP=X; undefined codes consume nothing.
+*/
+static const uint8_t pbamCigarOpFlags[16] = {
+  1 | 2 | 4, 1, 2 | 8, 2 | 8, 1, 0, 0, 1 | 2 | 4, 1 | 2 | 4,
+  0, 0, 0, 0, 0, 0, 0
+};
+
+inline void pbam_cigar_geometry::clear() {
+  ref_start = 0; ref_end = 0; ref_span = 0;
+  query_length = 0; aligned_length = 0;
+  soft_clip_start = 0; soft_clip_end = 0;
+  hard_clip_start = 0; hard_clip_end = 0;
+  blocks.clear();
+  junctions.clear();
+}
+
+inline void pbam_cigar_geometry::build(const uint32_t * cigar,
+    const uint32_t n_ops, const int32_t pos) {
+  clear();
+  ref_start = pos;
+  int64_t ref_pos = pos;
+  uint64_t query_len = 0;
+  uint64_t aligned_len = 0;
+  bool in_block = false;
+  for(uint32_t i = 0; i < n_ops; i++) {
+    const uint32_t op = cigar[i] & 15;
+    const uint32_t len = cigar[i] >> 4;
+    const uint8_t flags = pbamCigarOpFlags[op];
+    // Sums are updated without branching on the operation
+    const int64_t ref_len = (flags & 2) ? len : 0;
+    query_len += (flags & 1) ? len : 0;
+    aligned_len += (flags & 4) ? len : 0;
+    if(flags & 4) {
+      if(!in_block) {
+        blocks.push_back({(int32_t)ref_pos, (int32_t)ref_pos});
+        in_block = true;
+      }
+      blocks.back().end = (int32_t)(ref_pos + len);
+    } else if(flags & 8) {
+      in_block = false;
+      if(op == 3) {
+        junctions.push_back({(int32_t)ref_pos, (int32_t)(ref_pos + len)});
+      }
+    }
+    ref_pos += ref_len;
+  }
+  ref_end = (int32_t)ref_pos;
+  ref_span = (uint32_t)(ref_pos - pos);
+  query_length = (uint32_t)query_len;
+  aligned_length = (uint32_t)aligned_len;
+
+  // Clips: H, then S, at either end
+  uint32_t first = 0;
+  uint32_t last = n_ops;
+  if(first < last && (cigar[first] & 15) == 5) hard_clip_start = cigar[first++] >> 4;
+  if(first < last && (cigar[first] & 15) == 4) soft_clip_start = cigar[first++] >> 4;
+  if(first < last && (cigar[last - 1] & 15) == 5) hard_clip_end = cigar[--last] >> 4;
+  if(first < last && (cigar[last - 1] & 15) == 4) soft_clip_end = cigar[--last] >> 4;
+}
+
+#endif
@@ -29,9 +29,20 @@ static const int bamGzipHeadLength = 16;  // +2 a uint16 with the full block len
 static const char bamGzipHead[bamGzipHeadLength+1] = 
 		"\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00";
 static const int bamEOFlength = 28;
+static const size_t bgzfMaxBlockLength = 65536;  // BSIZE + 1 is at most 2^16
+static const size_t pbamIOAlign = 4096;   // Alignment of O_DIRECT reads
 static const char bamEOF[bamEOFlength+1] =
 		"\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00\x1b\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00";
 
+// Checks the fixed fields of a BGZF block header: gzip ID1, ID2, CM, FLG,
+//   then XLEN = 6 and the 'BC' subfield with SLEN = 2
+inline bool is_bgzf_header(const char * buf) {
+  return(memcmp(buf, bamGzipHead, 4) == 0 && 
+    memcmp(buf + 10, bamGzipHead + 10, 6) == 0);
+}
+
+static const unsigned int pbamTagIndexSize = 16;  // Tags indexed in each pbam1_t
+
 static const int magiclength = 4;
 static const char magicstring[magiclength+1] = "\x42\x41\x4d\x01";
 
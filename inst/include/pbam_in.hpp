@@ -23,6 +23,20 @@ SOFTWARE.  */
 #ifndef _pbam_in
 #define _pbam_in
 
+// A BGZF block within file_buf
+struct pbam_bgzf_block{
+  size_t src_pos;       // Offset of the block in file_buf
+  uint32_t src_size;    // Compressed size of the whole block (BSIZE + 1)
+  uint32_t dest_size;   // Decompressed size (ISIZE)
+};
+
+// A decompressed BGZF block, locating data_buf contents in the BAM file
+struct pbam_block_voffset{
+  uint64_t ustart;      // Offset of the block's data in the decompressed BAM
+  uint64_t coff;        // File offset of the block
+  uint32_t dest_size;   // Decompressed size (ISIZE)
+};
+
 /*
   Class Description
 */
@@ -40,8 +54,11 @@ class pbam_in {
       // Size of data buffer for decompressed data (default 1 Gb)
       const unsigned int chunks_per_file_buffer, 
       // How many chunks per file buffer (default 5)
-      const bool read_file_using_multiple_threads = true  
+      const bool read_file_using_multiple_threads = true,
       // Whether to read threads in multi-threaded way (default true)
+      const unsigned int crc_check_interval = 1
+      // Verify CRC32 of every Nth BGZF block per thread (default 1, i.e. 
+      //   every block); 0 disables CRC verification (trusted files only)
     );
     
     ~pbam_in();
@@ -49,9 +66,15 @@ class pbam_in {
     // File Openers //
     // NB: on file open, pbam_in automatically checks the BAM format and header
 
-    // Opens a file directly for BAM reading. Supply a BAM file name as a string
-    // Returns 0 if success, or -1 if error
-    int openFile(std::string filename, unsigned int n_threads); 
+    /* 
+      Opens a file directly for BAM reading. Supply a BAM file name as a string
+      If use_mmap is set, the file is memory-mapped and BGZF blocks are 
+        inflated directly from the mapping, instead of being read into the
+        two file buffers. Falls back to normal reading if mmap is unavailable
+      Returns 0 if success, or -1 if error
+    */
+    int openFile(std::string filename, unsigned int n_threads, 
+      const bool use_mmap = false); 
     
     // Closes the file. Essentially clears the pbam_in buffers, except constructor settings
     int closeFile();
@@ -68,6 +91,19 @@ class pbam_in {
       Returns 0 if success, or -1 if error
     */
     int SetInputHandle(std::ifstream *in_stream, const unsigned int n_threads); 
+
+    /*
+      Opens a BAM stream that cannot be seeked, such as a pipe or stdin.
+      Supply either a file descriptor (e.g. 0 for stdin; POSIX only), or an
+        std::istream opened in binary mode. pbam_in does not close the stream.
+      Compressed data is read sequentially by a single reader thread, while
+        decompression uses n_threads threads. GetFileSize() returns the
+        number of bytes read so far, until the end of the stream is reached.
+      Additionally, this function reads the BAM header.
+      Returns 0 if success, or -1 if error
+    */
+    int openStream(const int fd, const unsigned int n_threads);
+    int openStream(std::istream * in_stream, const unsigned int n_threads);
    
     // Returns two vectors, containing chromosome names and lengths
     // Must be called after openFile() or SetInputHandle()
@@ -77,6 +113,50 @@ class pbam_in {
       std::vector<uint32_t> & u32_chr_lens
     );
 
+    /*
+      Loads the BAM index (.bai or .csi) used by SetRegion(). By default, 
+        looks for [BAM file].bai, then the BAM file name with .bam replaced
+        by .bai, then [BAM file].csi
+      Must be called after openFile() or SetInputHandle()
+      Returns 0 if success, or -1 if error
+    */
+    int LoadIndex(const std::string & index_file = "");
+
+    /*
+      Restricts fillReads() / supplyRead() to reads overlapping the given
+        region(s). Coordinates are 0-based and half-open: [start, end)
+      Only the BGZF blocks that may contain such reads are decompressed, and
+        supplyRead() skips reads that do not overlap any region. Each read
+        is supplied once, even if it overlaps several regions.
+      Requires LoadIndex(). Any reads not yet supplied are discarded.
+      Returns 0 if success, or -1 if error
+    */
+    int SetRegion(const std::string & chr, const uint32_t start, 
+      const uint32_t end);
+    int SetRegions(
+      const std::vector<std::string> & chrs, 
+      const std::vector<uint32_t> & starts,
+      const std::vector<uint32_t> & ends
+    );
+
+    /*
+      Builds a BAM index while the file is read by fillReads(). Each thread
+        indexes the reads it will be supplied, and the results are merged
+        in file order. The BAM file must be coordinate-sorted.
+      min_shift = 0 builds a BAI index. Otherwise, builds a CSI index with
+        the given min_shift and depth (e.g. 14 and 6)
+      Must be called after openFile() and before the first fillReads()
+      Returns 0 if success, or -1 if error
+    */
+    int BuildIndex(const int min_shift = 0, const int depth = 5);
+
+    /*
+      Writes the index built during the scan, after fillReads() returned 1
+        at the end of the file.
+      Returns 0 if success, or -1 if error (including unsorted BAM files)
+    */
+    int WriteIndex(const std::string & index_file);
+
     /* 
       Reads the BAM file, decompressing to a maximum either by the data buffer cap,
         or the file chunk size (file_buf_cap / chunks_per_file_buf).
@@ -108,23 +188,175 @@ class pbam_in {
         this function is a "valid" read.
     */
     pbam1_t supplyRead(const unsigned int thread_id = 0);
+
+    /*
+      As supplyRead(), but returns a pbam_view. Each read is checked once,
+        when its view is made, and is not checked again by the getters.
+      Returns an empty view (pbam_view::valid() is false) at the end of the
+        thread's reads, or if the read buffer is corrupt.
+    */
+    pbam_view supplyView(const unsigned int thread_id = 0);
+
+    /*
+      Hands over all the reads of the last fillReads() not yet supplied, as 
+        one run of reads lying back to back in file order (e.g. to merge 
+        them with the reads of other files). Sets batch to the first read
+        and batch_size to the size of the run in bytes (0 if no reads). The
+        reads are then no longer supplied by supplyRead().
+      Must be called before any thread other than thread 0 is supplied a read.
+        Not available with SetPartitionKey() or during region queries, as
+        the reads handed out are then not a single run
+      Returns 0 if success, or -1 if error
+    */
+    int supplyBatch(char * & batch, size_t & batch_size);
     
     size_t remainingThreadReadsBuffer(const unsigned int thread_id = 0);
     
+    /*
+      Restricts fillReads() to the reads starting in BGZF blocks at file 
+        offsets within [begin, end), so that several processes can each read
+        one slice of the same BAM file without an index. Slices that together
+        cover the file, e.g. [0, n), [n, 2n), ..., supply every read exactly
+        once. The first read of a slice is found by checking the fields of
+        the reads from the first BGZF block in the slice.
+      Must be called after openFile() or SetInputHandle(). Any reads not yet
+        supplied are discarded, and region queries and index building are
+        stopped. Not available for streams
+      Returns 0 if success, or -1 if error
+    */
+    int SetByteRange(const size_t begin, const size_t end);
+
     // Returns the size of the opened BAM
     size_t GetFileSize() { return(IS_LENGTH); };
 
+    /*
+      Returns the BGZF virtual offset (file offset of the BGZF block << 16 |
+        offset within the decompressed block) of the first read that has not
+        been handed out by fillReads(). Call this between fillReads() calls,
+        e.g. to checkpoint a scan once all reads supplied have been processed
+      Returns 0 during region queries
+    */
+    uint64_t Tell();
+
+    /*
+      Moves to the read at the given virtual offset (e.g. returned by Tell()
+        or found in a BAM index). The next fillReads() resumes from there.
+      Any reads not yet supplied are discarded, and any region query or index
+        building is stopped. Not available for streams
+      Returns 0 if success, or -1 if error
+    */
+    int Seek(const uint64_t voffset);
+
     // Returns the number of bytes decompressed
-    size_t GetProgress() {return(prog_tellg());};
+    size_t GetProgress() {return(supplied_progress());};
     
     int GetErrorState() {return(error_state);};
+
+    /*
+      Sets the backend used to inflate BGZF blocks (see pbam_inflate.hpp):
+      - PBAM_INFLATE_AUTO (default): fastest backend compiled in
+      - PBAM_INFLATE_ZLIB: zlib (or zlib-ng if compiled with -DOMPBAM_USE_ZLIBNG)
+      - PBAM_INFLATE_LIBDEFLATE: libdeflate (-DOMPBAM_USE_LIBDEFLATE)
+      Returns 0 if success, or -1 if the backend is not compiled in, in which
+        case zlib is used instead
+    */
+    int SetInflateBackend(const int backend);
+    
+    // Returns the name of the backend used to inflate BGZF blocks
+    std::string GetInflateBackend() {return(pbam_inflate_name(inflate_backend));};
+
+    /*
+      Reads file chunks using O_DIRECT where possible (Linux only), bypassing
+        the page cache. Takes effect from the next openFile()
+      Returns 0 if success, or -1 if O_DIRECT is not supported
+    */
+    int SetDirectIO(const bool use_direct_io);
+
+    /*
+      Changes the number of threads used by fillReads() and supplyRead()
+        once the file is open. Call only after all reads supplied by the last
+        fillReads() have been read
+      Returns 0 if success, or -1 if error
+    */
+    int SetThreads(const unsigned int n_threads);
+
+    /*
+      Distributes reads to threads by a key, so that all reads with the same
+        key are supplied to the same thread, and per-thread results need no
+        locking. key is one of:
+      - A 2-character tag, e.g. "CB", "UB" or "RG". Reads without the tag
+          are all supplied to the same thread
+      - "QNAME": the read name
+      - "RNAME": the reference; each thread is given whole chromosomes
+      An empty key restores the default (contiguous ranges of reads).
+        Reads of each thread remain in file order. Takes effect from the
+        next fillReads(); remainingThreadReadsBuffer() then returns the
+        number of reads (rather than bytes) remaining
+      Returns 0 if success, or -1 if key is invalid
+    */
+    int SetPartitionKey(const std::string & key);
+
+    /*
+      For name-sorted or collated BAM files: moves the boundaries between the
+        reads of each thread, and between fillReads() batches, to the next
+        change of read name. All reads with the same name (e.g. both mates
+        of a pair) are then supplied to the same thread by one fillReads().
+      The reads with the last name of a batch are held back until the next
+        batch. Region queries and byte-range shards may still separate
+        reads with the same name
+    */
+    void SetMateBatching(const bool keep_mates);
+
+    /*
+      For coordinate-sorted BAM files: ends each fillReads() batch at a change
+        of reference, so that all reads supplied by one fillReads() are on
+        the same chromosome, given by GetBatchRefID(). Per-chromosome data
+        can then be freed once GetBatchRefID() changes (or fillReads()
+        returns 1). The reads of a chromosome may span several batches.
+      To give each thread whole chromosomes instead, use
+        SetPartitionKey("RNAME")
+    */
+    void SetChromosomeBatching(const bool by_chromosome);
+
+    // With chromosome batching, returns the refID of the reads supplied by the
+    //   last fillReads() (-1 for unplaced reads). Otherwise, returns -1
+    int32_t GetBatchRefID() {return(chrom_batching ? batch_refID : -1);};
+
+    // Sets CRC32 verification: 1 = every block, N = every Nth block, 0 = off
+    void SetCRCCheckInterval(const unsigned int interval) {
+      crc_check_interval = interval;
+    };
+
+    /*
+      Enables pipelined decompression. In this mode, fillReads() returns the
+        reads already decompressed in the background, then starts
+        decompressing the next batch on a background thread while the
+        current batch is processed via supplyRead().
+      - Uses a second data buffer (i.e. twice the data buffer memory)
+      - Background decompression uses its own team of n_threads threads,
+          so this is beneficial when per-read processing is CPU-heavy
+      Can be called at any time; a batch in flight is completed first.
+    */
+    void SetPipelined(const bool use_pipeline);
+
+    /*
+      Fills busy_secs with the time (in seconds) each thread spent 
+        decompressing BGZF blocks, and n_blocks with the number of blocks
+        each thread decompressed, since the file was opened.
+      Useful to check decompression is evenly balanced across threads.
+      Returns the number of threads
+    */
+    int GetThreadBusyTime(
+      std::vector<double> & busy_secs, 
+      std::vector<size_t> & n_blocks
+    );
     /* 
       Returns the incremental number of bytes decompressed since the last call 
       to IncProgress(). A useful function for RcppProgress progress bars.
     */
     size_t IncProgress() {
-      size_t INC = prog_tellg() - PROGRESS;
-      PROGRESS = prog_tellg();
+      size_t INC = supplied_progress() - PROGRESS;
+      PROGRESS = supplied_progress();
       return(INC);
     };
 
@@ -135,9 +367,23 @@ class pbam_in {
     unsigned int    chunks_per_file_buf   = 5;    // Divide file buffer into n segments
     unsigned int    threads_to_use        = 1;
     bool            multiFileRead         = true;
+    int             inflate_backend       = PBAM_INFLATE_AUTO;
+    unsigned int    crc_check_interval    = 1;    // Verify every Nth block; 0 = never
+    bool            direct_io             = false;  // O_DIRECT reads
     std::string     FILENAME;
 // File particulars
     std::ifstream    * IN;    
+    int             read_fd;      // Opened by openFile() for pread(); -1 if unused
+    int             direct_fd;    // As read_fd, but opened with O_DIRECT
+
+// Non-seekable input (openStream). IS_LENGTH is the number of bytes read so far
+    bool            streaming;
+    int             stream_fd;        // -1 if reading from stream_in
+    std::istream *  stream_in;
+    size_t          stream_pos;       // Bytes read from the stream
+    bool            stream_eof;       // End of stream reached
+    char            stream_tail[bamEOFlength];  // Last bytes read, to check EOF block
+    size_t          stream_tail_len;
     size_t          IS_LENGTH;     // size of BAM file (Input Stream Length)
   
 // Header storage:
@@ -151,6 +397,9 @@ class pbam_in {
     std::vector<uint32_t>       chr_lens;
   
 // Data buffers
+// Each is allocated once at full size. File buffers reserve bgzfMaxBlockLength
+//   bytes of headroom (plus up to pbamIOAlign bytes to align the data with its
+//   file offset) before the data read from file
     char *          file_buf; 
     size_t          file_buf_cap; 
     size_t          file_buf_cursor;
@@ -158,10 +407,15 @@ class pbam_in {
     char *          next_file_buf; 
     size_t          next_file_buf_cap;
     size_t          next_file_buf_cursor;
+    size_t          next_file_buf_start;  // Offset of data read into next_file_buf
     
     char *          data_buf; 
     size_t          data_buf_cap; 
     size_t          data_buf_cursor;
+
+// Memory-mapped input: if set, file_buf points to the mapping of the whole file
+    char *          map_buf;
+    size_t          map_len;
 /* 
   Thread-specific read cursor positions and boundaries
   Thread returns a null read if cursor read_cursors >= read_ptr_ends
@@ -169,38 +423,145 @@ class pbam_in {
     std::vector<size_t>         read_cursors;     // Cursor(s) of start of next read in each thread
     std::vector<size_t>         read_ptr_ends;    // Boundaries of read positions in each thread
 
+// Per-thread decompressor contexts; created on file open, freed by clear_buffers()
+    pbam_inflater *             inflaters;
+    unsigned int                n_inflaters;
+    
+// Map of complete BGZF blocks in file_buf, built once per file buffer fill
+    std::vector<pbam_bgzf_block> block_map;
+    size_t                      block_map_cursor;   // Next block to decompress
+    bool                        block_map_valid;    // false if file_buf changed
+    bool                        block_map_corrupt;  // Map ends at a corrupt block
+    // Buffers larger than this are mapped using multiple threads
+    size_t                      block_map_parallel_min = 16777216;
+
+// Per-thread decompression statistics
+    std::vector<double>         thread_busy_secs;     // Time spent inflating
+    std::vector<size_t>         thread_block_counts;  // Blocks inflated
+
+// Indexed region queries
+    pbam_index                  bam_index;
+    bool                        region_active;
+    std::vector<pbam_region>    regions;          // Sorted; disjoint per reference
+    std::vector<pbam_chunk>     region_chunks;    // Merged chunks to decompress
+    size_t                      region_chunk_idx; // Next chunk in region_chunks
+    bool                        region_chunk_done;  // Current chunk is finished
+    uint64_t                    region_stop;      // Virtual offset of chunk end
+    size_t                      region_read_limit;  // File offset to read up to
+
+// Decompressed blocks from data_buf_cursor onwards, in file order
+    std::vector<pbam_block_voffset> block_voffsets;
+    uint64_t                    data_stream_pos;  // Decompressed offset of data_buf_cap
+    uint64_t                    next_block_coff;  // File offset after the last block
+
+// Index built during the scan
+    pbam_index                  built_index;
+    int                         index_build_state;  // 0 = off, 1 = building,
+                                                    // 2 = EOF reached, 3 = finished, -1 = failed
+    std::vector<pbam_index_batch> index_batches;    // One per thread
+    bool                        scan_started;     // fillReads() or Seek() has been called
+    uint32_t                    block_skip;       // Bytes to skip in the first block
+                                                  //   after a seek
+
+// Byte-range shards (SetByteRange)
+    bool                        shard_active;
+    size_t                      shard_end;        // File offset ending the shard
+    uint64_t                    shard_stop;       // Decompressed offset after the shard's
+                                                  //   last block; -1 if not yet known
+    size_t                      shard_read_limit; // File offset to read up to
+    bool                        shard_syncing;    // Next fillReads() finds the first read
+    uint64_t                    first_read_voffset; // Virtual offset of the first read
+
 // Error state of decompression
     int error_state = 0;
 
+// Pipelined decompression
+    bool            pipelined             = false;
+    std::thread     pipe_thread;          // Background decompression thread
+    bool            pipe_running          = false;
+    size_t          pipe_bytes            = 0;  // Bytes decompressed by pipe_thread
+    size_t          pipe_progress         = 0;  // prog_tellg() at last hand-over
+    uint64_t        pipe_voffset          = 0;  // Tell() at last hand-over
+
+    char *          supply_buf;           // Buffer holding reads given by supplyRead()
+    char *          spare_data_buf;       // Second data buffer, used if pipelined
+
+// Mate and chromosome batching (SetMateBatching, SetChromosomeBatching)
+    bool            mate_batching         = false;
+    bool            chrom_batching        = false;
+    bool            reads_held            = false;  // Last batch left complete
+                                                    //   reads in data_buf
+    int32_t         batch_refID           = -1;     // refID of the last batch
+
+// Key-partitioned supply (SetPartitionKey). read_cursors and read_ptr_ends
+//   then index part_sorted, which holds the offsets of each thread's reads
+    int             part_mode             = 0;  // 0 = off, 1 = tag, 2 = QNAME,
+                                                //   3 = RNAME
+    char            part_tag[2]           = {0, 0};
+    std::vector<size_t>         part_offsets;   // Read offsets, in file order
+    std::vector<uint32_t>       part_dest;      // Thread of each read
+    std::vector<size_t>         part_sorted;    // Read offsets, by thread
+
 
 // Internal functions
 
     void            check_threads(unsigned int n_threads_to_check);
     int             check_file();
+    int             map_file(const std::string & filename);   // Returns 0 if success
+    void            unmap_file();
+    // Advises the kernel of the pages in the mapping about to be inflated
+    void            advise_map(const size_t src_start, const size_t src_end);
 
 // *** Initialisers ***
     void            initialize_buffers();         // Initialises a pbam_in
     void            clear_buffers();              // Clears all buffers and re-initialises pbam_in
+    int             init_inflaters();             // Creates one decompressor per thread
 
 // *** Internal functions run by decompress() ***
 
-    int             read_file_to_buffer(char * buf, const size_t len);
+    // Reads len bytes from the file. Returns the number of bytes read
+    size_t          read_file_to_buffer(char * buf, const size_t len);
+
+    // Reads up to len bytes from a stream. Returns the number of bytes read
+    size_t          read_stream_to_buffer(char * buf, const size_t len);
+    int             check_stream();
+
+    // Opens / closes read_fd and direct_fd for positional reads
+    int             open_read_fds(const std::string & filename);
+    void            close_read_fds();
+
+    // Reads len bytes at file offset using pread() from multiple threads
+    int             pread_to_buffer(char * buf, const size_t len, const size_t offset);
+    int             pread_segment(char * buf, const size_t len, const size_t offset);
+
+    // Total size of each file buffer
+    size_t          file_buf_size() {
+      return(bgzfMaxBlockLength + pbamIOAlign + FILE_BUFFER_CAP);
+    };
 
-    // Moves residual data to beginning of file or data buffer
-    // Buffer is passed by reference to the pointer
-    void move_residual_data(
-        char** buf,                     // Pointer to char pointer (for file/data buffer)
-        size_t & cursor, size_t & cap,  // Reference to buffer cursor / caps
-        const size_t new_cap            // Desired size of new buffer
+    // Builds block_map from file_buf_cursor to the end of file_buf
+    //   (or FILE_BUFFER_CAP bytes of a memory-mapped file)
+    void            build_block_map();
+    
+    // Appends complete blocks in file_buf from src_start up to src_end
+    size_t          scan_bgzf_blocks(
+      const size_t src_start, const size_t src_end,
+      std::vector<pbam_bgzf_block> & blocks, bool & corrupt
     );
 
+    // Allocates file_buf and next_file_buf (once per file)
+    int             alloc_file_buffers();
+
+    // Whether a complete BGZF block remains in file_buf
+    bool            file_buf_has_block();
+
     // Removes all data upstream of data_buf_cursor. Then, sets data_buf_cursor to 0.
-    int             clean_data_buffer(const size_t n_bytes_to_decompress);  
+    int             clean_data_buffer();
     
     /* 
-      If bytes remaining in primary file buffer is less than chunk_size,
-      re-initialises file_buf, copying residual data from existing file_buf,
-      and copies data from next_file_buf, upto FILE_BUFFER_CAP
+      If no complete BGZF block remains in file_buf, swaps file_buf with
+      next_file_buf, placing the partial block left in file_buf (if any)
+      right before the data in next_file_buf
     */
     int             swap_file_buffer_if_needed();
     
@@ -219,6 +580,66 @@ class pbam_in {
     */
     size_t          decompress(const size_t n_bytes_to_decompress);
 
+// *** Indexed region queries ***
+    // Sets regions, and the chunks to decompress from the index
+    int             start_region_query(std::vector<pbam_region> & new_regions);
+    // Moves file and data buffers to the next chunk. Returns -1 if none left
+    int             region_next_chunk();
+    // Whether the read at read_ptr overlaps any region
+    bool            read_in_regions(const char * read_ptr);
+    // End (exclusive) of the reference span of the read at read_ptr
+    uint32_t        read_ref_end(const char * read_ptr);
+
+// *** Index building ***
+    // Virtual offset of the byte at data_pos in data_buf
+    uint64_t        data_voffset(const size_t data_pos);
+    // Moves the file cursor to the BGZF block at file offset coff
+    void            seek_file(const size_t coff);
+    // Drops decompressed blocks before data_buf_cursor from block_voffsets
+    void            prune_block_voffsets();
+    // Adds the reads assigned to threads by fillReads() to the built index
+    void            index_reads();
+
+// *** Byte-range shards ***
+    // Finds the first BGZF block starting within [begin, end)
+    int             find_bgzf_block(const size_t begin, const size_t end, size_t & coff);
+    // Reads len bytes at file offset, without moving the file cursor
+    size_t          read_file_at(const size_t offset, char * buf, const size_t len);
+    // Whether a read may start at read_ptr: 1 = yes, 0 = no, 2 = needs more data
+    int             check_read_start(const char * read_ptr, const size_t avail);
+    // Moves data_buf_cursor to the first read of the shard
+    void            shard_resync();
+    // Raises shard_read_limit if the shard's last read continues past it
+    bool            shard_extend_limit();
+    // Whether all reads starting in the shard's blocks have been handed out
+    bool            shard_done() {
+      return(shard_stop != (uint64_t)-1 && 
+        data_stream_pos - (data_buf_cap - data_buf_cursor) >= shard_stop);
+    };
+
+// *** Mate and chromosome batching ***
+    bool            same_read_name(const size_t a, const size_t b);
+    // Whether a thread boundary can be placed at data_buf_cursor
+    bool            mate_boundary(const size_t group_start, const size_t scan_stop);
+    // Ends the batch at the first change of reference before scan_stop
+    size_t          chrom_batch_end(const size_t scan_stop);
+    // Whether data_buf holds a whole batch (up to a change of reference)
+    bool            chrom_batch_ready();
+
+// *** Key-partitioned supply ***
+    // Assigns the reads in part_offsets to threads by their key
+    void            partition_reads();
+    // supplyRead() of the next read in part_sorted
+    pbam1_t         supply_partitioned_read(const unsigned int thread_id);
+    // Hash of the key of the read at read_ptr
+    uint64_t        partition_hash(const char * read_ptr);
+    static uint64_t hash_key(const char * key, const size_t key_len);
+
+// *** Pipelined decompression ***
+    void            pipeline_start();     // Decompresses next batch in background
+    size_t          pipeline_wait();      // Waits for background batch; returns bytes
+    int             pipeline_swap();      // Hands decompressed reads to supply_buf
+
 // *** Internal functions used by readHeader() ***
     unsigned int read(char * dest, const unsigned int len);  // returns the number of bytes actually read
     unsigned int ignore(unsigned const int len);
@@ -228,18 +649,50 @@ class pbam_in {
     int             readHeader();
 
 // *** File specific functions ***
-    size_t tellg() {return((size_t)IN->tellg());};    // Returns position of file cursor
+    size_t tellg() {                                  // Returns position of file cursor
+      return(streaming ? stream_pos : (size_t)IN->tellg());
+    };
     
     size_t prog_tellg() {                             // Returns the number of bytes decompressed
-      return((size_t)IN->tellg()
+      return(tellg()
         - (file_buf_cap-file_buf_cursor)
         - next_file_buf_cap
     ); };
     
-    bool eof() {return(IS_LENGTH <= tellg());};       // Returns whether end of file is reached
-    bool fail() {return(IN->fail());};                // Returns any ifstream errors
+    // File offset up to which data is read (the end of the current chunk
+    //   in region queries, or the end of the shard)
+    size_t read_limit() {
+      if(region_active) return(std::min(IS_LENGTH, region_read_limit));
+      if(shard_active) return(std::min(IS_LENGTH, shard_read_limit));
+      return(IS_LENGTH);
+    };
+
+    // Returns the number of bytes left to read (unknown for streams)
+    size_t remaining_bytes() {
+      if(streaming) return(stream_eof ? 0 : (size_t)-1);
+      return(read_limit() > tellg() ? read_limit() - tellg() : 0);
+    };
+    
+    bool eof() {                                      // Returns whether end of file is reached
+      return(streaming ? stream_eof : read_limit() <= tellg());
+    };
+
+    // File offset of file_buf[0]. Data in file_buf and next_file_buf is
+    //   contiguous, and ends at the file cursor
+    size_t file_buf_offset() {
+      return(tellg() - next_file_buf_cap - file_buf_cap);
+    };
+    bool fail() {                                     // Returns any ifstream errors
+      return(streaming ? false : IN->fail());
+    };
     
     size_t PROGRESS = 0;    // Value of prog_tellg() when IncProgress() is last called
+
+    // Progress of reads handed out. While a background batch is being
+    //   decompressed, this is the progress at the time of the last hand-over
+    size_t supplied_progress() {
+      return(pipe_running ? pipe_progress : prog_tellg());
+    };
     
 // Disable copy construction / assignment (doing so triggers compile errors)
     pbam_in(const pbam_in &t);
@@ -251,6 +704,10 @@ class pbam_in {
 #include "pbam_in_decompress.hpp"
 #include "pbam_in_fillReads.hpp"
 #include "pbam_in_supplyRead.hpp"
+#include "pbam_in_regions.hpp"
+#include "pbam_in_buildIndex.hpp"
+#include "pbam_in_shard.hpp"
+#include "pbam_in_partition.hpp"
 #include "pbam_in_internals.hpp"
 
 #endif
\ No newline at end of file
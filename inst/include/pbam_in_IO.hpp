@@ -25,12 +25,16 @@ SOFTWARE.  */
 
 // Public functions:
 
-inline int pbam_in::openFile(std::string filename, unsigned int n_threads) {
+inline int pbam_in::openFile(std::string filename, unsigned int n_threads,
+    const bool use_mmap) {
   check_threads(n_threads);
   clear_buffers();
   
   IN = new std::ifstream(filename, std::ios::in | std::ifstream::binary);
   FILENAME = filename;
+  if(init_inflaters() != 0) return(-1);
+  if(use_mmap && !IN->fail()) map_file(filename);
+  if(!map_buf && !IN->fail()) open_read_fds(filename);
   int ret = check_file();
   return(ret);
 }
@@ -40,14 +44,142 @@ inline int pbam_in::SetInputHandle(std::ifstream *in_stream, unsigned int n_thre
   if(!in_stream) return(-1);
   
   IN = in_stream;
+  if(init_inflaters() != 0) return(-1);
   int ret = check_file();
   return(ret);
 }
 
+inline int pbam_in::openStream(const int fd, const unsigned int n_threads) {
+  check_threads(n_threads);
+  clear_buffers();
+  error_state = 0;
+  #ifdef OMPBAM_HAS_POSIX_IO
+  if(fd < 0) return(-1);
+  streaming = true;
+  stream_fd = fd;
+  if(init_inflaters() != 0) return(-1);
+  return(check_stream());
+  #else
+  cout << "Reading BAM from a file descriptor is not supported on this platform\n";
+  return(-1);
+  #endif
+}
+
+inline int pbam_in::openStream(std::istream * in_stream, 
+    const unsigned int n_threads) {
+  check_threads(n_threads);
+  clear_buffers();
+  error_state = 0;
+  if(!in_stream || in_stream->fail()) return(-1);
+  streaming = true;
+  stream_in = in_stream;
+  if(init_inflaters() != 0) return(-1);
+  return(check_stream());
+}
+
 inline int pbam_in::closeFile() {
   clear_buffers(); return(0);
 }
 
+inline uint64_t pbam_in::Tell() {
+  if(region_active) return(0);
+  if(pipe_running) return(pipe_voffset);
+  return(data_voffset(data_buf_cursor));
+}
+
+inline int pbam_in::Seek(const uint64_t voffset) {
+  if(!magic_header) {
+    cout << "Header is not yet read\n";
+    return(-1);
+  }
+  if(streaming) {
+    cout << "Seek() is not available for streams\n";
+    return(-1);
+  }
+  const size_t coff = (size_t)(voffset >> 16);
+  if(coff > IS_LENGTH) {
+    cout << "Virtual offset " << voffset << " is beyond the end of the file\n";
+    return(-1);
+  }
+  // Background batch and unsupplied reads belong to the previous position
+  pipeline_wait();
+  read_cursors.resize(0);
+  read_ptr_ends.resize(0);
+
+  if(region_active) {
+    region_active = false;
+    regions.resize(0); region_chunks.resize(0);
+  }
+  if(index_build_state != 0) {
+    cout << "Index building is cancelled by Seek()\n";
+    index_build_state = 0;
+  }
+  scan_started = true;    // An index can only be built from the first read
+  if(shard_active) {
+    // The shard's end is kept; a seek always lands on a read
+    shard_stop = (uint64_t)-1;
+    shard_syncing = false;
+  }
+
+  data_buf_cap = 0; data_buf_cursor = 0;
+  reads_held = false;
+  block_voffsets.resize(0);
+  next_block_coff = coff;
+  block_skip = (uint32_t)(voffset & 0xffff);
+  seek_file(coff);
+  return(0);
+}
+
+inline int pbam_in::SetInflateBackend(const int backend) {
+  if(!pbam_inflate_available(backend)) {
+    cout << "Requested inflate backend is not compiled in; using "
+      << pbam_inflate_name(PBAM_INFLATE_ZLIB) << " instead\n";
+    inflate_backend = PBAM_INFLATE_ZLIB;
+    // A batch decompressing in the background uses the current decompressors
+    if(pipe_running && pipe_thread.joinable()) pipe_thread.join();
+    if(inflaters) init_inflaters();
+    return(-1);
+  }
+  inflate_backend = backend;
+  // Re-create decompressors if a file is already open
+  if(pipe_running && pipe_thread.joinable()) pipe_thread.join();
+  if(inflaters) return(init_inflaters());
+  return(0);
+}
+
+inline int pbam_in::SetDirectIO(const bool use_direct_io) {
+  #if defined(OMPBAM_HAS_POSIX_IO) && defined(O_DIRECT)
+  direct_io = use_direct_io;
+  return(0);
+  #else
+  direct_io = false;
+  if(use_direct_io) {
+    cout << "O_DIRECT is not supported on this platform\n";
+    return(-1);
+  }
+  return(0);
+  #endif
+}
+
+inline int pbam_in::SetThreads(const unsigned int n_threads) {
+  const unsigned int prev_threads = threads_to_use;
+  check_threads(n_threads);
+  if(threads_to_use == prev_threads) return(0);
+  // A batch decompressing in the background uses the current decompressors;
+  //   it is still collected by the next fillReads()
+  if(pipe_running && pipe_thread.joinable()) pipe_thread.join();
+  if(inflaters) return(init_inflaters());
+  return(0);
+}
+
+inline int pbam_in::GetThreadBusyTime(
+    std::vector<double> & busy_secs, std::vector<size_t> & n_blocks
+) {
+  busy_secs = thread_busy_secs;
+  n_blocks = thread_block_counts;
+  return((int)thread_busy_secs.size());
+}
+
 inline int pbam_in::obtainChrs(std::vector<std::string> & s_chr_names, std::vector<uint32_t> & u32_chr_lens) {
   if(!magic_header) {
     cout << "Header is not yet read\n";
@@ -86,7 +218,12 @@ inline int pbam_in::check_file() {
       return(-1);
     }
     IN->clear(); 
-    IN->seekg(0, std::ios_base::beg);
+    if(map_buf) {
+      // The whole file is already in file_buf, so nothing is left to read
+      IN->seekg(0, std::ios_base::end);
+    } else {
+      IN->seekg(0, std::ios_base::beg);
+    }
     
     // Read header. If corrupt header, close everything and output error:
     int ret = readHeader();
@@ -100,6 +237,121 @@ inline int pbam_in::check_file() {
   }
 }
 
+/*
+  Maps the whole file read-only, and uses the mapping as file_buf.
+  next_file_buf is never used in this mode.
+  Returns 0 if success. Otherwise, the file is read normally.
+*/
+inline int pbam_in::map_file(const std::string & filename) {
+  #ifdef OMPBAM_HAS_MMAP
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0) {
+    cout << "Failed to open " << filename << " for memory mapping\n";
+    return(-1);
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    return(-1);
+  }
+  void * addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);  // The mapping remains valid after the descriptor is closed
+  if(addr == MAP_FAILED) {
+    cout << "Failed to memory-map " << filename << "; reading normally\n";
+    return(-1);
+  }
+  madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  map_buf = (char*)addr;
+  map_len = (size_t)st.st_size;
+  file_buf = map_buf;
+  file_buf_cap = map_len;
+  file_buf_cursor = 0;
+  block_map_valid = false;
+  return(0);
+  #else
+  (void)filename;
+  cout << "Memory-mapped input is not supported on this platform; "
+    << "reading normally\n";
+  return(-1);
+  #endif
+}
+
+/*
+  Opens the file descriptor(s) used for positional reads. These persist until
+    the file is closed, so no file handles are opened per file chunk.
+  Returns 0 if success. Otherwise, child ifstreams are used to read the file.
+*/
+inline int pbam_in::open_read_fds(const std::string & filename) {
+  #ifdef OMPBAM_HAS_POSIX_IO
+  read_fd = ::open(filename.c_str(), O_RDONLY);
+  if(read_fd < 0) return(-1);
+  #ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(read_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  #endif
+  #ifdef O_DIRECT
+  if(direct_io) {
+    direct_fd = ::open(filename.c_str(), O_RDONLY | O_DIRECT);
+    if(direct_fd < 0) {
+      cout << "Failed to open " << filename << " using O_DIRECT\n";
+    }
+  }
+  #endif
+  return(0);
+  #else
+  (void)filename;
+  return(-1);
+  #endif
+}
+
+inline void pbam_in::close_read_fds() {
+  #ifdef OMPBAM_HAS_POSIX_IO
+  if(read_fd >= 0) ::close(read_fd);
+  if(direct_fd >= 0) ::close(direct_fd);
+  #endif
+  read_fd = -1;
+  direct_fd = -1;
+}
+
+inline void pbam_in::unmap_file() {
+  #ifdef OMPBAM_HAS_MMAP
+  if(map_buf) munmap(map_buf, map_len);
+  #endif
+  if(map_buf && file_buf == map_buf) file_buf = NULL;
+  map_buf = NULL;
+  map_len = 0;
+}
+
+/*
+  Asks the kernel to read ahead [src_start, src_end) of the mapping, and to
+    drop the pages before src_start, which have already been inflated.
+  The mapping is read-only, so dropped pages are not written back; they are
+    simply released from this process (the page cache may still hold them)
+*/
+inline void pbam_in::advise_map(const size_t src_start, const size_t src_end) {
+  #ifdef OMPBAM_HAS_MMAP
+  if(!map_buf) return;
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t done = src_start - src_start % page;
+  if(done > 0) madvise(map_buf, done, MADV_DONTNEED);
+  if(src_end > done) madvise(map_buf + done, src_end - done, MADV_WILLNEED);
+  #else
+  (void)src_start;
+  (void)src_end;
+  #endif
+}
+
+// The EOF block of a stream can only be checked once it is reached
+//   (see read_stream_to_buffer)
+inline int pbam_in::check_stream() {
+  IS_LENGTH = 0;
+  int ret = readHeader();
+  if(ret != 0) {
+    clear_buffers();
+  }
+  return(ret);
+}
+
 inline int pbam_in::readHeader() {
   if(magic_header) {
     cout << "Header is already read\n";
@@ -135,6 +387,7 @@ inline int pbam_in::readHeader() {
   }
   
   free(u32c);
+  first_read_voffset = data_voffset(data_buf_cursor);
   return(0);
 }
 
@@ -0,0 +1,129 @@
+/* pbam_in_buildIndex.hpp pbam_in index building during a scan
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_in_buildIndex
+#define _pbam_in_buildIndex
+
+// Public functions:
+
+inline int pbam_in::BuildIndex(const int min_shift, const int depth) {
+  if(!magic_header) {
+    cout << "Header is not yet read\n";
+    return(-1);
+  }
+  if(scan_started) {
+    cout << "BuildIndex() must be called before fillReads()\n";
+    return(-1);
+  }
+  if(region_active) {
+    cout << "Indices cannot be built during region queries\n";
+    return(-1);
+  }
+  const bool csi = min_shift > 0;
+  if(built_index.build_start(n_ref, csi ? min_shift : 14, 
+      csi ? depth : 5, csi) != 0) {
+    cout << "Invalid min_shift (" << min_shift << ") or depth (" << depth 
+      << ") for CSI index\n";
+    return(-1);
+  }
+  for(unsigned int i = 0; i < chr_lens.size(); i++) {
+    if((uint64_t)chr_lens.at(i) > built_index.max_coord()) {
+      cout << "Chromosome " << chr_names.at(i) << " is too long for "
+        << (csi ? "this CSI" : "a BAI") << " index. Please use a CSI index "
+        << "with a larger depth\n";
+      built_index.clear();
+      return(-1);
+    }
+  }
+  index_batches.resize(threads_to_use);
+  for(unsigned int k = 0; k < index_batches.size(); k++) {
+    index_batches.at(k).clear();
+  }
+  index_build_state = 1;
+  return(0);
+}
+
+inline int pbam_in::WriteIndex(const std::string & index_file) {
+  if(index_build_state == 0) {
+    cout << "No index is being built. Please run BuildIndex() first\n";
+    return(-1);
+  }
+  if(index_build_state == -1) {
+    cout << "Index was not built as the BAM file is not coordinate-sorted\n";
+    return(-1);
+  }
+  if(index_build_state == 1) {
+    cout << "BAM file has not been read to the end. Please run fillReads() "
+      << "until it returns 1\n";
+    return(-1);
+  }
+  if(index_build_state == 2) {
+    built_index.build_finish();
+    index_batches.clear();
+    index_build_state = 3;
+  }
+  return(built_index.save(index_file));
+}
+
+// Internals
+
+/*
+  Each thread indexes the range of reads it is assigned by fillReads() into
+    its own batch. Batches are then merged in order, which only involves
+    one entry per run of reads in the same bin
+*/
+inline void pbam_in::index_reads() {
+  const unsigned int n_ranges = read_cursors.size();
+  if(index_batches.size() < n_ranges) index_batches.resize(n_ranges);
+  
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(threads_to_use) schedule(static,1)
+  #endif
+  for(unsigned int k = 0; k < n_ranges; k++) {
+    pbam_index_batch & batch = index_batches.at(k);
+    batch.clear();
+    size_t cursor = read_cursors.at(k);
+    uint64_t beg_off = data_voffset(cursor);
+    while(cursor < read_ptr_ends.at(k)) {
+      uint32_t block_size = 0;
+      memcpy(&block_size, data_buf + cursor, 4);
+      const pbam_core_32 * core = (const pbam_core_32 *)(data_buf + cursor + 4);
+      const uint64_t end_off = data_voffset(cursor + 4 + block_size);
+      built_index.build_add(batch, core->refID, core->pos, 
+        read_ref_end(data_buf + cursor), !(core->flag & 0x4), beg_off, end_off);
+      cursor += 4 + block_size;
+      beg_off = end_off;
+    }
+  }
+  
+  for(unsigned int k = 0; k < n_ranges; k++) {
+    if(built_index.build_merge(index_batches.at(k)) != 0) {
+      cout << "BAM file is not coordinate-sorted. The index will not be built\n";
+      built_index.clear();
+      index_batches.clear();
+      index_build_state = -1;
+      return;
+    }
+  }
+}
+
+#endif
@@ -30,14 +30,20 @@ SOFTWARE.  */
     in data_buf
   
   First wipes all data upstream of data_buf_cursor
-  If file_buf data remaining is below residual (FILE_BUFFER_CAP / chunks_per_file_buf)
+  If file_buf has no complete BGZF blocks remaining
     then runs swap_file_buffer
   If file_buf_cursor / chunks_per_file_buf > next_file_buf_cap / chunks_per_file_buf
     then runs read_file_chunk_to_spare_buffer
   Decompresses any data in file_buf to fill up to n_bytes_to_decompress in data_buf
 */
 inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
-  clean_data_buffer(n_bytes_to_decompress);
+  // In region queries, move on to the next chunk once the current one is done
+  if(region_active && region_chunk_done) {
+    if(region_next_chunk() != 0) return(0);
+  }
+  // A shard is finished once all reads starting in its blocks are handed out
+  if(shard_active && shard_done()) return(0);
+  if(clean_data_buffer() != 0) return(0);
   if(n_bytes_to_decompress < data_buf_cap) return(0);
   
   // The cursor to the data buffer to begin adding data
@@ -57,7 +63,7 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
         fill_file_buffer();
 
         // Ask to fill chunk_size amount to next_file_buf
-        spare_bytes_to_fill = std::min(chunk_size, IS_LENGTH - (size_t)tellg());
+        spare_bytes_to_fill = std::min(chunk_size, remaining_bytes());
       } else {
         // If only asking for small amount of data, do not use full buffer
         // This is typically only called when header is read
@@ -67,12 +73,8 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
     } else if(next_file_buf_cap > 0) {
       // Checks if need to swap file buffer
       swap_file_buffer_if_needed();
-      // If above is triggered:
-      // - Typically now file_buf_cap == FILE_BUFFER_CAP, file_buf_cursor == 0
-      
-      // NB file_buf_cap will only be < FILE_BUFFER_CAP if we have finished
-      //   reading from the file, given next_file_buf is already filled with
-      //   some data. In which case we would not be in this block.
+      // If above is triggered, next_file_buf is now empty (next_file_buf_cap
+      //   == 0) and will be filled again in the next call
       
       // Check if the file cursor has moved past the point where
       //   we should trigger filling more file chunks to next_file_buf
@@ -87,7 +89,10 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
     // If EOF, only check when buffer needs to be swapped
     swap_file_buffer_if_needed();
     spare_bytes_to_fill = 0;
-    if(file_buf_cap == file_buf_cursor) return(0);  // Finished reading file buffer
+    if(file_buf_cap == file_buf_cursor) {           // Finished reading file buffer
+      if(shard_extend_limit()) return(decompress(n_bytes_to_decompress));
+      return(0);
+    }
   }
 
   // No point asking for filling if next_file_buf is already at that level
@@ -96,8 +101,14 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
   // Set decomp_threads = threads_to_use - 1 to use asynchronous file reading
   //   using the remaining thread
   unsigned int decomp_threads = threads_to_use;
+  // With positional reads or streams, the spare buffer is filled by a separate thread
+  //   while all threads inflate; it is started just before decompression
+  size_t async_bytes_to_fill = 0;
   if(spare_bytes_to_fill > 0) {
-    if(decomp_threads > 1 && !multiFileRead) {
+    if(read_fd >= 0 || streaming) {
+      async_bytes_to_fill = spare_bytes_to_fill;
+      spare_bytes_to_fill = 0;
+    } else if(decomp_threads > 1 && !multiFileRead) {
         decomp_threads--;
     } else {
       read_file_chunk_to_spare_buffer(spare_bytes_to_fill);
@@ -105,200 +116,351 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
     }
   }
 
-  size_t src_cursor = 0;
-  size_t dest_cursor = 0;
-  
-  bool check_gzip_head = false;
-  uint32_t * u32; uint16_t * u16;
-
-  // Trial run to see if data limited at source file cap, or destination cap
-  unsigned int bgzf_count = 0;
-  while(src_cursor < chunk_size) {
-    if(file_buf_cursor + src_cursor + 28 > file_buf_cap) break;
+  // Map of complete BGZF blocks in file_buf; rebuilt only if file_buf changed,
+  //   or all blocks mapped so far have been decompressed
+  if(!block_map_valid || block_map_cursor >= block_map.size() ||
+      block_map.at(block_map_cursor).src_pos != file_buf_cursor) {
+    build_block_map();
+  }
 
-    // Check valid bamGzipHead every 1000 blocks
-    if(bgzf_count % 1000 == 0) check_gzip_head = true; // Check every 10000 blocks
-    bgzf_count++;
-    
-    if(check_gzip_head) {
-      if(strncmp(bamGzipHead, file_buf + file_buf_cursor + src_cursor, bamGzipHeadLength) != 0) {
-        break;  // Gzip head corrupt
-      } else {
-        check_gzip_head = false;
+  // Select the blocks to decompress, limited by source chunk size
+  //   and destination cap
+  const size_t first_block = block_map_cursor;
+  size_t last_block = first_block;
+  size_t src_max = 0; size_t dest_max = 0;
+  
+  // In region queries, blocks are selected up to the end of the chunk, and
+  //   the data of the final block is trimmed to the chunk end
+  const size_t buf_offset = file_buf_offset();
+  const uint64_t stop_coff = region_stop >> 16;
+  const uint32_t stop_uoff = (uint32_t)(region_stop & 0xffff);
+  size_t region_trim = 0;
+  // In shards, blocks from the read limit on (e.g. in a memory-mapped file)
+  //   are only decompressed if the shard's last read continues into them
+  bool shard_at_limit = false;
+  
+  while(last_block < block_map.size()) {
+    const pbam_bgzf_block & blk = block_map[last_block];
+    if(src_max + blk.src_size > chunk_size) break;
+    if(dest_max + blk.dest_size > max_bytes_to_decompress) break;
+    if(shard_active && buf_offset + blk.src_pos >= read_limit()) {
+      shard_at_limit = true;
+      break;
+    }
+    if(region_active) {
+      const uint64_t blk_coff = buf_offset + blk.src_pos;
+      if(blk_coff > stop_coff || (blk_coff == stop_coff && stop_uoff == 0)) {
+        region_chunk_done = true;
+        break;
+      }
+      if(blk_coff == stop_coff) {
+        region_trim = blk.dest_size - std::min(stop_uoff, blk.dest_size);
+        region_chunk_done = true;
       }
     }
-
-    // Check entire bgzf block lies within file_buf
-    u16 = (uint16_t*)(file_buf + file_buf_cursor + src_cursor + 16);
-    if(file_buf_cursor + src_cursor + (*u16+1) > file_buf_cap) break;
-
-    // Check entire bgzf block lies within chunk_size
-    if(src_cursor + (*u16+1) > chunk_size) break;
-    
-    // Abort if filling dest with extra data will lead to overflow
-    u32 = (uint32_t*)(file_buf + file_buf_cursor + src_cursor + (*u16+1) - 4);
-    if(dest_cursor + *u32 > max_bytes_to_decompress) break;   
-    
-    // Increment cursors to next compressed / decompressed bgzf block
-    src_cursor += *u16 + 1;
-    dest_cursor += *u32;
+    src_max += blk.src_size;
+    dest_max += blk.dest_size;
+    last_block++;
+    if(region_active && region_chunk_done) break;
   }
 
-  if(check_gzip_head) {
+  if(last_block == first_block && last_block == block_map.size() && 
+      block_map_corrupt) {
     cout << "BGZF blocks corrupt\n";
     return(0);
   }
+  
+  if(region_active && last_block == first_block) {
+    // Chunk is finished, or runs past the end of the file
+    if(!region_chunk_done && eof() && next_file_buf_cap == 0 && 
+        !file_buf_has_block()) {
+      region_chunk_done = true;
+    }
+    if(region_chunk_done) return(decompress(n_bytes_to_decompress));
+  }
+  if(shard_at_limit && last_block == first_block && shard_extend_limit()) {
+    return(decompress(n_bytes_to_decompress));
+  }
 
-  // Stores how much data to decompress,
-  //   and how much space to allocate to decompressed data
-  size_t src_max = src_cursor; size_t dest_max = dest_cursor;
-  src_cursor = 0; dest_cursor = 0;
-
-// Divide the bgzf blocks among the number of decompression threads
-
-  std::vector<size_t> src_bgzf_pos;   // source cursors
-  std::vector<size_t> dest_bgzf_pos;  // dest cursors    
-  std::vector<size_t> src_bgzf_cap;   // source cap: when thread should stop reading
-  std::vector<size_t> dest_bgzf_cap;  // dest cap    
+  // Destination of each block within data_buf
+  const size_t n_blocks = last_block - first_block;
+  std::vector<size_t> dest_bgzf_pos(n_blocks);
+  size_t dest_cursor = decomp_cursor;
+  for(size_t b = 0; b < n_blocks; b++) {
+    dest_bgzf_pos[b] = dest_cursor;
+    dest_cursor += block_map[first_block + b].dest_size;
+  }
 
-  // Ensures src_divider * decomp_threads > src_max
-  size_t src_divider = 1 + (src_max / decomp_threads);
-  size_t next_divider = std::min(src_divider, src_max);
+  // Now comes the multi-threaded decompression:
+  bool error_occurred = false;
   
-  // Profile the file and increment until the destination buffer is reached
-  unsigned int threads_accounted_for = 0;
-  src_bgzf_pos.push_back(file_buf_cursor + src_cursor);  
-  dest_bgzf_pos.push_back(decomp_cursor + dest_cursor);
-  while(src_cursor < src_max) {
-    // Increments cursors at next comp / decomp BGZF block
-    u16 = (uint16_t*)(file_buf + file_buf_cursor + src_cursor + 16);
-    u32 = (uint32_t*)(file_buf + file_buf_cursor + src_cursor + (*u16+1) - 4);
-    src_cursor += *u16 + 1;
-    dest_cursor += *u32;   
-
-    // This block will trigger a maximum (decomp_threads - 1) times
-    //   since src_divider * decomp_threads > src_max
-    if(src_cursor > next_divider) {
-      src_bgzf_cap.push_back(file_buf_cursor + src_cursor);  
-      dest_bgzf_cap.push_back(decomp_cursor + dest_cursor);
-      src_bgzf_pos.push_back(file_buf_cursor + src_cursor);  
-      dest_bgzf_pos.push_back(decomp_cursor + dest_cursor);
-      next_divider = std::min(next_divider + src_divider, src_max);
-      threads_accounted_for++;
+  // Decompressor contexts persist across calls; one is created per thread
+  if(!inflaters || n_inflaters < decomp_threads) {
+    if(init_inflaters() != 0) {
+      cout << "Failed to initialize BGZF decompressors\n";
+      return(0);
     }
   }
-  // Now, src_cursor == src_max and dest_cursor == dest_max
-  // Be pedantic and check this
-  if(src_cursor != src_max || dest_cursor != dest_max) {
-    cout << "Error occurred during BGZF block counting\n"
-      << "This should not have occurred. Please report to mod author\n";
-    return(0);
+  if(thread_busy_secs.size() < decomp_threads) {
+    thread_busy_secs.resize(threads_to_use, 0);
+    thread_block_counts.resize(threads_to_use, 0);
   }
   
-  // threads_accounted_for == (decomp_threads - 1)
-  //   but just in case it is not:
-  while(threads_accounted_for < decomp_threads - 1) {
-    src_bgzf_cap.push_back(file_buf_cursor + src_cursor);  
-    dest_bgzf_cap.push_back(decomp_cursor + dest_cursor);
-    src_bgzf_pos.push_back(file_buf_cursor + src_cursor);  
-    dest_bgzf_pos.push_back(decomp_cursor + dest_cursor);
-    threads_accounted_for++;
-  }  
-
-  // Fill last cap
-  src_bgzf_cap.push_back(file_buf_cursor + src_max);   
-  dest_bgzf_cap.push_back(decomp_cursor + dest_max);
-   
-  // Here, vector.size() == decomp_cursor
-   
-  // Now comes the multi-threaded decompression:
-  bool error_occurred = false;
+  /*
+    Blocks are handed out dynamically via a shared block cursor, so that
+      threads given blocks that are quick to inflate (e.g. highly compressed)
+      take on more blocks, and all threads finish at around the same time
+  */
+  size_t next_block = 0;
   
-  std::vector<z_stream> thread_streams(decomp_threads);
+  std::thread reader;
+  if(async_bytes_to_fill > 0) {
+    reader = std::thread([this, async_bytes_to_fill]() {
+      read_file_chunk_to_spare_buffer(async_bytes_to_fill);
+    });
+  }
   
   #ifdef _OPENMP
-  #pragma omp parallel for num_threads(threads_to_use) schedule(static,1)
+  #pragma omp parallel num_threads(threads_to_use)
   #endif
-  for(unsigned int k = 0; k < threads_to_use; k++) {
+  {
+    unsigned int k = 0;
+    #ifdef _OPENMP
+    k = (unsigned int)omp_get_thread_num();
+    #endif
     if(k == decomp_threads) {
       // In asynchronous read, decomp_threads == threads_to_use - 1
       // Therefore, this last thread is used to prime spare file buffer
       read_file_chunk_to_spare_buffer(spare_bytes_to_fill);
       spare_bytes_to_fill = 0;
-    } else {
-      size_t thread_src_cursor = src_bgzf_pos.at(k);
-      size_t thread_dest_cursor = dest_bgzf_pos.at(k);
-      
-      uint32_t crc = 0;
-      uint32_t * crc_check;
-      uint16_t * src_size;
-      uint32_t * dest_size;
-
-      z_stream * zs = &(thread_streams.at(k));
-      while(thread_src_cursor < src_bgzf_cap.at(k) && !error_occurred) {
-        src_size = (uint16_t *)(file_buf + thread_src_cursor + 16);
-        crc_check = (uint32_t *)(file_buf + thread_src_cursor + *src_size+1 - 8);
-        dest_size = (uint32_t *)(file_buf + thread_src_cursor + *src_size+1 - 4);
-
-        if(*dest_size > 0) {
-          // zs = new z_stream;
-          zs->zalloc = NULL; zs->zfree = NULL; zs->msg = NULL;
-          zs->next_in = (Bytef*)(file_buf + thread_src_cursor + 18);
-          zs->avail_in = *src_size + 1 - 18;
-          zs->next_out = (Bytef*)(data_buf + thread_dest_cursor);
-          zs->avail_out = *dest_size;
-
-          int ret = inflateInit2(zs, -15);
-          if(ret != Z_OK) {
-            cout << "Exception during BAM decompression - inflateInit2() fail: (" << ret << ") \n";
+    } else if(k < decomp_threads) {
+      std::chrono::steady_clock::time_point thread_start = 
+        std::chrono::steady_clock::now();
+      size_t thread_blocks = 0;
+
+      size_t b;
+      bool check_crc;
+
+      pbam_inflater * inf = &(inflaters[k]);
+      bool stop = false;
+      while(!stop) {
+        #ifdef _OPENMP
+        #pragma omp atomic capture
+        #endif
+        b = next_block++;
+        if(b >= n_blocks) break;
+        
+        const pbam_bgzf_block & blk = block_map[first_block + b];
+        thread_blocks++;
+
+        if(blk.dest_size > 0) {
+          // Blocks verified follow crc_check_interval (0 = none)
+          check_crc = crc_check_interval > 0 && b % crc_check_interval == 0;
+
+          int ret = inf->inflate_block(
+            file_buf + blk.src_pos, blk.src_size,
+            data_buf + dest_bgzf_pos[b], blk.dest_size, check_crc
+          );
+          if(ret == -2) {
+            cout << "CRC fail during BAM decompression\n";
+          }
+          if(ret != 0) {
             #ifdef _OPENMP
-            #pragma omp critical
+            #pragma omp atomic write
             #endif
             error_occurred = true;
           }
-          if(!error_occurred) {
-            ret = inflate(zs, Z_FINISH);
-            if(ret != Z_OK && ret != Z_STREAM_END) {
-              cout << "Exception during BAM decompression - inflate() fail: (" << ret << ") \n";
-              #ifdef _OPENMP
-              #pragma omp critical
-              #endif
-              error_occurred = true;
-            }
-          }
-          if(!error_occurred) {
-            ret = inflateEnd(zs);
-            crc = crc32(crc32(0L, NULL, 0L), (Bytef*)(data_buf + thread_dest_cursor), *dest_size);
-            if(*crc_check != crc) {
-              cout << "CRC fail during BAM decompression\n";
-              #ifdef _OPENMP
-              #pragma omp critical
-              #endif
-              error_occurred = true;
-            }
-          }
-          // delete zs;
         }
-        thread_src_cursor += *src_size + 1;
-        thread_dest_cursor += *dest_size;
+        // Other threads stop taking blocks once any block fails
+        #ifdef _OPENMP
+        #pragma omp atomic read
+        #endif
+        stop = error_occurred;
       }
+      thread_busy_secs.at(k) += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - thread_start).count();
+      thread_block_counts.at(k) += thread_blocks;
     }
-    
+  }
+  
+  if(reader.joinable()) reader.join();
+  
+  // Fewer threads than requested may have been spawned; 
+  //   make sure spare buffer is primed and all blocks are decompressed
+  if(spare_bytes_to_fill > 0) {
+    read_file_chunk_to_spare_buffer(spare_bytes_to_fill);
+    spare_bytes_to_fill = 0;
+  }
+  if(!error_occurred && next_block < n_blocks) {
+    cout << "Not all BGZF blocks were decompressed\n";
+    error_occurred = true;
   }
   
   if(error_occurred) {
     cout << "Decompression failed at " << GetProgress() << " bytes\n";
     return(0);
   }
-  file_buf_cursor = src_bgzf_cap.at(src_bgzf_cap.size() - 1);
-  data_buf_cap = dest_bgzf_cap.at(dest_bgzf_cap.size() - 1);
+  file_buf_cursor += src_max;
+  block_map_cursor = last_block;
+  data_buf_cap = decomp_cursor + dest_max - region_trim;
+  if(!region_active && n_blocks > 0) {
+    // Record where each block came from, to convert positions in data_buf
+    //   to virtual offsets
+    pbam_block_voffset bv;
+    for(size_t b = 0; b < n_blocks; b++) {
+      const pbam_bgzf_block & blk = block_map[first_block + b];
+      bv.ustart = data_stream_pos + (dest_bgzf_pos[b] - decomp_cursor);
+      bv.coff = buf_offset + blk.src_pos;
+      bv.dest_size = blk.dest_size;
+      block_voffsets.push_back(bv);
+      if(shard_active && shard_stop == (uint64_t)-1 && 
+          bv.coff + blk.src_size >= shard_end) {
+        // Reads starting after the shard's last block belong to the next shard
+        shard_stop = bv.ustart + (bv.coff < shard_end ? bv.dest_size : 0);
+      }
+    }
+    next_block_coff = bv.coff + block_map[last_block - 1].src_size;
+    data_stream_pos += dest_max;
+  }
+  if(block_skip > 0 && n_blocks > 0) {
+    // After a seek, the next read starts block_skip bytes into the first block
+    data_buf_cursor += std::min((size_t)block_skip, data_buf_cap - data_buf_cursor);
+    block_skip = 0;
+  }
+  if(region_active && region_chunk_done && data_buf_cap == data_buf_cursor) {
+    return(decompress(n_bytes_to_decompress));
+  }
 
-  return(dest_cursor);
+  return(dest_max - region_trim);
 }
 
 // *************** Internal functions run by decompress() *********************
 
-inline int pbam_in::read_file_to_buffer(char * buf, const size_t len) {
+/*
+  Walks the BGZF headers from src_start, appending each complete block to
+    blocks, until the next block starts at or after src_end (or the end of
+    file_buf is reached).
+  Returns the position after the last block. Sets corrupt if a block with an
+    invalid header is found.
+*/
+inline size_t pbam_in::scan_bgzf_blocks(
+    const size_t src_start, const size_t src_end,
+    std::vector<pbam_bgzf_block> & blocks, bool & corrupt
+) {
+  pbam_bgzf_block blk;
+  uint16_t * u16; uint32_t * u32;
+  size_t src_cursor = src_start;
+  corrupt = false;
+  while(src_cursor < src_end) {
+    if(src_cursor + 28 > file_buf_cap) break;
+    if(strncmp(bamGzipHead, file_buf + src_cursor, bamGzipHeadLength) != 0) {
+      corrupt = true;
+      break;
+    }
+    // Check entire bgzf block lies within file_buf
+    u16 = (uint16_t*)(file_buf + src_cursor + 16);
+    if(src_cursor + (*u16+1) > file_buf_cap) break;
+    u32 = (uint32_t*)(file_buf + src_cursor + (*u16+1) - 4);
+    
+    blk.src_pos = src_cursor;
+    blk.src_size = *u16 + 1;
+    blk.dest_size = *u32;
+    blocks.push_back(blk);
+    src_cursor += blk.src_size;
+  }
+  return(src_cursor);
+}
+
+/*
+  Builds the map of all complete BGZF blocks in file_buf from file_buf_cursor.
+  
+  For large buffers, the buffer is split into one segment per thread. Each
+    thread finds the first BGZF header in its segment and walks the blocks
+    to the end of its segment. The segments are joined if each one starts
+    exactly where the previous one ended; otherwise (e.g. a BGZF header-like
+    sequence within compressed data), the buffer is walked in a single pass.
+*/
+inline void pbam_in::build_block_map() {
+  block_map.clear();
+  block_map_cursor = 0;
+  block_map_corrupt = false;
+  block_map_valid = true;
+  
+  const size_t src_start = file_buf_cursor;
+  // A memory-mapped file is mapped in windows of FILE_BUFFER_CAP bytes, so
+  //   that only the pages about to be inflated are faulted in
+  const size_t src_stop = map_buf ? 
+    std::min(file_buf_cap, file_buf_cursor + FILE_BUFFER_CAP) : file_buf_cap;
+  const size_t src_len = src_stop - file_buf_cursor;
+  if(map_buf) advise_map(src_start, src_stop);
+  const unsigned int n_seg = threads_to_use;
+  
+  if(n_seg > 1 && src_len > block_map_parallel_min) {
+    std::vector< std::vector<pbam_bgzf_block> > seg_blocks(n_seg);
+    std::vector<size_t> seg_first(n_seg);
+    std::vector<size_t> seg_end(n_seg);
+    std::vector<char> seg_corrupt(n_seg);
+    
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_seg) schedule(static,1)
+    #endif
+    for(unsigned int k = 0; k < n_seg; k++) {
+      size_t from = src_start + (src_len / n_seg) * k;
+      size_t to = (k == n_seg - 1) ? src_stop : 
+        src_start + (src_len / n_seg) * (k + 1);
+      
+      // Find the first BGZF header at or after from
+      if(k > 0) {
+        while(from + bamGzipHeadLength <= file_buf_cap && 
+            !is_bgzf_header(file_buf + from)) {
+          from++;
+        }
+      }
+      seg_first.at(k) = from;
+      bool corrupt = false;
+      seg_blocks.at(k).reserve(1 + (to - std::min(from, to)) / 16384);
+      seg_end.at(k) = scan_bgzf_blocks(from, to, seg_blocks.at(k), corrupt);
+      seg_corrupt.at(k) = corrupt;
+    }
+    
+    // Check segments join up
+    bool joined = true;
+    for(unsigned int k = 0; k + 1 < n_seg; k++) {
+      if(seg_corrupt.at(k) || seg_end.at(k) != seg_first.at(k + 1)) {
+        joined = false;
+        break;
+      }
+    }
+    if(joined) {
+      size_t total = 0;
+      for(unsigned int k = 0; k < n_seg; k++) total += seg_blocks.at(k).size();
+      block_map.reserve(total);
+      for(unsigned int k = 0; k < n_seg; k++) {
+        block_map.insert(block_map.end(), 
+          seg_blocks.at(k).begin(), seg_blocks.at(k).end());
+      }
+      block_map_corrupt = seg_corrupt.at(n_seg - 1);
+      return;
+    }
+  }
+  
+  bool corrupt = false;
+  scan_bgzf_blocks(src_start, src_stop, block_map, corrupt);
+  block_map_corrupt = corrupt;
+}
+
+inline size_t pbam_in::read_file_to_buffer(char * buf, const size_t len) {
+  if(streaming) return(read_stream_to_buffer(buf, len));
+  #ifdef OMPBAM_HAS_POSIX_IO
+  if(read_fd >= 0) {
+    // Positional reads from the persistent descriptor; IN only tracks position
+    const size_t cur_pos = (size_t)tellg();
+    IN->seekg(len, std::ios_base::cur);
+    if(pread_to_buffer(buf, len, cur_pos) != 0) return(0);
+    return(len);
+  }
+  #endif
+
   std::vector<size_t> len_chunks;
   std::vector<size_t> len_starts;
   
@@ -332,153 +494,242 @@ inline int pbam_in::read_file_to_buffer(char * buf, const size_t len) {
   } else {
     IN->read(buf, len);
   }
-  return(0);
+  return(len);
 }
 
-inline void pbam_in::move_residual_data(
-    char** buf,                     // Pointer to char pointer (for file/data buffer)
-    size_t & cursor, size_t & cap,  // Reference to buffer cursor / caps
-    const size_t new_cap            // Desired size of new buffer
-) {
-  char * data_tmp;
-  char * temp_buffer;
-  size_t residual = cap - cursor;
-  if(residual > 0) {
-    // have to move bytes around
-    temp_buffer = (char*)malloc(residual + 1);
-    memcpy(temp_buffer, *buf + cursor, residual);
-  
-    *buf = (char*)realloc(data_tmp = *buf, 
-      std::max(new_cap + 1, residual + 1));
-    memcpy(*buf, temp_buffer, residual);
-    free(temp_buffer);
-    
-    cap = residual;
-  } else {
-    *buf = (char*)realloc(data_tmp = *buf, new_cap + 1);
-    cap = 0;
+/*
+  Reads sequentially from stream_fd or stream_in until len bytes are read or
+    the stream ends. At the end of the stream, checks that the last bytes read
+    were the BGZF EOF block.
+*/
+inline size_t pbam_in::read_stream_to_buffer(char * buf, const size_t len) {
+  size_t done = 0;
+  while(done < len && !stream_eof) {
+    size_t n = 0;
+    if(stream_fd >= 0) {
+      #ifdef OMPBAM_HAS_POSIX_IO
+      ssize_t ret = ::read(stream_fd, buf + done, len - done);
+      if(ret < 0 && errno == EINTR) continue;
+      if(ret < 0) {
+        cout << "Error reading BAM stream\n";
+        error_state = -1;
+      }
+      n = ret > 0 ? (size_t)ret : 0;
+      #endif
+    } else if(stream_in) {
+      stream_in->read(buf + done, len - done);
+      n = (size_t)stream_in->gcount();
+    }
+    if(n == 0) {
+      stream_eof = true;
+      break;
+    }
+    done += n;
+  }
+  stream_pos += done;
+  IS_LENGTH = stream_pos;
+
+  // Keep the last bamEOFlength bytes read
+  if(done >= (size_t)bamEOFlength) {
+    memcpy(stream_tail, buf + done - bamEOFlength, bamEOFlength);
+    stream_tail_len = bamEOFlength;
+  } else if(done > 0) {
+    size_t keep = std::min(stream_tail_len, bamEOFlength - done);
+    memmove(stream_tail, stream_tail + stream_tail_len - keep, keep);
+    memcpy(stream_tail + keep, buf, done);
+    stream_tail_len = keep + done;
+  }
+  if(stream_eof && (stream_tail_len < (size_t)bamEOFlength || 
+      memcmp(stream_tail, bamEOF, bamEOFlength) != 0)) {
+    cout << "Error reading BAM stream - EOF bit corrupt. "
+      << "Perhaps this stream is truncated?\n";
+    error_state = -1;
   }
-  cursor = 0;
+  return(done);
 }
 
-inline int pbam_in::clean_data_buffer(const size_t n_bytes_to_decompress) {
-  // Remove residual bytes to beginning of buffer:
-  // cout << "clean_data_buffer\n";
-  char * data_tmp;
-  char * temp_buffer;
-  size_t residual = data_buf_cap-data_buf_cursor;
+/*
+  Reads len bytes at the given file offset into buf. If multiFileRead is set,
+    the range is split into one segment per thread (each at least 1 Mb), and
+    segments are read concurrently using pread() on the same descriptor.
+  Returns 0 if success, or -1 if error
+*/
+inline int pbam_in::pread_to_buffer(char * buf, const size_t len, 
+    const size_t offset) {
+  #ifdef OMPBAM_HAS_POSIX_IO
+  unsigned int n_workers = multiFileRead ? threads_to_use : 1;
+  n_workers = std::max(1u, std::min(n_workers, (unsigned int)(len / 1048576)));
   
-  if(residual > 0) {
-    // have to move bytes around
-    temp_buffer = (char*)malloc(residual + 1);
-    memcpy(temp_buffer, data_buf + data_buf_cursor, residual);
+  // Segment boundaries are aligned to pbamIOAlign in the file
+  size_t seg_len = (len / n_workers) - (len / n_workers) % pbamIOAlign;
+  if(seg_len == 0) n_workers = 1;
   
-    data_buf = (char*)realloc(data_tmp = data_buf, std::max(n_bytes_to_decompress + 1, residual + 1));
-    memcpy(data_buf, temp_buffer, residual);
-    free(temp_buffer);
-    
-    data_buf_cap = residual;
-  } else {
-    data_buf = (char*)realloc(data_tmp = data_buf, n_bytes_to_decompress + 1);
-    data_buf_cap = 0;
+  std::vector<int> ret(n_workers, 0);
+  std::vector<std::thread> workers;
+  for(unsigned int k = 1; k < n_workers; k++) {
+    size_t from = seg_len * k;
+    size_t to = (k == n_workers - 1) ? len : seg_len * (k + 1);
+    workers.push_back(std::thread([this, &ret, buf, from, to, offset, k]() {
+      ret.at(k) = pread_segment(buf + from, to - from, offset + from);
+    }));
+  }
+  ret.at(0) = pread_segment(buf, n_workers == 1 ? len : seg_len, offset);
+  for(unsigned int k = 0; k < workers.size(); k++) workers.at(k).join();
+
+  for(unsigned int k = 0; k < n_workers; k++) {
+    if(ret.at(k) != 0) {
+      cout << "Failed to read from BAM file at " << offset << " bytes\n";
+      return(-1);
+    }
   }
+  return(0);
+  #else
+  return(-1);
+  #endif
+}
+
+// Reads len bytes at offset. The aligned middle of the range is read using
+//   direct_fd if its address and file offset are equally aligned
+inline int pbam_in::pread_segment(char * buf, const size_t len, 
+    const size_t offset) {
+  #ifdef OMPBAM_HAS_POSIX_IO
+  size_t head = len; size_t mid = 0;
+  if(direct_fd >= 0 && ((size_t)buf - offset) % pbamIOAlign == 0) {
+    head = std::min(len, (pbamIOAlign - offset % pbamIOAlign) % pbamIOAlign);
+    mid = (len - head) - (len - head) % pbamIOAlign;
+  }
+  size_t done = 0;
+  while(done < len) {
+    // Read the head and tail using read_fd, the middle using direct_fd
+    const bool direct = done >= head && done < head + mid;
+    const size_t stop = direct ? head + mid : (done < head ? head : len);
+    ssize_t n = pread(direct ? direct_fd : read_fd, buf + done, 
+      stop - done, (off_t)(offset + done));
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && direct) {
+      // e.g. EINVAL if the filesystem does not support O_DIRECT
+      mid = 0; head = done;
+      continue;
+    }
+    if(n <= 0) return(-1);
+    done += (size_t)n;
+    if(direct && done % pbamIOAlign != 0) {
+      // A short direct read: read the rest using read_fd
+      mid = 0; head = done;
+    }
+  }
+  return(0);
+  #else
+  return(-1);
+  #endif
+}
+
+/*
+  Allocates the file buffers once, at their full size. Each file buffer has
+    bgzfMaxBlockLength bytes of headroom before the region file data is read
+    into, so that a partial BGZF block at the end of one buffer can be placed
+    directly in front of the data in the other buffer (see 
+    swap_file_buffer_if_needed)
+  Buffers are aligned to pbamIOAlign for O_DIRECT reads
+*/
+inline int pbam_in::alloc_file_buffers() {
+  char ** bufs[2] = {&file_buf, &next_file_buf};
+  for(unsigned int i = 0; i < 2; i++) {
+    if(*bufs[i]) continue;
+    #ifdef OMPBAM_HAS_POSIX_IO
+    void * ptr = NULL;
+    if(posix_memalign(&ptr, pbamIOAlign, file_buf_size() + 1) == 0) {
+      *bufs[i] = (char*)ptr;
+    }
+    #else
+    *bufs[i] = (char*)malloc(file_buf_size() + 1);
+    #endif
+  }
+  if(!file_buf || !next_file_buf) {
+    cout << "Failed to allocate file buffers\n";
+    return(-1);
+  }
+  return(0);
+}
+
+// Returns whether file_buf contains at least one complete BGZF block
+//   from file_buf_cursor
+inline bool pbam_in::file_buf_has_block() {
+  size_t residual = file_buf_cap - file_buf_cursor;
+  // A partial block is always smaller than bgzfMaxBlockLength
+  if(residual > bgzfMaxBlockLength) return(true);
+  if(residual < 28) return(false);
+  uint16_t * u16 = (uint16_t*)(file_buf + file_buf_cursor + 16);
+  return((size_t)(*u16 + 1) <= residual);
+}
+
+/*
+  Removes all data upstream of data_buf_cursor. Then, sets data_buf_cursor to 0.
+  data_buf is allocated once (DATA_BUFFER_CAP); only the residual incomplete
+    read is moved
+*/
+inline int pbam_in::clean_data_buffer() {
+  if(!data_buf) {
+    data_buf = (char*)malloc(DATA_BUFFER_CAP + 1);
+    data_buf_cap = 0; data_buf_cursor = 0;
+    if(!data_buf) {
+      cout << "Failed to allocate data buffer\n";
+      return(-1);
+    }
+  }
+  size_t residual = data_buf_cap - data_buf_cursor;
+  if(residual > 0 && data_buf_cursor > 0) {
+    memmove(data_buf, data_buf + data_buf_cursor, residual);
+  }
+  data_buf_cap = residual;
   data_buf_cursor = 0;
 
   return(0);
 }
 
 /* 
-  If bytes remaining in primary file buffer is less than chunk_size,
-  re-initialises file_buf, copying residual data from existing file_buf,
-  and copies data from next_file_buf, upto FILE_BUFFER_CAP
+  Once file_buf has no complete BGZF blocks left, swaps file_buf with 
+    next_file_buf. The partial block at the end of file_buf (if any) is copied
+    into the headroom of next_file_buf, right before its data.
+  No other data is copied, and neither buffer is reallocated.
 */
 inline int pbam_in::swap_file_buffer_if_needed() {
-  // Transfers residual data from file_buf to next_file_buf:
   if(next_file_buf_cap == 0) return(1);
-  size_t chunk_size = (size_t)(FILE_BUFFER_CAP / chunks_per_file_buf);
-  if(file_buf_cap  - file_buf_cursor > chunk_size) return(1);
-  
-  char * file_tmp;
-  char * residual_data_buffer;
-  size_t residual = file_buf_cap-file_buf_cursor;
-  // Remove residual bytes to beginning of buffer:
-  if(residual > 0) {
-    // have to move bytes around
-    residual_data_buffer = (char*)malloc(residual + 1);
-    memcpy(residual_data_buffer, file_buf + file_buf_cursor, residual);
+  if(file_buf_has_block()) return(1);
   
-    file_buf = (char*)realloc(file_tmp = file_buf, FILE_BUFFER_CAP + 1);
-    memcpy(file_buf, residual_data_buffer, residual);
-    free(residual_data_buffer);
-  } else {
-    // residual == 0
-    file_buf = (char*)realloc(file_tmp = file_buf, FILE_BUFFER_CAP + 1);
-  }
-  
-  file_buf_cap = residual;
-  file_buf_cursor = 0;
-  
-  if(next_file_buf_cap <= FILE_BUFFER_CAP - file_buf_cap) {
-    // If next_file_buf fits inside cap:
-    //   transfer all contents over and free next_file_buf
-    // Typically only happens when we have finished reading the BAM file
-
-    memcpy(file_buf + file_buf_cap, next_file_buf, next_file_buf_cap);
-    file_buf_cap += next_file_buf_cap;
-
-    free(next_file_buf); next_file_buf = NULL;
-    next_file_buf_cap = 0;
-  } else {
-  // copies some data to fill file_buf to the brim
-    memcpy(file_buf + file_buf_cap, next_file_buf, FILE_BUFFER_CAP - file_buf_cap);
-    file_buf_cap = FILE_BUFFER_CAP;
-
-    // Move data around in secondary buffer so that it starts at zero:
-    size_t residual2 = next_file_buf_cap - (FILE_BUFFER_CAP - residual);
-    
-    residual_data_buffer = (char*)malloc(residual2 + 1);
-    memcpy(residual_data_buffer, next_file_buf + FILE_BUFFER_CAP - residual, residual2);
+  size_t residual = file_buf_cap - file_buf_cursor;
+  char * new_start = next_file_buf + next_file_buf_start - residual;
+  if(residual > 0) memcpy(new_start, file_buf + file_buf_cursor, residual);
   
-    next_file_buf = (char*)realloc(file_tmp = next_file_buf, FILE_BUFFER_CAP + 1);
-    memcpy(next_file_buf, residual_data_buffer, residual2);
-    free(residual_data_buffer);  
-    next_file_buf_cap = residual2;
-  }
+  std::swap(file_buf, next_file_buf);
+  file_buf_cursor = next_file_buf_start - residual;
+  file_buf_cap = next_file_buf_start + next_file_buf_cap;
+  next_file_buf_cap = 0;
+  block_map_valid = false;
   return(0);
 }
 
 /*  
-  Read from file to fill n_bytes of file_buf
-  First removes data upstream of file cursor
-  Then fills buffer to n_bytes
+  Read from file so that file_buf holds n_bytes of unprocessed data.
+  Data is appended after file_buf_cap. Only if the buffer is full are the
+    residual bytes moved to the beginning of the buffer.
 */
 inline size_t pbam_in::load_from_file(const size_t n_bytes) {
-  char * file_tmp;
-  char * residual_data_buffer;
   size_t residual = file_buf_cap-file_buf_cursor;
 
   size_t n_bytes_to_load =  std::min( std::max(n_bytes, residual) , FILE_BUFFER_CAP);  // Cap at file buffer
-  size_t n_bytes_to_read = std::min(n_bytes_to_load - residual, IS_LENGTH - tellg());
+  size_t n_bytes_to_read = std::min(n_bytes_to_load - residual, remaining_bytes());
   if(n_bytes_to_read == 0) return(0);
-  // cout << "\nload_from file: n_bytes_to_read = " << n_bytes_to_read << '\n';
-  // Remove residual bytes to beginning of buffer:
-  if(residual > 0) {
-    // have to move bytes around
-    residual_data_buffer = (char*)malloc(residual + 1);
-    memcpy(residual_data_buffer, file_buf + file_buf_cursor, residual);
-  
-    file_buf = (char*)realloc(file_tmp = file_buf, n_bytes_to_read + residual + 1);
-    memcpy(file_buf, residual_data_buffer, residual);
-    free(residual_data_buffer);
-  } else {
-    // residual == 0
-    file_buf = (char*)realloc(file_tmp = file_buf, n_bytes_to_read + 1);
+  if(alloc_file_buffers() != 0) return(0);
+
+  if(file_buf_cap + n_bytes_to_read > file_buf_size()) {
+    if(residual > 0) memmove(file_buf, file_buf + file_buf_cursor, residual);
+    file_buf_cursor = 0;
+    file_buf_cap = residual;
   }
-  file_buf_cursor = 0;
-  file_buf_cap = residual;
+  block_map_valid = false;
   
-  // IN->read(file_buf + file_buf_cap, n_bytes_to_read);
-  read_file_to_buffer(file_buf + file_buf_cap, n_bytes_to_read);
+  n_bytes_to_read = read_file_to_buffer(file_buf + file_buf_cap, n_bytes_to_read);
 
   file_buf_cap += n_bytes_to_read;
   return(n_bytes_to_read);
@@ -489,7 +740,9 @@ inline size_t pbam_in::fill_file_buffer() {
 }
 
 /*  
-  Read from file to fill n_bytes of next_file_buf
+  Read from file to fill n_bytes of next_file_buf (after its headroom)
+  The data starts at the same offset modulo pbamIOAlign as in the file, so
+    that most of it can be read using O_DIRECT
 */
 inline size_t pbam_in::read_file_chunk_to_spare_buffer(const size_t n_bytes) {
   // There is no residual to move in next_file_buf
@@ -499,20 +752,18 @@ inline size_t pbam_in::read_file_chunk_to_spare_buffer(const size_t n_bytes) {
   if(FILE_BUFFER_CAP <= residual) return(0);
   
   size_t n_bytes_to_load =  std::min( std::max(n_bytes, residual) , FILE_BUFFER_CAP);  // Cap at file buffer
-  size_t n_bytes_to_read = std::min(n_bytes_to_load - residual, IS_LENGTH - tellg());  
+  size_t n_bytes_to_read = std::min(n_bytes_to_load - residual, remaining_bytes());  
   if(n_bytes_to_read == 0) return(0);
-  
-  // Initialize next_file_buf here:
+  if(alloc_file_buffers() != 0) return(0);
   if(next_file_buf_cap == 0) {
-    char * file_tmp;
-    next_file_buf = (char*)realloc(file_tmp = next_file_buf, FILE_BUFFER_CAP + 1);
+    next_file_buf_start = bgzfMaxBlockLength + tellg() % pbamIOAlign;
   }
   
-  read_file_to_buffer(next_file_buf + next_file_buf_cap, n_bytes_to_read);
+  n_bytes_to_read = read_file_to_buffer(
+    next_file_buf + next_file_buf_start + next_file_buf_cap, n_bytes_to_read);
   
   next_file_buf_cap += n_bytes_to_read;
   return(n_bytes_to_read);
 }
 
-
 #endif
@@ -51,35 +51,97 @@ inline int pbam_in::fillReads() {
   // Clear read pointers:
   read_cursors.resize(0);
   read_ptr_ends.resize(0);
+  scan_started = true;
   
-  // Call decompress
-  size_t bytes_decompressed = decompress(DATA_BUFFER_CAP);
+  // Call decompress, or collect the batch decompressed in the background
+  size_t bytes_decompressed = 0;
+  if(pipe_running) {
+    bytes_decompressed = pipeline_wait();
+  } else if(chrom_batching && reads_held && chrom_batch_ready()) {
+    // The next chromosome is already decompressed; this avoids moving the
+    //   remaining data once per (small) chromosome
+    bytes_decompressed = data_buf_cap - data_buf_cursor;
+  } else {
+    bytes_decompressed = decompress(DATA_BUFFER_CAP);
+  }
+  // After SetByteRange(), skip to the first read starting in the shard. The 
+  //   reads of a shard may also continue past its read limit
+  while(shard_active && bytes_decompressed > 0) {
+    if(shard_syncing) shard_resync();
+    if(!shard_syncing) {
+      if(shard_done()) break;
+      const size_t residual = data_buf_cap - data_buf_cursor;
+      if(residual >= 4 && 
+          *(uint32_t *)(data_buf + data_buf_cursor) + 4 <= residual) break;
+    }
+    bytes_decompressed = decompress(DATA_BUFFER_CAP);
+  }
+  supply_buf = data_buf;
+  // Reads held back by the last batch are handed out once no more data follows
+  bool last_reads = false;
+  if(bytes_decompressed == 0 && reads_held) {
+    const size_t residual = data_buf_cap - data_buf_cursor;
+    if(residual >= 4 && 
+        *(uint32_t *)(data_buf + data_buf_cursor) + 4 <= residual) {
+      bytes_decompressed = residual;
+      last_reads = true;
+    }
+  }
+  reads_held = false;
   if(bytes_decompressed == 0) {
-    if(GetProgress() != GetFileSize()) {
+    if((!region_active && !shard_active && GetProgress() != GetFileSize()) || 
+        (shard_active && !shard_done()) ||
+        (streaming && error_state != 0)) {
       cout << "Error occurred during decompression\n";
       error_state = -1;
       return(-1);
     }
+    if(index_build_state == 1) index_build_state = 2;
     return(1);
   }
   
+  // In shards, reads starting after the shard's last block are not handed out
+  size_t scan_stop = data_buf_cap;
+  if(shard_active && shard_stop != (uint64_t)-1) {
+    const uint64_t buf_start = data_stream_pos - data_buf_cap;
+    scan_stop = shard_stop > buf_start ? 
+      std::min(data_buf_cap, (size_t)(shard_stop - buf_start)) : 0;
+  }
+
   // Check decompressed data contains at least 1 full read  
+  if(data_buf_cursor >= scan_stop) return(1);
   if(data_buf_cap - data_buf_cursor < 4) return(1);
   uint32_t *u32p;
   u32p = (uint32_t *)(data_buf + data_buf_cursor);
   if(*u32p + 4 > data_buf_cap - data_buf_cursor) return(1);
 
+  // With chromosome batching, the batch ends at the next change of reference
+  size_t divide_end = data_buf_cap;
+  if(chrom_batching) {
+    scan_stop = chrom_batch_end(scan_stop);
+    divide_end = std::min(scan_stop, data_buf_cap);
+  }
+
   // Roughly divide the buffer into N regions:
-  size_t data_divider = 1 + ((data_buf_cap - data_buf_cursor) / threads_to_use);
+  size_t data_divider = 1 + ((divide_end - data_buf_cursor) / threads_to_use);
   size_t next_divider = std::min(data_buf_cursor + data_divider, data_buf_cap);
 
   read_cursors.push_back(data_buf_cursor);
+  part_offsets.resize(0);
+  const size_t batch_start = data_buf_cursor;
+  size_t group_start = data_buf_cursor;   // First read with the last read's name
   unsigned int threads_accounted_for = 0;
   while(1) {
     // Checks remaining data contains at least 1 full read; breaks otherwise
+    if(data_buf_cursor >= scan_stop) break;
     if(data_buf_cap - data_buf_cursor >= 4) {
       u32p = (uint32_t *)(data_buf + data_buf_cursor);
       if(*u32p + 4 <= data_buf_cap - data_buf_cursor) {
+        if(part_mode != 0) part_offsets.push_back(data_buf_cursor);
+        if(mate_batching && data_buf_cursor > batch_start && 
+            !same_read_name(group_start, data_buf_cursor)) {
+          group_start = data_buf_cursor;
+        }
         data_buf_cursor += *u32p + 4;
       } else {
         break;
@@ -87,6 +149,9 @@ inline int pbam_in::fillReads() {
     } else {
       break;
     }
+    // Mate batching moves thread boundaries to the next change of read name
+    if(mate_batching && data_buf_cursor >= next_divider &&
+        !mate_boundary(group_start, scan_stop)) continue;
     if(data_buf_cursor >= next_divider) {
       read_ptr_ends.push_back(data_buf_cursor);
       read_cursors.push_back(data_buf_cursor);
@@ -95,6 +160,17 @@ inline int pbam_in::fillReads() {
     }
   }
 
+  // Mate batching holds back the reads with the last read's name, whose mates
+  //   may not yet be decompressed, unless they are the whole batch. These
+  //   are handed out by the next fillReads()
+  if(mate_batching && !region_active && !last_reads && group_start > batch_start) {
+    data_buf_cursor = group_start;
+    while(part_offsets.size() > 0 && part_offsets.back() >= group_start) {
+      part_offsets.pop_back();
+    }
+    reads_held = true;
+  }
+
   while(threads_accounted_for < threads_to_use - 1) {
     read_ptr_ends.push_back(data_buf_cursor);
     read_cursors.push_back(data_buf_cursor);
@@ -102,9 +178,79 @@ inline int pbam_in::fillReads() {
   }
   read_ptr_ends.push_back(data_buf_cursor);
 
+  if(index_build_state == 1) index_reads();
+  prune_block_voffsets();
+  if(part_mode != 0) partition_reads();
+
+  // If the spare buffer cannot be allocated, the batch stays in data_buf
+  if(pipelined && pipeline_swap() == 0) pipeline_start();
   return(0);
 }
 
+// Whether the reads at data_buf positions a and b have the same name
+inline bool pbam_in::same_read_name(const size_t a, const size_t b) {
+  const pbam_core_32 * core_a = (const pbam_core_32 *)(data_buf + a + 4);
+  const pbam_core_32 * core_b = (const pbam_core_32 *)(data_buf + b + 4);
+  return(core_a->l_read_name == core_b->l_read_name &&
+    memcmp(data_buf + a + 36, data_buf + b + 36, core_a->l_read_name) == 0);
+}
+
+// Whether a read that will be handed out starts at data_buf_cursor, with a
+//   different name from the read at group_start
+inline bool pbam_in::mate_boundary(const size_t group_start, const size_t scan_stop) {
+  if(data_buf_cursor >= scan_stop) return(false);
+  const size_t residual = data_buf_cap - data_buf_cursor;
+  if(residual < 4 || 
+      *(uint32_t *)(data_buf + data_buf_cursor) + 4 > residual) return(false);
+  return(!same_read_name(group_start, data_buf_cursor));
+}
+
+inline void pbam_in::SetMateBatching(const bool keep_mates) {
+  mate_batching = keep_mates;
+}
+
+inline size_t pbam_in::chrom_batch_end(const size_t scan_stop) {
+  batch_refID = ((const pbam_core_32 *)(data_buf + data_buf_cursor + 4))->refID;
+  size_t cursor = data_buf_cursor;
+  while(cursor < scan_stop && data_buf_cap - cursor >= 4) {
+    const uint32_t read_size = *(uint32_t *)(data_buf + cursor) + 4;
+    if(read_size > data_buf_cap - cursor) break;
+    if(((const pbam_core_32 *)(data_buf + cursor + 4))->refID != batch_refID) {
+      // Reads of the next chromosome are handed out by the next fillReads()
+      reads_held = true;
+      return(cursor);
+    }
+    cursor += read_size;
+  }
+  return(scan_stop);
+}
+
+inline bool pbam_in::chrom_batch_ready() {
+  const size_t residual = data_buf_cap - data_buf_cursor;
+  if(residual < 36 || 
+      *(uint32_t *)(data_buf + data_buf_cursor) + 4 > residual) return(false);
+  if(shard_active && shard_syncing) return(false);
+  const int32_t refID = ((const pbam_core_32 *)(data_buf + data_buf_cursor + 4))->refID;
+  size_t cursor = data_buf_cursor;
+  while(data_buf_cap - cursor >= 4) {
+    const uint32_t read_size = *(uint32_t *)(data_buf + cursor) + 4;
+    if(read_size > data_buf_cap - cursor) break;
+    if(((const pbam_core_32 *)(data_buf + cursor + 4))->refID != refID) return(true);
+    cursor += read_size;
+  }
+  return(false);
+}
+
+inline void pbam_in::SetChromosomeBatching(const bool by_chromosome) {
+  chrom_batching = by_chromosome;
+}
+
+// A batch already decompressing in the background is collected by the next
+//   fillReads(), even if pipelining is switched off
+inline void pbam_in::SetPipelined(const bool use_pipeline) {
+  pipelined = use_pipeline;
+}
+
 // Internal
 inline size_t pbam_in::remainingThreadReadsBuffer(const unsigned int thread_id) {
   if(thread_id > threads_to_use) {
@@ -119,4 +265,53 @@ inline size_t pbam_in::remainingThreadReadsBuffer(const unsigned int thread_id)
   return(read_ptr_ends.at(thread_id) - read_cursors.at(thread_id));
 }
 
+// ************************ Pipelined decompression ***************************
+
+// Starts decompressing the next batch into data_buf on a background thread
+inline void pbam_in::pipeline_start() {
+  if(pipe_running) return;
+  pipe_progress = prog_tellg();
+  pipe_voffset = data_voffset(data_buf_cursor);
+  pipe_bytes = 0;
+  pipe_running = true;
+  pipe_thread = std::thread([this]() {
+    pipe_bytes = decompress(DATA_BUFFER_CAP);
+  });
+}
+
+// Waits for the background batch to finish. Returns bytes decompressed
+inline size_t pbam_in::pipeline_wait() {
+  if(!pipe_running) return(0);
+  if(pipe_thread.joinable()) pipe_thread.join();
+  pipe_running = false;
+  return(pipe_bytes);
+}
+
+/*
+  Hands the reads assigned to threads over to supply_buf, by swapping data_buf
+    with the spare data buffer. The residual (incomplete) read at the end of
+    data_buf is copied to the start of the new data_buf, so that the next batch
+    can be decompressed while supplyRead() reads from supply_buf.
+  Returns -1 (and stops pipelining) if the spare data buffer fails to allocate
+*/
+inline int pbam_in::pipeline_swap() {
+  size_t residual = data_buf_cap - data_buf_cursor;
+  char * staging = spare_data_buf;
+  if(!staging) staging = (char*)malloc(DATA_BUFFER_CAP + 1);
+  if(!staging) {
+    cout << "Failed to allocate spare data buffer; pipelining is disabled\n";
+    error_state = -1;
+    pipelined = false;
+    return(-1);
+  }
+  if(residual > 0) memcpy(staging, data_buf + data_buf_cursor, residual);
+  
+  spare_data_buf = data_buf;
+  supply_buf = spare_data_buf;
+  data_buf = staging;
+  data_buf_cap = residual;
+  data_buf_cursor = 0;
+  return(0);
+}
+
 #endif
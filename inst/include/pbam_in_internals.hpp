@@ -28,10 +28,16 @@ SOFTWARE.  */
 inline void pbam_in::initialize_buffers() {
   // Empty buffer pointers
   file_buf = NULL;  data_buf = NULL;  next_file_buf = NULL;
+  supply_buf = NULL;  spare_data_buf = NULL;
+  map_buf = NULL;  map_len = 0;
+  read_fd = -1;  direct_fd = -1;
+  streaming = false;  stream_fd = -1;  stream_in = NULL;
+  stream_pos = 0;  stream_eof = false;  stream_tail_len = 0;
   // Empty capacities and cursors
   file_buf_cap = 0; file_buf_cursor = 0;
   data_buf_cap = 0; data_buf_cursor = 0;
   next_file_buf_cap = 0; next_file_buf_cursor = 0;
+  next_file_buf_start = bgzfMaxBlockLength;
   // Empty BAM header info
   magic_header = NULL; l_text = 0; headertext = NULL; n_ref = 0;
   chr_names.resize(0); chr_lens.resize(0);
@@ -41,12 +47,38 @@ inline void pbam_in::initialize_buffers() {
   // Empties cursors for thread-specific reads
   read_cursors.resize(0); read_ptr_ends.resize(0);
 
+  // Empty region query
+  region_active = false; regions.resize(0); region_chunks.resize(0);
+  region_chunk_idx = 0; region_chunk_done = false;
+  region_stop = 0; block_skip = 0; region_read_limit = 0;
+
+  // Empty block offsets and index building
+  block_voffsets.resize(0); data_stream_pos = 0; next_block_coff = 0;
+  index_build_state = 0; index_batches.resize(0); scan_started = false;
+
+  // Empty byte-range shard
+  shard_active = false; shard_end = 0; shard_stop = 0; shard_read_limit = 0;
+  shard_syncing = false; first_read_voffset = 0;
+  reads_held = false;
+
+  // Empty BGZF block map
+  block_map.resize(0); block_map_cursor = 0;
+  block_map_valid = false; block_map_corrupt = false;
+
+  // Empty decompressor contexts
+  inflaters = NULL; n_inflaters = 0;
+  thread_busy_secs.resize(0); thread_block_counts.resize(0);
+
   // Clears handle to ifstream
   IN = NULL;
   error_state = 0;
 }
 
 inline void pbam_in::clear_buffers() {
+  // Background decompression must finish before buffers are released
+  pipeline_wait();
+
+  close_read_fds();
   if(FILENAME.size() > 0 && IN) {
     IN->close();  // close previous file if opened using openFile()
     delete(IN);   // Releases heap-allocated ifstream produced by openFile()
@@ -54,15 +86,20 @@ inline void pbam_in::clear_buffers() {
   }
   
   // Releases file and data buffers
+  unmap_file();   // file_buf is not heap-allocated if memory-mapped
   if(file_buf) free(file_buf); 
   file_buf = NULL;
   if(data_buf) free(data_buf); 
   data_buf = NULL;
   if(next_file_buf) free(next_file_buf); 
   next_file_buf = NULL;
+  if(spare_data_buf) free(spare_data_buf);
+  spare_data_buf = NULL;
+  supply_buf = NULL;
   file_buf_cap = 0; file_buf_cursor = 0;
   data_buf_cap = 0; data_buf_cursor = 0;
   next_file_buf_cap = 0; next_file_buf_cursor = 0;
+  next_file_buf_start = bgzfMaxBlockLength;
 
   // Releases stored header data
   if(magic_header) free(magic_header); 
@@ -76,8 +113,104 @@ inline void pbam_in::clear_buffers() {
   read_cursors.resize(0);
   read_ptr_ends.resize(0);
 
-  // Clears handle to ifstream
+  // Releases index and region query
+  bam_index.clear();
+  region_active = false; regions.resize(0); region_chunks.resize(0);
+  region_chunk_idx = 0; region_chunk_done = false;
+  region_stop = 0; block_skip = 0; region_read_limit = 0;
+
+  // Releases block offsets and index building
+  block_voffsets.clear(); data_stream_pos = 0; next_block_coff = 0;
+  built_index.clear();
+  index_build_state = 0; index_batches.clear(); scan_started = false;
+
+  // Releases byte-range shard
+  shard_active = false; shard_end = 0; shard_stop = 0; shard_read_limit = 0;
+  shard_syncing = false; first_read_voffset = 0;
+  reads_held = false;
+
+  // Releases BGZF block map
+  block_map.clear(); block_map.shrink_to_fit(); block_map_cursor = 0;
+  block_map_valid = false; block_map_corrupt = false;
+
+  // Releases decompressor contexts
+  if(inflaters) delete[] inflaters;
+  inflaters = NULL; n_inflaters = 0;
+  thread_busy_secs.resize(0); thread_block_counts.resize(0);
+
+  // Clears handle to ifstream, and releases (but does not close) any stream
   IN = NULL;
+  streaming = false;  stream_fd = -1;  stream_in = NULL;
+  stream_pos = 0;  stream_eof = false;  stream_tail_len = 0;
+}
+
+inline uint64_t pbam_in::data_voffset(const size_t data_pos) {
+  const uint64_t upos = data_stream_pos - (data_buf_cap - data_pos);
+  // Last block starting at or before upos
+  std::vector<pbam_block_voffset>::const_iterator it = std::upper_bound(
+    block_voffsets.begin(), block_voffsets.end(), upos,
+    [](const uint64_t u, const pbam_block_voffset & b) {
+      return(u < b.ustart);
+    });
+  // Nothing decompressed yet since the last seek
+  if(it == block_voffsets.begin()) {
+    return(pbam_voffset(next_block_coff, block_skip));
+  }
+  --it;
+  // The end of the last decompressed block is the start of the next block
+  if(it->dest_size > 0 && upos >= it->ustart + it->dest_size) {
+    return(pbam_voffset(next_block_coff, 0));
+  }
+  return(pbam_voffset(it->coff, (uint32_t)(upos - it->ustart)));
+}
+
+inline void pbam_in::prune_block_voffsets() {
+  const uint64_t upos = data_stream_pos - (data_buf_cap - data_buf_cursor);
+  size_t n_drop = 0;
+  while(n_drop + 1 < block_voffsets.size() && 
+      block_voffsets.at(n_drop + 1).ustart <= upos) {
+    n_drop++;
+  }
+  if(n_drop > 0) {
+    block_voffsets.erase(block_voffsets.begin(), block_voffsets.begin() + n_drop);
+  }
+}
+
+/*
+  Moves the file cursor so that the next BGZF block decompressed is at file
+    offset coff. Data in file_buf is kept if coff lies ahead within it
+*/
+inline void pbam_in::seek_file(const size_t coff) {
+  block_map_valid = false;
+  if(map_buf) {
+    file_buf_cursor = std::min(coff, file_buf_cap);
+    return;
+  }
+  const size_t buf_offset = file_buf_offset();
+  if(coff >= buf_offset + file_buf_cursor && coff < buf_offset + file_buf_cap) {
+    file_buf_cursor = coff - buf_offset;
+    return;
+  }
+  IN->clear();
+  IN->seekg(coff, std::ios_base::beg);
+  file_buf_cursor = 0; file_buf_cap = 0;
+  next_file_buf_cap = 0;
+}
+
+// (Re-)creates one decompressor context per thread using the chosen backend
+inline int pbam_in::init_inflaters() {
+  if(inflaters && n_inflaters != threads_to_use) {
+    delete[] inflaters;
+    inflaters = NULL; n_inflaters = 0;
+  }
+  if(!inflaters) {
+    inflaters = new pbam_inflater[threads_to_use];
+    n_inflaters = threads_to_use;
+  }
+  for(unsigned int k = 0; k < n_inflaters; k++) {
+    if(inflaters[k].init(inflate_backend) != 0) return(-1);
+  }
+  return(0);
 }
 
 // Makes sure given threads does not exist system resources
@@ -0,0 +1,198 @@
+/* pbam_in_partition.hpp pbam_in key-partitioned read supply
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_in_partition
+#define _pbam_in_partition
+
+/*
+  With a partition key, fillReads() records the offset of every read it hands
+    out (part_offsets). partition_reads() then hashes the key of each read
+    to choose its thread, and sorts the offsets by thread (part_sorted),
+    keeping reads of each thread in file order. Both steps are run by all
+    threads, each over an equal share of the reads.
+*/
+
+// Public functions:
+
+inline int pbam_in::SetPartitionKey(const std::string & key) {
+  if(key.size() == 0) {
+    part_mode = 0;
+  } else if(key == "QNAME") {
+    part_mode = 2;
+  } else if(key == "RNAME") {
+    part_mode = 3;
+  } else if(key.size() == 2 && isalpha((unsigned char)key[0]) &&
+      isalnum((unsigned char)key[1])) {
+    part_mode = 1;
+    part_tag[0] = key[0];
+    part_tag[1] = key[1];
+  } else {
+    cout << "Invalid partition key: " << key
+      << ". Use a 2-character tag, \"QNAME\" or \"RNAME\"\n";
+    return(-1);
+  }
+  return(0);
+}
+
+// Internals
+
+inline void pbam_in::partition_reads() {
+  const size_t n_reads = part_offsets.size();
+  const unsigned int n_parts = threads_to_use;
+  part_dest.resize(n_reads);
+  part_sorted.resize(n_reads);
+
+  // Number of reads of each share (row) given to each thread (column)
+  std::vector<size_t> counts((size_t)n_parts * n_parts, 0);
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_parts) schedule(static,1)
+  #endif
+  for(unsigned int k = 0; k < n_parts; k++) {
+    size_t * count = counts.data() + (size_t)k * n_parts;
+    const size_t end = n_reads * (k + 1) / n_parts;
+    for(size_t i = n_reads * k / n_parts; i < end; i++) {
+      const uint32_t dest = (uint32_t)(
+        partition_hash(data_buf + part_offsets[i]) % n_parts);
+      part_dest[i] = dest;
+      count[dest]++;
+    }
+  }
+
+  // Turn counts into the position in part_sorted of each share's reads
+  read_cursors.assign(n_parts, 0);
+  read_ptr_ends.assign(n_parts, 0);
+  size_t total = 0;
+  for(unsigned int t = 0; t < n_parts; t++) {
+    read_cursors.at(t) = total;
+    for(unsigned int k = 0; k < n_parts; k++) {
+      const size_t n = counts[(size_t)k * n_parts + t];
+      counts[(size_t)k * n_parts + t] = total;
+      total += n;
+    }
+    read_ptr_ends.at(t) = total;
+  }
+
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_parts) schedule(static,1)
+  #endif
+  for(unsigned int k = 0; k < n_parts; k++) {
+    size_t * pos = counts.data() + (size_t)k * n_parts;
+    const size_t end = n_reads * (k + 1) / n_parts;
+    for(size_t i = n_reads * k / n_parts; i < end; i++) {
+      part_sorted[pos[part_dest[i]]++] = part_offsets[i];
+    }
+  }
+}
+
+// 64-bit FNV-1a, mixed so that the low bits depend on all bytes
+inline uint64_t pbam_in::hash_key(const char * key, const size_t key_len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for(size_t i = 0; i < key_len; i++) {
+    hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return(hash);
+}
+
+/*
+  Integer tags are hashed by value, so the same value stored as a different
+    integer type has the same hash. Reads without the tag have the hash of
+    an empty key. RNAME is not hashed, so chromosomes are dealt to threads
+    in turn
+*/
+inline uint64_t pbam_in::partition_hash(const char * read_ptr) {
+  const pbam_core_32 * core = (const pbam_core_32 *)(read_ptr + 4);
+  if(part_mode == 3) return((uint64_t)(uint32_t)core->refID);
+  if(part_mode == 2) {
+    return(hash_key(read_ptr + 36,
+      core->l_read_name > 0 ? core->l_read_name - 1 : 0));
+  }
+
+  // Walk the tags after the read's qualities
+  const char * tag = read_ptr + 36 + core->l_read_name +
+    4 * (size_t)core->n_cigar_op + ((size_t)core->l_seq + 1) / 2 + core->l_seq;
+  const char * end = read_ptr + 4 + *(const uint32_t *)read_ptr;
+  while(tag + 3 <= end) {
+    const char type = tag[2];
+    const char * val = tag + 3;
+    size_t val_len = 0;     // Excludes the NUL ending Z and H tags
+    switch(type) {
+      case 'A': case 'c': case 'C': val_len = 1; break;
+      case 's': case 'S': val_len = 2; break;
+      case 'i': case 'I': case 'f': val_len = 4; break;
+      case 'Z': case 'H':
+        while(val + val_len < end && val[val_len] != '\0') val_len++;
+        break;
+      case 'B': {
+        size_t elem_size = 0;
+        if(val + 5 <= end) switch(val[0]) {
+          case 'c': case 'C': elem_size = 1; break;
+          case 's': case 'S': elem_size = 2; break;
+          case 'i': case 'I': case 'f': elem_size = 4; break;
+        }
+        if(elem_size == 0) return(hash_key(NULL, 0));   // Corrupt tag
+        val_len = 5 + elem_size * *(const uint32_t *)(val + 1);
+        break;
+      }
+      default:
+        return(hash_key(NULL, 0));                       // Corrupt tag
+    }
+    if(val + val_len > end) break;
+
+    if(tag[0] == part_tag[0] && tag[1] == part_tag[1]) {
+      int64_t int_val = 0;
+      switch(type) {
+        case 'c': int_val = *(const int8_t *)val; break;
+        case 'C': int_val = *(const uint8_t *)val; break;
+        case 's': int_val = *(const int16_t *)val; break;
+        case 'S': int_val = *(const uint16_t *)val; break;
+        case 'i': int_val = *(const int32_t *)val; break;
+        case 'I': int_val = *(const uint32_t *)val; break;
+        default: return(hash_key(val, val_len));
+      }
+      return(hash_key((const char *)&int_val, sizeof(int64_t)));
+    }
+    tag = val + val_len + ((type == 'Z' || type == 'H') ? 1 : 0);
+  }
+  return(hash_key(NULL, 0));
+}
+
+inline pbam1_t pbam_in::supply_partitioned_read(const unsigned int thread_id) {
+  size_t & cursor = read_cursors.at(thread_id);
+  pbam1_t read(supply_buf + part_sorted[cursor], false);
+  // In region queries, skip reads that do not overlap any region
+  while(region_active && read.validate() &&
+      !read_in_regions(supply_buf + part_sorted[cursor])) {
+    if(++cursor >= read_ptr_ends.at(thread_id)) return(pbam1_t());
+    read = pbam1_t(supply_buf + part_sorted[cursor], false);
+  }
+  if(read.validate()) {
+    cursor++;
+  } else {
+    cout << "Invalid read found before end of thread buffer " << thread_id << '\n';
+  }
+  return(read);
+}
+
+#endif
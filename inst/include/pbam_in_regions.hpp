@@ -0,0 +1,213 @@
+/* pbam_in_regions.hpp pbam_in indexed region queries
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_in_regions
+#define _pbam_in_regions
+
+// Public functions:
+
+inline int pbam_in::LoadIndex(const std::string & index_file) {
+  if(!magic_header) {
+    cout << "Header is not yet read\n";
+    return(-1);
+  }
+  std::vector<std::string> candidates;
+  if(index_file.size() > 0) {
+    candidates.push_back(index_file);
+  } else if(FILENAME.size() > 0) {
+    candidates.push_back(FILENAME + ".bai");
+    if(FILENAME.size() > 4 && 
+        FILENAME.compare(FILENAME.size() - 4, 4, ".bam") == 0) {
+      candidates.push_back(FILENAME.substr(0, FILENAME.size() - 4) + ".bai");
+    }
+    candidates.push_back(FILENAME + ".csi");
+  } else {
+    cout << "Please specify the index file\n";
+    return(-1);
+  }
+  for(unsigned int i = 0; i < candidates.size(); i++) {
+    std::ifstream test(candidates.at(i));
+    if(!test.is_open()) continue;
+    test.close();
+    if(bam_index.load(candidates.at(i)) != 0) return(-1);
+    if(bam_index.n_ref() != (int)n_ref) {
+      cout << "Index " << candidates.at(i) << " does not match the BAM header\n";
+      bam_index.clear();
+      return(-1);
+    }
+    return(0);
+  }
+  cout << "Could not find BAM index\n";
+  return(-1);
+}
+
+inline int pbam_in::SetRegion(const std::string & chr, const uint32_t start, 
+    const uint32_t end) {
+  return(SetRegions(
+    std::vector<std::string>(1, chr),
+    std::vector<uint32_t>(1, start),
+    std::vector<uint32_t>(1, end)
+  ));
+}
+
+inline int pbam_in::SetRegions(
+    const std::vector<std::string> & chrs, 
+    const std::vector<uint32_t> & starts,
+    const std::vector<uint32_t> & ends
+) {
+  if(!bam_index.loaded()) {
+    cout << "No BAM index loaded. Please run LoadIndex() first\n";
+    return(-1);
+  }
+  if(streaming) {
+    cout << "Region queries are not supported on streams\n";
+    return(-1);
+  }
+  if(chrs.size() != starts.size() || chrs.size() != ends.size()) {
+    cout << "chrs, starts and ends must be of the same length\n";
+    return(-1);
+  }
+  std::vector<pbam_region> new_regions;
+  for(unsigned int i = 0; i < chrs.size(); i++) {
+    std::vector<std::string>::iterator it = 
+      std::find(chr_names.begin(), chr_names.end(), chrs.at(i));
+    if(it == chr_names.end()) {
+      cout << "Chromosome " << chrs.at(i) << " not found in BAM header\n";
+      return(-1);
+    }
+    pbam_region reg;
+    reg.refID = (int32_t)(it - chr_names.begin());
+    reg.start = starts.at(i);
+    reg.end = std::min(ends.at(i), chr_lens.at(reg.refID));
+    if((uint64_t)reg.end > bam_index.max_coord()) {
+      cout << "Region " << chrs.at(i) << ":" << reg.start << "-" << reg.end
+        << " is beyond the range of the index (" << bam_index.max_coord() 
+        << " bp). Please use a CSI index with a larger depth\n";
+      return(-1);
+    }
+    if(reg.start < reg.end) new_regions.push_back(reg);
+  }
+  return(start_region_query(new_regions));
+}
+
+// Internals
+
+/*
+  Sorts and merges regions, and looks up the chunks to decompress. Then
+    resets the buffers so that the next fillReads() starts at the first chunk
+*/
+inline int pbam_in::start_region_query(std::vector<pbam_region> & new_regions) {
+  // Background batch and unsupplied reads belong to the previous query
+  pipeline_wait();
+  read_cursors.resize(0);
+  read_ptr_ends.resize(0);
+
+  // Virtual offsets are not tracked in region queries
+  block_voffsets.resize(0);
+  shard_active = false;
+  if(index_build_state != 0) {
+    cout << "Index building is cancelled by region queries\n";
+    index_build_state = 0;
+  }
+
+  std::sort(new_regions.begin(), new_regions.end(),
+    [](const pbam_region & a, const pbam_region & b) {
+      return(a.refID < b.refID || (a.refID == b.refID && a.start < b.start));
+    });
+  regions.resize(0);
+  for(unsigned int i = 0; i < new_regions.size(); i++) {
+    if(regions.size() > 0 && regions.back().refID == new_regions.at(i).refID &&
+        regions.back().end >= new_regions.at(i).start) {
+      regions.back().end = std::max(regions.back().end, new_regions.at(i).end);
+    } else {
+      regions.push_back(new_regions.at(i));
+    }
+  }
+  
+  region_chunks.resize(0);
+  for(unsigned int i = 0; i < regions.size(); i++) {
+    bam_index.query(regions.at(i), region_chunks);
+  }
+  pbam_index::merge_chunks(region_chunks);
+  
+  region_active = true;
+  region_chunk_idx = 0;
+  region_chunk_done = true;   // Next decompress() moves to the first chunk
+  region_stop = 0; block_skip = 0; region_read_limit = 0;
+  data_buf_cap = 0; data_buf_cursor = 0;
+  return(0);
+}
+
+inline int pbam_in::region_next_chunk() {
+  // Data left over from the previous chunk is not needed
+  data_buf_cap = 0; data_buf_cursor = 0;
+  if(region_chunk_idx >= region_chunks.size()) return(-1);
+  
+  const pbam_chunk & chunk = region_chunks.at(region_chunk_idx++);
+  block_skip = (uint32_t)(chunk.beg & 0xffff);
+  region_stop = chunk.end;
+  region_chunk_done = false;
+  // Chunks are sorted, so the read limit only moves forward
+  region_read_limit = std::max(region_read_limit, 
+    (size_t)(chunk.end >> 16) + bgzfMaxBlockLength);
+  seek_file((size_t)(chunk.beg >> 16));
+  return(0);
+}
+
+/*
+  The reference span is given by the CIGAR (M, D, N, = and X operations).
+    Unmapped reads, and reads without such operations, span 1 base, as
+    is done when binning reads in BAM indices
+*/
+inline uint32_t pbam_in::read_ref_end(const char * read_ptr) {
+  const pbam_core_32 * core = (const pbam_core_32 *)(read_ptr + 4);
+  const uint32_t start = (uint32_t)std::max(core->pos, 0);
+  uint32_t ref_len = 0;
+  if(!(core->flag & 0x4)) {
+    const uint32_t * cigar = (const uint32_t *)(read_ptr + 36 + core->l_read_name);
+    for(uint16_t i = 0; i < core->n_cigar_op; i++) {
+      const uint32_t op = cigar[i] & 0xf;
+      if(op == 0 || op == 2 || op == 3 || op == 7 || op == 8) ref_len += cigar[i] >> 4;
+    }
+  }
+  if(ref_len == 0) ref_len = 1;
+  return(start + ref_len);
+}
+
+inline bool pbam_in::read_in_regions(const char * read_ptr) {
+  const pbam_core_32 * core = (const pbam_core_32 *)(read_ptr + 4);
+  if(core->refID < 0 || core->pos < 0) return(false);
+  const uint32_t start = (uint32_t)core->pos;
+  const uint32_t end = read_ref_end(read_ptr);
+  
+  // First region that ends after the read starts
+  pbam_region key;
+  key.refID = core->refID; key.start = start; key.end = start;
+  std::vector<pbam_region>::const_iterator it = std::lower_bound(
+    regions.begin(), regions.end(), key,
+    [](const pbam_region & a, const pbam_region & b) {
+      return(a.refID < b.refID || (a.refID == b.refID && a.end <= b.start));
+    });
+  return(it != regions.end() && it->refID == core->refID && it->start < end);
+}
+
+#endif
@@ -0,0 +1,234 @@
+/* pbam_in_shard.hpp pbam_in byte-range shards
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_in_shard
+#define _pbam_in_shard
+
+/*
+  A shard owns the reads whose first byte lies in a BGZF block starting at a
+    file offset within [begin, end). As every read starts in exactly one
+    BGZF block, shards covering the file without gaps or overlaps supply
+    every read exactly once.
+
+  The first block of a shard is found by scanning for BGZF headers from
+    begin. As the reads continuing from the previous block are not known,
+    the first read of the shard is found by checking the fields of each
+    candidate read, and of the reads that follow it.
+*/
+
+// Public functions:
+
+inline int pbam_in::SetByteRange(const size_t begin, const size_t end) {
+  if(!magic_header) {
+    cout << "Header is not yet read\n";
+    return(-1);
+  }
+  if(streaming) {
+    cout << "SetByteRange() is not available for streams\n";
+    return(-1);
+  }
+  if(begin >= end) {
+    cout << "Invalid byte range: [" << begin << ", " << end << ")\n";
+    return(-1);
+  }
+  size_t coff = 0;
+  if(find_bgzf_block(begin, end, coff) != 0) return(-1);
+
+  // Shards starting before the first read need not be re-synced
+  const bool sync = coff > (size_t)(first_read_voffset >> 16);
+  if(Seek(sync ? pbam_voffset(coff, 0) : first_read_voffset) != 0) return(-1);
+
+  shard_active = true;
+  shard_end = std::min(end, IS_LENGTH);
+  shard_syncing = sync;
+  shard_stop = (uint64_t)-1;
+  // The last block of the shard starts before shard_end
+  shard_read_limit = shard_end + bgzfMaxBlockLength;
+  // No BGZF block starts within the range, so the shard has no reads
+  if(coff >= shard_end) shard_stop = 0;
+  return(0);
+}
+
+// Internals
+
+/*
+  Finds the first BGZF block starting within [begin, end). A BGZF header-like
+    sequence within compressed data is rejected unless the blocks that
+    follow it also start with BGZF headers (or the file ends).
+  Sets coff to the end of the file if no block starts within the range.
+  Returns 0 if success, or -1 if error
+*/
+inline int pbam_in::find_bgzf_block(const size_t begin, const size_t end,
+    size_t & coff) {
+  coff = IS_LENGTH;
+  if(begin >= IS_LENGTH) return(0);
+  const size_t range_end = std::min(end, IS_LENGTH);
+
+  // A block starts within bgzfMaxBlockLength bytes of begin, and the 2 blocks
+  //   after it lie within the window
+  const size_t win_len = std::min(IS_LENGTH - begin, 3 * bgzfMaxBlockLength);
+  std::vector<char> win(win_len);
+  if(read_file_at(begin, win.data(), win_len) != win_len) {
+    cout << "Failed to read from BAM file at " << begin << " bytes\n";
+    return(-1);
+  }
+
+  const size_t scan_end = std::min(range_end - begin, bgzfMaxBlockLength);
+  for(size_t pos = 0; pos < scan_end; pos++) {
+    bool chained = true;
+    size_t blk_pos = pos;
+    for(unsigned int i = 0; i < 3 && begin + blk_pos < IS_LENGTH; i++) {
+      if(blk_pos + 18 > win_len || !is_bgzf_header(win.data() + blk_pos)) {
+        chained = false;
+        break;
+      }
+      uint16_t * u16 = (uint16_t *)(win.data() + blk_pos + 16);
+      if(*u16 + 1 < bamEOFlength) {
+        chained = false;
+        break;
+      }
+      blk_pos += *u16 + 1;
+    }
+    if(chained && begin + blk_pos <= IS_LENGTH) {
+      coff = begin + pos;
+      return(0);
+    }
+  }
+
+  if(range_end - begin > bgzfMaxBlockLength) {
+    cout << "No BGZF block found after " << begin
+      << " bytes. Perhaps this file is corrupt?\n";
+    return(-1);
+  }
+  return(0);
+}
+
+// Reads up to len bytes at the file offset, without moving the file cursor.
+//   Returns the number of bytes read
+inline size_t pbam_in::read_file_at(const size_t offset, char * buf,
+    const size_t len) {
+  if(offset >= IS_LENGTH) return(0);
+  const size_t n_bytes = std::min(len, IS_LENGTH - offset);
+  if(map_buf) {
+    memcpy(buf, map_buf + offset, n_bytes);
+    return(n_bytes);
+  }
+  const size_t cur_pos = tellg();
+  IN->clear();
+  IN->seekg(offset, std::ios_base::beg);
+  IN->read(buf, n_bytes);
+  const size_t n_read = (size_t)IN->gcount();
+  IN->clear();
+  IN->seekg(cur_pos, std::ios_base::beg);
+  return(n_read);
+}
+
+/*
+  Checks whether a read could start at read_ptr, given avail bytes of data:
+  - refID / next_refID are -1 or a reference in the header, and pos / next_pos
+      are -1 or within the reference
+  - The read name is NUL-terminated and uses the characters allowed in QNAME
+  - block_size holds the read name, CIGAR, sequence and qualities
+  - CIGAR operations are valid
+  Returns 1 if plausible, 0 if not, or 2 if more data is needed to decide
+*/
+inline int pbam_in::check_read_start(const char * read_ptr, const size_t avail) {
+  if(avail < 36) return(2);
+  const uint32_t block_size = *(const uint32_t *)read_ptr;
+  const pbam_core_32 * core = (const pbam_core_32 *)(read_ptr + 4);
+
+  if(core->refID < -1 || core->refID >= (int32_t)n_ref) return(0);
+  if(core->next_refID < -1 || core->next_refID >= (int32_t)n_ref) return(0);
+  if(core->pos < -1 || (core->refID >= 0 && core->pos > 0 &&
+      (uint32_t)core->pos > chr_lens.at(core->refID))) return(0);
+  if(core->next_pos < -1 || (core->next_refID >= 0 && core->next_pos > 0 &&
+      (uint32_t)core->next_pos > chr_lens.at(core->next_refID))) return(0);
+  if(core->l_read_name == 0) return(0);
+
+  const uint64_t fixed_size = 32 + (uint64_t)core->l_read_name +
+    4 * (uint64_t)core->n_cigar_op +
+    (uint64_t)core->l_seq + ((uint64_t)core->l_seq + 1) / 2;
+  if(fixed_size > block_size) return(0);
+
+  // Read name: [!-?A-~]+ then NUL
+  const char * read_name = read_ptr + 36;
+  const size_t name_avail = std::min(avail - 36, (size_t)core->l_read_name);
+  for(size_t i = 0; i < name_avail; i++) {
+    const char c = read_name[i];
+    if(i + 1 == core->l_read_name) {
+      if(c != '\0') return(0);
+    } else if(c < '!' || c > '~' || c == '@') {
+      return(0);
+    }
+  }
+  if(avail < (size_t)block_size + 4) return(2);
+
+  const uint32_t * cigar = (const uint32_t *)(read_name + core->l_read_name);
+  for(uint16_t i = 0; i < core->n_cigar_op; i++) {
+    if((cigar[i] & 0xf) > 8) return(0);
+  }
+  return(1);
+}
+
+/*
+  Moves data_buf_cursor to the first read starting in the shard. A read is
+    accepted if it and the (up to) 3 reads after it are plausible.
+  If more data is needed to decide, the data from that position is kept, and
+    shard_syncing remains set
+*/
+inline void pbam_in::shard_resync() {
+  const unsigned int n_chain = 4;
+  size_t stop = data_buf_cap;
+  if(shard_stop != (uint64_t)-1) {
+    const uint64_t buf_start = data_stream_pos - data_buf_cap;
+    stop = shard_stop > buf_start ?
+      std::min(data_buf_cap, (size_t)(shard_stop - buf_start)) : 0;
+  }
+
+  for(size_t pos = data_buf_cursor; pos < stop; pos++) {
+    size_t read_pos = pos;
+    int ret = 1;
+    for(unsigned int i = 0; i < n_chain && read_pos < data_buf_cap; i++) {
+      ret = check_read_start(data_buf + read_pos, data_buf_cap - read_pos);
+      if(ret != 1) break;
+      read_pos += *(uint32_t *)(data_buf + read_pos) + 4;
+    }
+    if(ret == 0) continue;
+    data_buf_cursor = pos;
+    if(ret == 1) shard_syncing = false;
+    return;
+  }
+  // No read starts within the shard's blocks
+  data_buf_cursor = std::max(data_buf_cursor, stop);
+  if(shard_stop != (uint64_t)-1) shard_syncing = false;
+}
+
+// Raises the read limit of the shard if its last read continues past it.
+//   Returns whether the limit was raised
+inline bool pbam_in::shard_extend_limit() {
+  if(!shard_active || shard_done() || shard_read_limit >= IS_LENGTH) return(false);
+  shard_read_limit = std::min(IS_LENGTH,
+    shard_read_limit + (size_t)(FILE_BUFFER_CAP / chunks_per_file_buf));
+  return(true);
+}
+
+#endif
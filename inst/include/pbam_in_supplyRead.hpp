@@ -32,7 +32,19 @@ inline pbam1_t pbam_in::supplyRead(const unsigned int thread_id) {
   if(read_cursors.at(thread_id) >= read_ptr_ends.at(thread_id)) {
     return(read);
   }
-  read = pbam1_t(data_buf + read_cursors.at(thread_id), false);
+  if(part_mode != 0) return(supply_partitioned_read(thread_id));
+  read = pbam1_t(supply_buf + read_cursors.at(thread_id), false);
+  
+  // In region queries, skip reads that do not overlap any region
+  while(region_active && read.validate() && 
+      !read_in_regions(supply_buf + read_cursors.at(thread_id))) {
+    read_cursors.at(thread_id) += read.block_size() + 4;
+    if(read_cursors.at(thread_id) >= read_ptr_ends.at(thread_id)) {
+      return(pbam1_t());
+    }
+    read = pbam1_t(supply_buf + read_cursors.at(thread_id), false);
+  }
+  
   if(read.validate()) {
     read_cursors.at(thread_id) += read.block_size() + 4;
   } else {
@@ -46,4 +58,54 @@ inline pbam1_t pbam_in::supplyRead(const unsigned int thread_id) {
   return(read);
 }
 
-#endif
+// Walks the thread's reads as supplyRead(), making one view of each read
+inline pbam_view pbam_in::supplyView(const unsigned int thread_id) {
+  if(thread_id >= read_cursors.size()) {
+    cout << "Invalid thread number parsed to supplyView()\n";
+    return(pbam_view());
+  }
+  size_t & cursor = read_cursors.at(thread_id);
+  const size_t end = read_ptr_ends.at(thread_id);
+  while(cursor < end) {
+    const char * read_ptr = supply_buf + 
+      (part_mode != 0 ? part_sorted[cursor] : cursor);
+    pbam_view view(read_ptr);
+    if(!view.valid()) {
+      cout << "Invalid read found before end of thread buffer " 
+        << thread_id << ". read_cursor = " << cursor
+        << ", read_ptr_ends = " << end << '\n';
+      return(view);
+    }
+    cursor += (part_mode != 0 ? 1 : view.block_size() + 4);
+    // In region queries, skip reads that do not overlap any region
+    if(!region_active || read_in_regions(read_ptr)) return(view);
+  }
+  return(pbam_view());
+}
+
+// The reads of all threads form one run if threads 1 onwards have not started
+inline int pbam_in::supplyBatch(char * & batch, size_t & batch_size) {
+  batch = supply_buf;
+  batch_size = 0;
+  if(part_mode != 0 || region_active) {
+    cout << "supplyBatch() is not available for partitioned reads or "
+      << "region queries\n";
+    return(-1);
+  }
+  if(read_cursors.size() == 0) return(0);
+  for(unsigned int i = 1; i < read_cursors.size(); i++) {
+    if(read_cursors.at(i) != read_ptr_ends.at(i - 1)) {
+      cout << "supplyBatch() called after thread " << i 
+        << " was supplied reads\n";
+      return(-1);
+    }
+  }
+  const size_t batch_start = read_cursors.front();
+  const size_t batch_end = read_ptr_ends.back();
+  read_cursors = read_ptr_ends;
+  batch = supply_buf + batch_start;
+  if(batch_end > batch_start) batch_size = batch_end - batch_start;
+  return(0);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,684 @@
+/* pbam_index.hpp pbam_index class (BAI / CSI index reader and region queries)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_index
+#define _pbam_index
+
+#include <algorithm>
+
+/*
+  A BGZF virtual offset is (coffset << 16 | uoffset), where coffset is the
+    file offset of a BGZF block, and uoffset is the offset within the
+    decompressed block
+*/
+inline uint64_t pbam_voffset(const uint64_t coffset, const uint32_t uoffset) {
+  return((coffset << 16) | (uoffset & 0xffff));
+}
+
+// A range of reads in the BAM file, between two virtual offsets
+struct pbam_chunk {
+  uint64_t beg;
+  uint64_t end;
+};
+
+// A genomic region: 0-based, half-open [start, end) on reference refID
+struct pbam_region {
+  int32_t refID;
+  uint32_t start;
+  uint32_t end;
+};
+
+// Consecutive reads in the same reference and bin, between two virtual offsets
+struct pbam_index_run {
+  int32_t refID;
+  uint32_t bin;
+  uint64_t beg;
+  uint64_t end;
+  uint32_t n_mapped;
+  uint32_t n_unmapped;
+};
+
+// First read overlapping a 2^min_shift window of the linear index
+struct pbam_index_window {
+  int32_t refID;
+  uint32_t window;
+  uint64_t voffset;
+};
+
+/*
+  Index entries accumulated by one thread from a contiguous range of reads,
+    while the index is built during a scan. Batches are merged into the
+    pbam_index in file order by pbam_index::build_merge()
+*/
+struct pbam_index_batch {
+  std::vector<pbam_index_run> runs;
+  std::vector<pbam_index_window> windows;
+  uint64_t n_no_coor;       // Reads without a reference
+  bool has_reads;
+  bool unsorted;            // Reads in this batch are out of order
+  uint64_t first_key;       // Sort keys of the first and last reads
+  uint64_t last_key;
+  int32_t window_refID;     // Reference and last window added to windows
+  int64_t last_window;
+
+  void clear() {
+    runs.resize(0); windows.resize(0);
+    n_no_coor = 0; has_reads = false; unsorted = false;
+    first_key = 0; last_key = 0;
+    window_refID = -1; last_window = -1;
+  };
+};
+
+/*
+  Binning index of a BAM file (.bai or .csi). Bins and the linear index are
+    stored per reference. The binning scheme is described by min_shift (size
+    of the smallest bins, 2^min_shift) and depth (number of levels below the
+    root); for BAI, min_shift = 14 and depth = 5, which addresses references
+    up to 2^29 bp. CSI stores its own min_shift and depth, and replaces the
+    linear index with the smallest read offset of each bin (loffset)
+*/
+class pbam_index {
+  private:
+    struct pbam_bin {
+      uint64_t loffset;               // CSI only: smallest offset in the bin
+      std::vector<pbam_chunk> chunks;
+    };
+    struct pbam_ref_index {
+      std::map< uint32_t, pbam_bin > bins;
+      std::vector<uint64_t> linear;   // BAI only: smallest offset per window
+    };
+
+    int min_shift;
+    int depth;
+    bool is_csi;
+    std::vector<pbam_ref_index> refs;
+    uint64_t n_no_coor;       // Reads without a reference
+
+    // Index construction
+    bool build_has_reads;
+    uint64_t build_last_key;  // Sort key of the last read merged
+
+    // Decompresses a BGZF-compressed index (CSI) in place
+    int inflate_bgzf(std::vector<char> & buf, const std::string & filename);
+
+    int parse_bai(const std::vector<char> & buf);
+    int parse_csi(const std::vector<char> & buf);
+
+    // Smallest bin that contains [beg, end)
+    uint32_t reg2bin(const uint64_t beg, const uint64_t end) const;
+
+    // Lists bins that may contain reads overlapping [beg, end)
+    void reg2bins(const uint64_t beg, const uint64_t end,
+      std::vector<uint32_t> & bins) const;
+
+    // Smallest file offset of reads overlapping beg, or 0 if not known
+    uint64_t min_offset(const pbam_ref_index & ref, const uint64_t beg) const;
+
+    // First bin of the given level (0 = root)
+    uint32_t first_bin(const int level) const {
+      return((uint32_t)((((uint64_t)1 << (level * 3)) - 1) / 7));
+    };
+
+    // First bin of the deepest level
+    uint32_t first_leaf_bin() const {return(first_bin(depth));};
+
+    // First linear index window covered by bin
+    uint64_t bin_first_window(const uint32_t bin) const;
+
+    // Pseudo-bin holding index metadata, which is not a real bin
+    uint32_t meta_bin() const {
+      return((uint32_t)((((uint64_t)1 << ((depth + 1) * 3)) - 1) / 7) + 1);
+    };
+
+  public:
+    pbam_index() {clear();};
+
+    /*
+      Reads a .bai or .csi file; the format is detected from its contents.
+      Returns 0 if success, or -1 if error
+    */
+    int load(const std::string & filename);
+
+    // Whether an index has been loaded
+    bool loaded() const {return(refs.size() > 0);};
+
+    // Number of references in the index
+    int n_ref() const {return((int)refs.size());};
+
+    // Largest reference length that the binning scheme can address
+    uint64_t max_coord() const {return((uint64_t)1 << (min_shift + depth * 3));};
+
+    // Appends the chunks that may contain reads overlapping region to chunks
+    void query(const pbam_region & region,
+      std::vector<pbam_chunk> & chunks) const;
+
+    // Sorts chunks and merges those that overlap or share a BGZF block
+    static void merge_chunks(std::vector<pbam_chunk> & chunks);
+
+    void clear() {
+      refs.clear(); min_shift = 14; depth = 5; is_csi = false; n_no_coor = 0;
+      build_has_reads = false; build_last_key = 0;
+    };
+
+    // ************************* Index construction ***************************
+
+    /*
+      Starts building an empty index for n_ref references. Builds a BAI if
+        csi is false (min_shift and depth must be 14 and 5), otherwise a CSI
+      Returns 0 if success, or -1 if min_shift / depth are out of range
+    */
+    int build_start(const int n_ref, const int new_min_shift, 
+      const int new_depth, const bool csi);
+
+    /*
+      Adds a read to batch. The read spans [pos, end) on refID, and lies
+        between virtual offsets beg_off and end_off in the BAM file.
+      Thread-safe, as long as each thread uses its own batch
+    */
+    void build_add(pbam_index_batch & batch, const int32_t refID,
+      const int32_t pos, const uint32_t end, const bool mapped,
+      const uint64_t beg_off, const uint64_t end_off) const;
+
+    /*
+      Merges a batch into the index. Batches must be merged in file order.
+      Returns 0 if success, or -1 if the reads are not coordinate-sorted
+    */
+    int build_merge(const pbam_index_batch & batch);
+
+    // Completes the linear index (BAI) or bin offsets (CSI), after all reads
+    void build_finish();
+
+    // Writes the index to file (CSI is BGZF-compressed). Returns 0 if success
+    int save(const std::string & filename) const;
+};
+
+// Reads a little-endian value from buf at cursor, checking bounds
+template <typename T>
+inline bool pbam_index_get(const std::vector<char> & buf, size_t & cursor,
+    T & val) {
+  if(cursor + sizeof(T) > buf.size()) return(false);
+  memcpy(&val, buf.data() + cursor, sizeof(T));
+  cursor += sizeof(T);
+  return(true);
+}
+
+inline int pbam_index::load(const std::string & filename) {
+  clear();
+  std::ifstream inIDX(filename, std::ios::in | std::ifstream::binary);
+  if(!inIDX.is_open()) {
+    cout << "Could not open BAM index " << filename << '\n';
+    return(-1);
+  }
+  std::vector<char> buf(
+    (std::istreambuf_iterator<char>(inIDX)), std::istreambuf_iterator<char>());
+  inIDX.close();
+
+  if(buf.size() >= 18 && is_bgzf_header(buf.data())) {
+    if(inflate_bgzf(buf, filename) != 0) return(-1);
+  }
+
+  int ret = -1;
+  if(buf.size() >= 8 && memcmp(buf.data(), "BAI\1", 4) == 0) {
+    ret = parse_bai(buf);
+  } else if(buf.size() >= 16 && memcmp(buf.data(), "CSI\1", 4) == 0) {
+    ret = parse_csi(buf);
+  } else {
+    cout << filename << " is not a valid BAI or CSI index\n";
+    return(-1);
+  }
+  if(ret != 0) {
+    cout << "BAM index " << filename << " is truncated or corrupt\n";
+    clear();
+    return(-1);
+  }
+  return(0);
+}
+
+inline int pbam_index::inflate_bgzf(std::vector<char> & buf,
+    const std::string & filename) {
+  std::vector<char> out;
+  pbam_inflater inflater;
+  if(inflater.init() != 0) return(-1);
+  size_t pos = 0;
+  while(pos < buf.size()) {
+    if(pos + 18 > buf.size() || !is_bgzf_header(buf.data() + pos)) break;
+    uint16_t bsize = 0;
+    memcpy(&bsize, buf.data() + pos + 16, 2);
+    const uint32_t block_len = (uint32_t)bsize + 1;
+    if(block_len < 26 || pos + block_len > buf.size()) break;
+    uint32_t isize = 0;
+    memcpy(&isize, buf.data() + pos + block_len - 4, 4);
+    if(isize > bgzfMaxBlockLength) break;
+    if(isize > 0) {
+      const size_t out_pos = out.size();
+      out.resize(out_pos + isize);
+      if(inflater.inflate_block(buf.data() + pos, block_len,
+          out.data() + out_pos, isize) != 0) break;
+    }
+    pos += block_len;
+  }
+  if(pos != buf.size()) {
+    cout << "BGZF decompression of BAM index " << filename << " failed\n";
+    return(-1);
+  }
+  buf.swap(out);
+  return(0);
+}
+
+inline int pbam_index::parse_bai(const std::vector<char> & buf) {
+  size_t cursor = 4;
+  min_shift = 14; depth = 5; is_csi = false;
+
+  int32_t n_ref = 0;
+  pbam_index_get(buf, cursor, n_ref);
+  if(n_ref < 0) return(-1);
+  refs.resize(n_ref);
+
+  for(int32_t i = 0; i < n_ref; i++) {
+    int32_t n_bin = 0;
+    if(!pbam_index_get(buf, cursor, n_bin)) return(-1);
+    for(int32_t j = 0; j < n_bin; j++) {
+      uint32_t bin = 0; int32_t n_chunk = 0;
+      if(!pbam_index_get(buf, cursor, bin) || 
+          !pbam_index_get(buf, cursor, n_chunk)) return(-1);
+      if(n_chunk < 0 || cursor + (size_t)n_chunk * 16 > buf.size()) return(-1);
+      pbam_bin & b = refs.at(i).bins[bin];
+      b.loffset = 0;
+      b.chunks.resize(n_chunk);
+      for(int32_t k = 0; k < n_chunk; k++) {
+        pbam_index_get(buf, cursor, b.chunks.at(k).beg);
+        pbam_index_get(buf, cursor, b.chunks.at(k).end);
+      }
+    }
+    int32_t n_intv = 0;
+    if(!pbam_index_get(buf, cursor, n_intv)) return(-1);
+    if(n_intv < 0 || cursor + (size_t)n_intv * 8 > buf.size()) return(-1);
+    refs.at(i).linear.resize(n_intv);
+    for(int32_t k = 0; k < n_intv; k++) {
+      pbam_index_get(buf, cursor, refs.at(i).linear.at(k));
+    }
+  }
+  pbam_index_get(buf, cursor, n_no_coor);   // Optional
+  return(0);
+}
+
+inline int pbam_index::parse_csi(const std::vector<char> & buf) {
+  size_t cursor = 4;
+  int32_t i_min_shift = 0, i_depth = 0, l_aux = 0;
+  pbam_index_get(buf, cursor, i_min_shift);
+  pbam_index_get(buf, cursor, i_depth);
+  pbam_index_get(buf, cursor, l_aux);
+  // Bin numbers must fit in 32 bits, and coordinates in 64 bits
+  if(i_min_shift < 1 || i_depth < 0 || i_depth > 10 ||
+      i_min_shift + i_depth * 3 > 63) return(-1);
+  if(l_aux < 0 || cursor + (size_t)l_aux > buf.size()) return(-1);
+  cursor += l_aux;
+  min_shift = i_min_shift; depth = i_depth; is_csi = true;
+
+  int32_t n_ref = 0;
+  if(!pbam_index_get(buf, cursor, n_ref) || n_ref < 0) return(-1);
+  refs.resize(n_ref);
+
+  for(int32_t i = 0; i < n_ref; i++) {
+    int32_t n_bin = 0;
+    if(!pbam_index_get(buf, cursor, n_bin)) return(-1);
+    for(int32_t j = 0; j < n_bin; j++) {
+      uint32_t bin = 0; uint64_t loffset = 0; int32_t n_chunk = 0;
+      if(!pbam_index_get(buf, cursor, bin) || 
+          !pbam_index_get(buf, cursor, loffset) ||
+          !pbam_index_get(buf, cursor, n_chunk)) return(-1);
+      if(n_chunk < 0 || cursor + (size_t)n_chunk * 16 > buf.size()) return(-1);
+      pbam_bin & b = refs.at(i).bins[bin];
+      b.loffset = loffset;
+      b.chunks.resize(n_chunk);
+      for(int32_t k = 0; k < n_chunk; k++) {
+        pbam_index_get(buf, cursor, b.chunks.at(k).beg);
+        pbam_index_get(buf, cursor, b.chunks.at(k).end);
+      }
+    }
+  }
+  pbam_index_get(buf, cursor, n_no_coor);   // Optional
+  return(0);
+}
+
+inline void pbam_index::reg2bins(const uint64_t beg, const uint64_t end,
+    std::vector<uint32_t> & bins) const {
+  bins.clear();
+  if(end <= beg) return;
+  const uint64_t last = end - 1;
+  int s = min_shift + depth * 3;
+  uint32_t t = 0;
+  for(int l = 0; l <= depth; l++) {
+    uint32_t b = t + (uint32_t)(beg >> s);
+    uint32_t e = t + (uint32_t)(last >> s);
+    for(uint32_t i = b; i <= e; i++) bins.push_back(i);
+    s -= 3;
+    t += 1u << (l * 3);
+  }
+}
+
+inline uint64_t pbam_index::min_offset(const pbam_ref_index & ref,
+    const uint64_t beg) const {
+  if(!is_csi) {
+    if(ref.linear.size() == 0) return(0);
+    size_t w = (size_t)(beg >> min_shift);
+    return(ref.linear.at(std::min(w, ref.linear.size() - 1)));
+  }
+  // CSI: loffset of the deepest existing bin at or before beg, climbing
+  //   to the parent bin when a level has no bins to the left
+  uint32_t bin = first_leaf_bin() + (uint32_t)(beg >> min_shift);
+  while(bin > 0) {
+    std::map< uint32_t, pbam_bin >::const_iterator it = ref.bins.find(bin);
+    if(it != ref.bins.end()) return(it->second.loffset);
+    const uint32_t parent = (bin - 1) >> 3;
+    const uint32_t first_sibling = (parent << 3) + 1;
+    if(bin > first_sibling) {
+      bin--;
+    } else {
+      bin = parent;
+    }
+  }
+  std::map< uint32_t, pbam_bin >::const_iterator it = ref.bins.find(0);
+  return(it != ref.bins.end() ? it->second.loffset : 0);
+}
+
+inline void pbam_index::query(const pbam_region & region,
+    std::vector<pbam_chunk> & chunks) const {
+  if(region.refID < 0 || region.refID >= (int32_t)refs.size()) return;
+  const pbam_ref_index & ref = refs.at(region.refID);
+
+  // Reads starting before this offset cannot overlap the region
+  const uint64_t min_off = min_offset(ref, region.start);
+
+  std::vector<uint32_t> bins;
+  reg2bins(region.start, region.end, bins);
+  const uint32_t skip_bin = meta_bin();
+  for(unsigned int i = 0; i < bins.size(); i++) {
+    if(bins.at(i) == skip_bin) continue;
+    std::map< uint32_t, pbam_bin >::const_iterator it =
+      ref.bins.find(bins.at(i));
+    if(it == ref.bins.end()) continue;
+    const std::vector<pbam_chunk> & bin_chunks = it->second.chunks;
+    for(unsigned int k = 0; k < bin_chunks.size(); k++) {
+      if(bin_chunks.at(k).end > min_off) chunks.push_back(bin_chunks.at(k));
+    }
+  }
+}
+
+inline void pbam_index::merge_chunks(std::vector<pbam_chunk> & chunks) {
+  if(chunks.size() == 0) return;
+  std::sort(chunks.begin(), chunks.end(),
+    [](const pbam_chunk & a, const pbam_chunk & b) {return(a.beg < b.beg);});
+  size_t n = 0;
+  for(size_t i = 1; i < chunks.size(); i++) {
+    // Merge if overlapping, or if the next chunk starts in the same BGZF block
+    if(chunks.at(i).beg <= chunks.at(n).end ||
+        (chunks.at(i).beg >> 16) == (chunks.at(n).end >> 16)) {
+      chunks.at(n).end = std::max(chunks.at(n).end, chunks.at(i).end);
+    } else {
+      chunks.at(++n) = chunks.at(i);
+    }
+  }
+  chunks.resize(n + 1);
+}
+
+inline uint32_t pbam_index::reg2bin(const uint64_t beg, const uint64_t end) const {
+  const uint64_t last = end - 1;
+  int s = min_shift;
+  for(int l = depth; l > 0; l--) {
+    if(beg >> s == last >> s) return(first_bin(l) + (uint32_t)(beg >> s));
+    s += 3;
+  }
+  return(0);
+}
+
+inline uint64_t pbam_index::bin_first_window(const uint32_t bin) const {
+  int l = 0;
+  while(l < depth && bin >= first_bin(l + 1)) l++;
+  return((uint64_t)(bin - first_bin(l)) << ((depth - l) * 3));
+}
+
+// ************************* Index construction *******************************
+
+inline int pbam_index::build_start(const int n_ref, const int new_min_shift,
+    const int new_depth, const bool csi) {
+  clear();
+  if(new_min_shift < 1 || new_depth < 0 || new_depth > 10 ||
+      new_min_shift + new_depth * 3 > 63) return(-1);
+  if(!csi && (new_min_shift != 14 || new_depth != 5)) return(-1);
+  min_shift = new_min_shift; depth = new_depth; is_csi = csi;
+  refs.resize(n_ref);
+  return(0);
+}
+
+inline void pbam_index::build_add(pbam_index_batch & batch, 
+    const int32_t refID, const int32_t pos, const uint32_t end, 
+    const bool mapped, const uint64_t beg_off, const uint64_t end_off) const {
+  // Reads are sorted by reference, then position; reads without a reference
+  //   come last
+  const uint64_t key = refID < 0 ? ((uint64_t)INT32_MAX << 32) :
+    ((uint64_t)refID << 32) | (uint32_t)std::max(pos, 0);
+  if(!batch.has_reads) {
+    batch.first_key = key;
+    batch.has_reads = true;
+  } else if(key < batch.last_key) {
+    batch.unsorted = true;
+  }
+  batch.last_key = key;
+  if(refID < 0) {
+    batch.n_no_coor++;
+    return;
+  }
+
+  const uint32_t beg = (uint32_t)std::max(pos, 0);
+  const uint32_t bin = reg2bin(beg, std::max(end, beg + 1));
+  if(batch.runs.size() > 0 && batch.runs.back().refID == refID &&
+      batch.runs.back().bin == bin && batch.runs.back().end == beg_off) {
+    batch.runs.back().end = end_off;
+  } else {
+    pbam_index_run run;
+    run.refID = refID; run.bin = bin; run.beg = beg_off; run.end = end_off;
+    run.n_mapped = 0; run.n_unmapped = 0;
+    batch.runs.push_back(run);
+  }
+  if(mapped) {
+    batch.runs.back().n_mapped++;
+  } else {
+    batch.runs.back().n_unmapped++;
+  }
+
+  // Windows are first covered in increasing order, as reads are sorted
+  if(batch.window_refID != refID) {
+    batch.window_refID = refID;
+    batch.last_window = -1;
+  }
+  const int64_t w_end = (int64_t)((std::max(end, beg + 1) - 1) >> min_shift);
+  for(int64_t w = std::max(batch.last_window + 1, (int64_t)(beg >> min_shift));
+      w <= w_end; w++) {
+    pbam_index_window win;
+    win.refID = refID; win.window = (uint32_t)w; win.voffset = beg_off;
+    batch.windows.push_back(win);
+  }
+  batch.last_window = std::max(batch.last_window, w_end);
+}
+
+inline int pbam_index::build_merge(const pbam_index_batch & batch) {
+  if(!batch.has_reads) return(0);
+  if(batch.unsorted || (build_has_reads && batch.first_key < build_last_key)) {
+    return(-1);
+  }
+  build_has_reads = true;
+  build_last_key = batch.last_key;
+  n_no_coor += batch.n_no_coor;
+
+  const uint32_t stats_bin = meta_bin();
+  for(unsigned int i = 0; i < batch.runs.size(); i++) {
+    const pbam_index_run & run = batch.runs.at(i);
+    if(run.refID >= (int32_t)refs.size()) return(-1);
+    pbam_ref_index & ref = refs.at(run.refID);
+    
+    std::vector<pbam_chunk> & chunks = ref.bins[run.bin].chunks;
+    if(chunks.size() > 0 && chunks.back().end == run.beg) {
+      chunks.back().end = run.end;
+    } else {
+      pbam_chunk chunk;
+      chunk.beg = run.beg; chunk.end = run.end;
+      chunks.push_back(chunk);
+    }
+
+    // The pseudo-bin holds the reference's offsets and read counts
+    std::vector<pbam_chunk> & stats = ref.bins[stats_bin].chunks;
+    if(stats.size() == 0) {
+      stats.resize(2);
+      stats.at(0).beg = run.beg;
+      stats.at(1).beg = 0; stats.at(1).end = 0;
+    }
+    stats.at(0).end = run.end;
+    stats.at(1).beg += run.n_mapped;
+    stats.at(1).end += run.n_unmapped;
+  }
+
+  // An offset of 0 marks windows not yet covered (no read starts at 0)
+  for(unsigned int i = 0; i < batch.windows.size(); i++) {
+    const pbam_index_window & win = batch.windows.at(i);
+    std::vector<uint64_t> & linear = refs.at(win.refID).linear;
+    if(win.window >= linear.size()) linear.resize(win.window + 1, 0);
+    if(linear.at(win.window) == 0) linear.at(win.window) = win.voffset;
+  }
+  return(0);
+}
+
+inline void pbam_index::build_finish() {
+  const uint32_t stats_bin = meta_bin();
+  for(unsigned int i = 0; i < refs.size(); i++) {
+    pbam_ref_index & ref = refs.at(i);
+    // Windows without reads take the offset of the previous window
+    for(size_t w = 1; w < ref.linear.size(); w++) {
+      if(ref.linear.at(w) == 0) ref.linear.at(w) = ref.linear.at(w - 1);
+    }
+    std::map< uint32_t, pbam_bin >::iterator it;
+    for(it = ref.bins.begin(); it != ref.bins.end(); it++) {
+      if(it->first == stats_bin) {
+        it->second.loffset = 0;
+        continue;
+      }
+      merge_chunks(it->second.chunks);
+      const uint64_t w = bin_first_window(it->first);
+      it->second.loffset = w < ref.linear.size() ? ref.linear.at(w) : 0;
+    }
+    if(is_csi) ref.linear.clear();
+  }
+}
+
+// Appends a little-endian value to buf
+template <typename T>
+inline void pbam_index_put(std::vector<char> & buf, const T val) {
+  const size_t cursor = buf.size();
+  buf.resize(cursor + sizeof(T));
+  memcpy(buf.data() + cursor, &val, sizeof(T));
+}
+
+inline int pbam_index::save(const std::string & filename) const {
+  std::vector<char> buf;
+  if(is_csi) {
+    buf.insert(buf.end(), "CSI\1", "CSI\1" + 4);
+    pbam_index_put(buf, (int32_t)min_shift);
+    pbam_index_put(buf, (int32_t)depth);
+    pbam_index_put(buf, (int32_t)0);     // l_aux
+  } else {
+    buf.insert(buf.end(), "BAI\1", "BAI\1" + 4);
+  }
+  pbam_index_put(buf, (int32_t)refs.size());
+  for(unsigned int i = 0; i < refs.size(); i++) {
+    const pbam_ref_index & ref = refs.at(i);
+    pbam_index_put(buf, (int32_t)ref.bins.size());
+    std::map< uint32_t, pbam_bin >::const_iterator it;
+    for(it = ref.bins.begin(); it != ref.bins.end(); it++) {
+      pbam_index_put(buf, it->first);
+      if(is_csi) pbam_index_put(buf, it->second.loffset);
+      pbam_index_put(buf, (int32_t)it->second.chunks.size());
+      for(unsigned int k = 0; k < it->second.chunks.size(); k++) {
+        pbam_index_put(buf, it->second.chunks.at(k).beg);
+        pbam_index_put(buf, it->second.chunks.at(k).end);
+      }
+    }
+    if(!is_csi) {
+      pbam_index_put(buf, (int32_t)ref.linear.size());
+      for(size_t w = 0; w < ref.linear.size(); w++) {
+        pbam_index_put(buf, ref.linear.at(w));
+      }
+    }
+  }
+  pbam_index_put(buf, n_no_coor);
+
+  std::ofstream outIDX(filename, std::ios::out | std::ofstream::binary);
+  if(!outIDX.is_open()) {
+    cout << "Could not open " << filename << " for writing\n";
+    return(-1);
+  }
+  if(!is_csi) {
+    outIDX.write(buf.data(), buf.size());
+  } else {
+    // BGZF blocks hold at most 0xff00 bytes, so that the deflated block
+    //   always fits within 64 Kb
+    const size_t block_data = 0xff00;
+    std::vector<char> block(bgzfMaxBlockLength);
+    pbam_zstream zs;
+    memset(&zs, 0, sizeof(pbam_zstream));
+    if(pbam_zlib_deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, 
+        Z_DEFAULT_STRATEGY) != Z_OK) {
+      cout << "Exception during index compression - deflateInit2() fail\n";
+      return(-1);
+    }
+    for(size_t pos = 0; pos < buf.size() && outIDX.good(); pos += block_data) {
+      const uint32_t len = (uint32_t)std::min(block_data, buf.size() - pos);
+      pbam_zlib_deflateReset(&zs);
+      zs.next_in = (unsigned char *)(buf.data() + pos);
+      zs.avail_in = len;
+      zs.next_out = (unsigned char *)(block.data() + 18);
+      zs.avail_out = (uint32_t)(bgzfMaxBlockLength - 26);
+      if(pbam_zlib_deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        cout << "Exception during index compression - deflate() fail\n";
+        pbam_zlib_deflateEnd(&zs);
+        return(-1);
+      }
+      const uint32_t block_len = 18 + (uint32_t)zs.total_out + 8;
+      memcpy(block.data(), bamGzipHead, 16);
+      const uint16_t bsize = (uint16_t)(block_len - 1);
+      memcpy(block.data() + 16, &bsize, 2);
+      const uint32_t crc = pbam_crc32(buf.data() + pos, len);
+      memcpy(block.data() + block_len - 8, &crc, 4);
+      memcpy(block.data() + block_len - 4, &len, 4);
+      outIDX.write(block.data(), block_len);
+    }
+    pbam_zlib_deflateEnd(&zs);
+    outIDX.write(bamEOF, bamEOFlength);
+  }
+  outIDX.close();
+  if(outIDX.fail()) {
+    cout << "Error writing index " << filename << '\n';
+    return(-1);
+  }
+  return(0);
+}
+
+#endif
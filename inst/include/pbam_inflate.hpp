@@ -0,0 +1,264 @@
+/* pbam_inflate.hpp pbam_inflater class (BGZF block inflate backends)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_inflate
+#define _pbam_inflate
+
+/*
+  Backends used to inflate BGZF blocks.
+
+  - PBAM_INFLATE_ZLIB uses the zlib streaming API. This is always available.
+      If compiled with -DOMPBAM_USE_ZLIBNG, the native zlib-ng API is used
+      instead of stock zlib (both cannot be linked into the same unit)
+  - PBAM_INFLATE_LIBDEFLATE uses libdeflate's whole-buffer decompressor,
+      which suits BGZF blocks (<= 64 Kb) well. Requires -DOMPBAM_USE_LIBDEFLATE
+      and linking with -ldeflate
+  - PBAM_INFLATE_AUTO picks the fastest backend that was compiled in.
+
+  If a requested backend is not compiled in, zlib is used instead.
+*/
+enum pbam_inflate_backend {
+  PBAM_INFLATE_AUTO       = 0,
+  PBAM_INFLATE_ZLIB       = 1,
+  PBAM_INFLATE_LIBDEFLATE = 2
+};
+
+// zlib and zlib-ng (native API) share the same streaming interface
+//   (deflate is only used to write BGZF-compressed index files)
+#ifdef OMPBAM_USE_ZLIBNG
+  typedef zng_stream pbam_zstream;
+  #define pbam_zlib_inflateInit2  zng_inflateInit2
+  #define pbam_zlib_inflate       zng_inflate
+  #define pbam_zlib_inflateReset  zng_inflateReset
+  #define pbam_zlib_inflateEnd    zng_inflateEnd
+  #define pbam_zlib_crc32         zng_crc32
+  #define pbam_zlib_deflateInit2  zng_deflateInit2
+  #define pbam_zlib_deflate       zng_deflate
+  #define pbam_zlib_deflateReset  zng_deflateReset
+  #define pbam_zlib_deflateEnd    zng_deflateEnd
+#else
+  typedef z_stream pbam_zstream;
+  #define pbam_zlib_inflateInit2  inflateInit2
+  #define pbam_zlib_inflate       inflate
+  #define pbam_zlib_inflateReset  inflateReset
+  #define pbam_zlib_inflateEnd    inflateEnd
+  #define pbam_zlib_crc32         crc32
+  #define pbam_zlib_deflateInit2  deflateInit2
+  #define pbam_zlib_deflate       deflate
+  #define pbam_zlib_deflateReset  deflateReset
+  #define pbam_zlib_deflateEnd    deflateEnd
+#endif
+
+#include "pbam_crc32.hpp"
+
+// Returns whether the given backend was compiled in
+inline bool pbam_inflate_available(const int backend) {
+  switch(backend) {
+    case PBAM_INFLATE_AUTO: case PBAM_INFLATE_ZLIB:
+      return(true);
+    case PBAM_INFLATE_LIBDEFLATE:
+      #ifdef OMPBAM_USE_LIBDEFLATE
+        return(true);
+      #else
+        return(false);
+      #endif
+  }
+  return(false);
+}
+
+// Resolves PBAM_INFLATE_AUTO and unavailable backends to a concrete backend
+inline int pbam_inflate_resolve(const int backend) {
+  if(backend == PBAM_INFLATE_AUTO) {
+    #ifdef OMPBAM_USE_LIBDEFLATE
+      return(PBAM_INFLATE_LIBDEFLATE);
+    #else
+      return(PBAM_INFLATE_ZLIB);
+    #endif
+  }
+  if(!pbam_inflate_available(backend)) return(PBAM_INFLATE_ZLIB);
+  return(backend);
+}
+
+// Returns a printable name of the given backend
+inline std::string pbam_inflate_name(const int backend) {
+  switch(pbam_inflate_resolve(backend)) {
+    case PBAM_INFLATE_LIBDEFLATE:
+      return("libdeflate");
+    default:
+      #ifdef OMPBAM_USE_ZLIBNG
+        return("zlib-ng");
+      #else
+        return("zlib");
+      #endif
+  }
+}
+
+/*
+  Decompressor for raw deflate data contained in BGZF blocks.
+  One pbam_inflater is used per decompression thread. The backend state is
+    allocated once by init(), reset between blocks, and freed by end()
+*/
+class pbam_inflater {
+  private:
+    int backend_in_use;
+    pbam_zstream zs;
+    bool zs_ready;
+    #ifdef OMPBAM_USE_LIBDEFLATE
+    struct libdeflate_decompressor * ld;
+    #endif
+
+    int inflate_zlib(char * src, const uint32_t src_len,
+      char * dest, const uint32_t dest_len);
+    #ifdef OMPBAM_USE_LIBDEFLATE
+    int inflate_libdeflate(char * src, const uint32_t src_len,
+      char * dest, const uint32_t dest_len);
+    #endif
+
+// Disable copy construction / assignment (doing so triggers compile errors)
+    pbam_inflater(const pbam_inflater &t);
+    pbam_inflater & operator = (const pbam_inflater &t);
+  public:
+    pbam_inflater();
+    ~pbam_inflater();
+
+    // Allocates resources for the given backend. Returns 0 if success
+    int init(const int backend = PBAM_INFLATE_AUTO);
+
+    // Releases resources held by the backend
+    void end();
+
+    /*
+      Inflates a whole BGZF block of block_len bytes (BSIZE + 1) into dest,
+        which must hold exactly dest_len (the block's ISIZE) bytes
+      If check_crc is set, the block's CRC32 is also verified (for all
+        backends, by pbam_crc32(), so that a mismatch is told apart from
+        corrupt deflate data)
+      Returns 0 if success, -1 if inflate error, -2 if CRC mismatch
+    */
+    int inflate_block(char * block, const uint32_t block_len,
+      char * dest, const uint32_t dest_len, const bool check_crc = true);
+
+    int backend() const {return(backend_in_use);};
+};
+
+inline pbam_inflater::pbam_inflater() {
+  backend_in_use = PBAM_INFLATE_ZLIB;
+  memset(&zs, 0, sizeof(pbam_zstream));
+  zs_ready = false;
+  #ifdef OMPBAM_USE_LIBDEFLATE
+  ld = NULL;
+  #endif
+}
+
+inline pbam_inflater::~pbam_inflater() {
+  end();
+}
+
+inline int pbam_inflater::init(const int backend) {
+  end();
+  backend_in_use = pbam_inflate_resolve(backend);
+  #ifdef OMPBAM_USE_LIBDEFLATE
+  if(backend_in_use == PBAM_INFLATE_LIBDEFLATE) {
+    ld = libdeflate_alloc_decompressor();
+    if(!ld) {
+      cout << "Exception during BAM decompression - "
+        << "libdeflate_alloc_decompressor() fail\n";
+      return(-1);
+    }
+    return(0);
+  }
+  #endif
+  memset(&zs, 0, sizeof(pbam_zstream));
+  int ret = pbam_zlib_inflateInit2(&zs, -15);
+  if(ret != Z_OK) {
+    cout << "Exception during BAM decompression - inflateInit2() fail: (" << ret << ") \n";
+    return(-1);
+  }
+  zs_ready = true;
+  return(0);
+}
+
+inline void pbam_inflater::end() {
+  if(zs_ready) pbam_zlib_inflateEnd(&zs);
+  zs_ready = false;
+  #ifdef OMPBAM_USE_LIBDEFLATE
+  if(ld) libdeflate_free_decompressor(ld);
+  ld = NULL;
+  #endif
+}
+
+inline int pbam_inflater::inflate_block(char * block, const uint32_t block_len,
+    char * dest, const uint32_t dest_len, const bool check_crc) {
+  int ret = -1;
+  #ifdef OMPBAM_USE_LIBDEFLATE
+  if(backend_in_use == PBAM_INFLATE_LIBDEFLATE) {
+    ret = inflate_libdeflate(block + 18, block_len - 26, dest, dest_len);
+  }
+  #endif
+  if(backend_in_use != PBAM_INFLATE_LIBDEFLATE) {
+    ret = inflate_zlib(block + 18, block_len - 26, dest, dest_len);
+  }
+  if(ret != 0) return(-1);
+  if(check_crc) {
+    uint32_t * crc_check = (uint32_t *)(block + block_len - 8);
+    if(*crc_check != pbam_crc32(dest, dest_len)) return(-2);
+  }
+  return(0);
+}
+
+inline int pbam_inflater::inflate_zlib(char * src, const uint32_t src_len,
+    char * dest, const uint32_t dest_len) {
+  if(!zs_ready) return(-1);
+  int ret = pbam_zlib_inflateReset(&zs);
+  if(ret != Z_OK) {
+    cout << "Exception during BAM decompression - inflateReset() fail: (" << ret << ") \n";
+    return(-1);
+  }
+  zs.next_in = (unsigned char*)src;
+  zs.avail_in = src_len;
+  zs.next_out = (unsigned char*)dest;
+  zs.avail_out = dest_len;
+
+  ret = pbam_zlib_inflate(&zs, Z_FINISH);
+  if(ret != Z_OK && ret != Z_STREAM_END) {
+    cout << "Exception during BAM decompression - inflate() fail: (" << ret << ") \n";
+    return(-1);
+  }
+  return(0);
+}
+
+#ifdef OMPBAM_USE_LIBDEFLATE
+inline int pbam_inflater::inflate_libdeflate(char * src, const uint32_t src_len,
+    char * dest, const uint32_t dest_len) {
+  size_t actual_out = 0;
+  enum libdeflate_result ret = libdeflate_deflate_decompress(
+    ld, src, src_len, dest, dest_len, &actual_out);
+  if(ret != LIBDEFLATE_SUCCESS || actual_out != dest_len) {
+    cout << "Exception during BAM decompression - "
+      << "libdeflate_deflate_decompress() fail: (" << (int)ret << ") \n";
+    return(-1);
+  }
+  return(0);
+}
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+/* pbam_mate_pairer.hpp pbam_mate_pairer class (pairs mates of reads)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_mate_pairer
+#define _pbam_mate_pairer
+
+/*
+  Pairs the mates of paired reads in files that are not name-sorted (e.g.
+    coordinate-sorted). The first mate seen is copied and kept until its
+    mate is given to add().
+
+  Use one pbam_mate_pairer per thread, with pbam_in::SetPartitionKey("QNAME")
+    so that both mates of each pair are supplied to the same thread.
+  Only primary alignments are paired; secondary and supplementary alignments
+    and unpaired reads are not kept.
+*/
+class pbam_mate_pairer {
+  public:
+    pbam_mate_pairer() {};
+    ~pbam_mate_pairer() {clear();};
+
+    /*
+      Adds a read. If its mate was added before, returns 1 and sets mate to a
+        (realized) copy of the mate. If the read is the first mate seen,
+        copies and keeps it, and returns 0.
+      Returns -1 if the read is not a paired primary alignment flagged as
+        either the first or the last segment (0x40 / 0x80), or if the read
+        kept under its name is flagged as the same segment
+    */
+    int add(pbam1_t & read, pbam1_t & mate);
+
+    // Returns the number of reads whose mates have not been added
+    size_t size() {return(waiting.size());};
+
+    // Moves the reads whose mates have not been added (as realized reads)
+    //   to dest
+    void flush(std::vector<pbam1_t> & dest);
+
+    // Discards all reads kept
+    void clear();
+
+  private:
+    std::unordered_map<std::string, char *> waiting;  // Copies of reads, by name
+
+// Disable copy construction / assignment (doing so triggers compile errors)
+    pbam_mate_pairer(const pbam_mate_pairer &t);
+    pbam_mate_pairer & operator = (const pbam_mate_pairer &t);
+};
+
+inline int pbam_mate_pairer::add(pbam1_t & read, pbam1_t & mate) {
+  if(!read.validate()) return(-1);
+  // Paired, and neither secondary nor supplementary
+  if(!(read.flag() & 0x1) || (read.flag() & 0x900)) return(-1);
+  // Either the first or the last segment
+  const uint32_t segment = read.flag() & 0xC0;
+  if(segment != 0x40 && segment != 0x80) return(-1);
+
+  std::string read_name(read.read_name(), read.l_read_name() - 1);
+  std::unordered_map<std::string, char *>::iterator it = waiting.find(read_name);
+  if(it == waiting.end()) {
+    const size_t read_size = read.block_size() + 4;
+    char * copy = (char*)malloc(read_size);
+    memcpy(copy, read.record(), read_size);
+    waiting.insert({read_name, copy});
+    return(0);
+  }
+  pbam1_t kept(it->second, false);
+  if((kept.flag() & 0xC0) == segment) return(-1);
+  mate = pbam1_t(it->second, true);
+  free(it->second);
+  waiting.erase(it);
+  return(1);
+}
+
+inline void pbam_mate_pairer::flush(std::vector<pbam1_t> & dest) {
+  for(std::unordered_map<std::string, char *>::iterator it = waiting.begin();
+      it != waiting.end(); it++) {
+    dest.push_back(pbam1_t(it->second, true));
+    free(it->second);
+  }
+  waiting.clear();
+}
+
+inline void pbam_mate_pairer::clear() {
+  for(std::unordered_map<std::string, char *>::iterator it = waiting.begin();
+      it != waiting.end(); it++) {
+    free(it->second);
+  }
+  waiting.clear();
+}
+
+#endif
@@ -0,0 +1,483 @@
+/* pbam_merge_in.hpp pbam_merge_in class (merges coordinate-sorted BAM files)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_merge_in
+#define _pbam_merge_in
+
+/*
+  Reads several coordinate-sorted BAM files as one, in coordinate order.
+
+  Each input is read by its own pbam_in. Inputs whose reads are used up are
+    filled at the same time, each by its share of the threads. The reads
+    of the inputs are then merged, using a binary heap keyed by
+    (refID, pos, input index), into a list of pointers to the reads in the
+    inputs' buffers. Reads are not copied.
+
+  A batch ends when any input runs out of decompressed reads, as its next
+    reads are needed to continue the merge. The merged list is split into
+    n_threads ranges, in order, which are supplied as pbam_in::supplyRead().
+    Reads with refID -1 (unmapped) come last, as in samtools sort.
+*/
+
+// An input of pbam_merge_in
+struct pbam_merge_input {
+  std::string filename;
+  size_t file_size;
+  pbam_in * in;
+  char * batch;             // Reads given by the last in->fillReads()
+  size_t cursor;            // Next read to merge, in batch
+  size_t end;               // Size of batch
+  bool needs_fill;          // All reads merged, and the file is not finished
+  uint64_t last_key;        // Key of the last read merged
+};
+
+// The next read of an input, in the merge heap
+struct pbam_merge_head {
+  uint64_t key;
+  unsigned int input_idx;
+};
+
+class pbam_merge_in {
+  public:
+    /*
+      Creates a pbam_merge_in. memory_cap is the total size of the file and
+        data buffers of all inputs (default 2 Gb, the same as a single
+        pbam_in with default settings)
+    */
+    pbam_merge_in(
+      const size_t memory_cap = 2e9,
+      const bool read_file_using_multiple_threads = true,
+      const unsigned int crc_check_interval = 1
+    );
+    ~pbam_merge_in();
+
+    /*
+      Opens the BAM files to merge, which must be coordinate-sorted and have
+        the same references (in the same order).
+      Returns 0 if success, or -1 if any file cannot be opened
+    */
+    int openFiles(const std::vector<std::string> & filenames,
+      unsigned int n_threads, const bool use_mmap = false);
+
+    // Closes all files
+    int closeFiles();
+
+    /*
+      Fills a batch of merged reads.
+      Returns -1 if error (including an input that is not coordinate-sorted),
+        and 1 once all files are read. Otherwise, returns 0
+    */
+    int fillReads();
+
+    // Returns the next read for thread_id, as pbam_in::supplyRead()
+    pbam1_t supplyRead(const unsigned int thread_id = 0);
+
+    // As supplyRead(), but returns a pbam_view (see pbam_in::supplyView())
+    pbam_view supplyView(const unsigned int thread_id = 0);
+
+    size_t remainingThreadReadsBuffer(const unsigned int thread_id = 0);
+
+    // Returns the index (in the vector given to openFiles()) of the file of
+    //   the read last supplied to thread_id; -1 if none
+    int GetFileIndex(const unsigned int thread_id = 0);
+
+    // Returns the number of files, and the name of the given file
+    size_t GetFileCount() {return(inputs.size());};
+    std::string GetFileName(const unsigned int file_idx);
+
+    // Returns the chromosome names and lengths shared by all files.
+    //   Returns the number of chromosomes, or -1 if error
+    int obtainChrs(
+      std::vector<std::string> & s_chr_names,
+      std::vector<uint32_t> & u32_chr_lens
+    );
+
+    /*
+      Enables pipelined decompression of each input (see
+        pbam_in::SetPipelined()). Each input then decompresses in the
+        background using its share of the threads. Must be called before
+        openFiles()
+    */
+    void SetPipelined(const bool use_pipeline) {pipelined = use_pipeline;};
+
+    // Returns the total size of all files
+    size_t GetFileSize() {return(total_size);};
+
+    // Returns the number of bytes decompressed from all files
+    size_t GetProgress();
+
+    // As pbam_in::IncProgress(), over all files
+    size_t IncProgress() {
+      size_t progress = GetProgress();
+      size_t INC = progress - PROGRESS;
+      PROGRESS = progress;
+      return(INC);
+    };
+
+    int GetErrorState() {return(error_state);};
+
+  private:
+// Settings
+    size_t          MEMORY_CAP;
+    bool            multiFileRead;
+    unsigned int    crc_check_interval;
+    unsigned int    threads_to_use      = 1;
+    bool            pipelined           = false;
+
+// Inputs
+    std::vector<pbam_merge_input>   inputs;
+    std::vector<pbam_merge_head>    heap;
+    size_t          total_size;
+    std::vector<std::string>  chr_names;
+    std::vector<uint32_t>     chr_lens;
+
+// Merged reads of the last fillReads(), and their inputs
+    std::vector<char *>         merged;
+    std::vector<unsigned int>   merged_input;
+    std::vector<size_t>         read_cursors;
+    std::vector<size_t>         read_ptr_ends;
+    std::vector<int>            last_input;   // Input of the read last supplied
+
+    size_t          PROGRESS = 0;
+    int             error_state = 0;
+
+    void            check_threads(unsigned int n_threads_to_check);
+    // Fills inputs that need more reads, and adds their next reads to heap
+    int             refill_inputs();
+    // Adds the next read of an input to heap. Returns -1 if out of order
+    int             push_head(const unsigned int input_idx);
+    static uint64_t read_key(const char * read_ptr) {
+      const pbam_core_32 * core = (const pbam_core_32 *)(read_ptr + 4);
+      return(((uint64_t)(uint32_t)core->refID << 32) | (uint32_t)core->pos);
+    };
+    // Orders the heap so that its front is the smallest key
+    static bool merge_later(const pbam_merge_head & a,
+        const pbam_merge_head & b) {
+      if(a.key != b.key) return(a.key > b.key);
+      return(a.input_idx > b.input_idx);
+    };
+
+// Disable copy construction / assignment (doing so triggers compile errors)
+    pbam_merge_in(const pbam_merge_in &t);
+    pbam_merge_in & operator = (const pbam_merge_in &t);
+};
+
+inline pbam_merge_in::pbam_merge_in(
+    const size_t memory_cap,
+    const bool read_file_using_multiple_threads,
+    const unsigned int crc_check_interval
+) {
+  MEMORY_CAP = memory_cap;
+  multiFileRead = read_file_using_multiple_threads;
+  this->crc_check_interval = crc_check_interval;
+  total_size = 0;
+}
+
+inline pbam_merge_in::~pbam_merge_in() {
+  closeFiles();
+}
+
+inline int pbam_merge_in::openFiles(const std::vector<std::string> & filenames,
+    unsigned int n_threads, const bool use_mmap) {
+  closeFiles();
+  check_threads(n_threads);
+  if(filenames.size() == 0) {
+    cout << "No BAM files given\n";
+    return(-1);
+  }
+
+  // Buffers are sized as pbam_multi_in, from each input's share of MEMORY_CAP
+  const size_t min_cap = 1048576;
+  const size_t input_cap = MEMORY_CAP / filenames.size();
+  const size_t max_cap = std::max(min_cap,
+    std::min((size_t)5e8, input_cap / (pipelined ? 6 : 4)));
+  const unsigned int input_threads = std::max(1u,
+    threads_to_use / (unsigned int)filenames.size());
+
+  pbam_merge_input input;
+  input.in = NULL; input.batch = NULL;
+  for(unsigned int i = 0; i < filenames.size(); i++) {
+    input.filename = filenames.at(i);
+    input.cursor = 0; input.end = 0;
+    input.needs_fill = true; input.last_key = 0;
+    {
+      std::ifstream IN(filenames.at(i), std::ios::in | std::ifstream::binary);
+      if(IN.fail()) {
+        cout << "Failed to open " << filenames.at(i) << "\n";
+        closeFiles();
+        return(-1);
+      }
+      IN.seekg(0, std::ios_base::end);
+      input.file_size = (size_t)IN.tellg();
+    }
+    const size_t file_cap = std::max(min_cap,
+      std::min(max_cap, input.file_size + bgzfMaxBlockLength));
+    const size_t data_cap = std::max(2 * file_cap,
+      std::min(16 * min_cap, input_cap / 2));
+    input.in = new pbam_in(file_cap, data_cap,
+      file_cap >= 5 * 8 * min_cap ? 5 : 1, multiFileRead, crc_check_interval);
+    inputs.push_back(input);
+    total_size += input.file_size;
+
+    pbam_in * in = inputs.back().in;
+    in->SetPipelined(pipelined);
+    if(in->openFile(input.filename, pipelined ? input_threads : threads_to_use,
+        use_mmap) != 0) {
+      cout << "Failed to open " << input.filename << "\n";
+      closeFiles();
+      return(-1);
+    }
+
+    std::vector<std::string> s_chr_names;
+    std::vector<uint32_t> u32_chr_lens;
+    in->obtainChrs(s_chr_names, u32_chr_lens);
+    if(i == 0) {
+      chr_names = s_chr_names;
+      chr_lens = u32_chr_lens;
+    } else if(s_chr_names != chr_names || u32_chr_lens != chr_lens) {
+      cout << input.filename << " has different references to "
+        << filenames.at(0) << "\n";
+      closeFiles();
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+inline int pbam_merge_in::closeFiles() {
+  for(unsigned int i = 0; i < inputs.size(); i++) {
+    if(inputs.at(i).in) delete inputs.at(i).in;
+  }
+  inputs.clear();
+  heap.clear();
+  chr_names.clear(); chr_lens.clear();
+  merged.clear(); merged_input.clear();
+  read_cursors.clear(); read_ptr_ends.clear(); last_input.clear();
+  total_size = 0;
+  PROGRESS = 0; error_state = 0;
+  return(0);
+}
+
+inline int pbam_merge_in::fillReads() {
+  if(inputs.size() == 0) {
+    cout << "No BAM files opened\n";
+    error_state = -1;
+    return(-1);
+  }
+  // Check if previous reads are all read:
+  for(unsigned int i = 0; i < read_cursors.size(); i++) {
+    if(remainingThreadReadsBuffer(i) > 0) {
+      cout << "Thread " << i << " has reads remaining. Please debug your code "
+        << "and make sure all threads clear their reads before filling any more reads\n";
+      error_state = -1;
+      return(-1);
+    }
+  }
+  merged.clear();
+  merged_input.clear();
+  read_cursors.assign(threads_to_use, 0);
+  read_ptr_ends.assign(threads_to_use, 0);
+  last_input.assign(threads_to_use, -1);
+
+  if(refill_inputs() != 0) {
+    error_state = -1;
+    return(-1);
+  }
+  if(heap.size() == 0) return(1);
+
+  // Merge until an input runs out of reads
+  while(heap.size() > 0) {
+    std::pop_heap(heap.begin(), heap.end(), merge_later);
+    const unsigned int i = heap.back().input_idx;
+    heap.pop_back();
+    pbam_merge_input & input = inputs.at(i);
+    char * read_ptr = input.batch + input.cursor;
+    merged.push_back(read_ptr);
+    merged_input.push_back(i);
+    input.cursor += *(uint32_t *)read_ptr + 4;
+
+    if(input.cursor < input.end) {
+      if(push_head(i) != 0) {
+        error_state = -1;
+        return(-1);
+      }
+    } else {
+      input.needs_fill = true;
+      break;
+    }
+  }
+
+  // Split merged reads evenly by count
+  const size_t n_merged = merged.size();
+  for(unsigned int t = 0; t < threads_to_use; t++) {
+    read_cursors.at(t) = n_merged * t / threads_to_use;
+    read_ptr_ends.at(t) = n_merged * (t + 1) / threads_to_use;
+  }
+  return(0);
+}
+
+inline pbam1_t pbam_merge_in::supplyRead(const unsigned int thread_id) {
+  if(thread_id >= read_cursors.size()) {
+    cout << "Invalid thread number parsed to supplyRead()\n";
+    return(pbam1_t());
+  }
+  size_t & cursor = read_cursors.at(thread_id);
+  if(cursor >= read_ptr_ends.at(thread_id)) return(pbam1_t());
+  last_input.at(thread_id) = (int)merged_input.at(cursor);
+  return(pbam1_t(merged.at(cursor++), false));
+}
+
+inline pbam_view pbam_merge_in::supplyView(const unsigned int thread_id) {
+  if(thread_id >= read_cursors.size()) {
+    cout << "Invalid thread number parsed to supplyView()\n";
+    return(pbam_view());
+  }
+  size_t & cursor = read_cursors.at(thread_id);
+  if(cursor >= read_ptr_ends.at(thread_id)) return(pbam_view());
+  last_input.at(thread_id) = (int)merged_input.at(cursor);
+  return(pbam_view(merged.at(cursor++)));
+}
+
+inline size_t pbam_merge_in::remainingThreadReadsBuffer(
+    const unsigned int thread_id) {
+  if(thread_id >= read_cursors.size()) return(0);
+  return(read_ptr_ends.at(thread_id) - read_cursors.at(thread_id));
+}
+
+inline int pbam_merge_in::GetFileIndex(const unsigned int thread_id) {
+  if(thread_id >= last_input.size()) return(-1);
+  return(last_input.at(thread_id));
+}
+
+inline std::string pbam_merge_in::GetFileName(const unsigned int file_idx) {
+  if(file_idx >= inputs.size()) return("");
+  return(inputs.at(file_idx).filename);
+}
+
+inline int pbam_merge_in::obtainChrs(
+    std::vector<std::string> & s_chr_names,
+    std::vector<uint32_t> & u32_chr_lens
+) {
+  if(inputs.size() == 0) {
+    cout << "No BAM files opened\n";
+    return(-1);
+  }
+  s_chr_names = chr_names;
+  u32_chr_lens = chr_lens;
+  return((int)s_chr_names.size());
+}
+
+inline size_t pbam_merge_in::GetProgress() {
+  size_t progress = 0;
+  for(unsigned int i = 0; i < inputs.size(); i++) {
+    progress += inputs.at(i).in->GetProgress();
+  }
+  return(progress);
+}
+
+// Internals
+
+inline void pbam_merge_in::check_threads(unsigned int n_threads_to_check) {
+  #ifdef _OPENMP
+    if(n_threads_to_check > (unsigned int)omp_get_max_threads()) {
+      threads_to_use = (unsigned int)omp_get_max_threads();
+    } else {
+      threads_to_use = std::max(1u, n_threads_to_check);
+    }
+  #else
+    (void)n_threads_to_check;
+    threads_to_use = 1;
+  #endif
+}
+
+inline int pbam_merge_in::refill_inputs() {
+  while(1) {
+    std::vector<unsigned int> to_fill;
+    for(unsigned int i = 0; i < inputs.size(); i++) {
+      if(inputs.at(i).needs_fill) to_fill.push_back(i);
+    }
+    if(to_fill.size() == 0) return(0);
+
+    // Each input gets an equal share of the threads. Pipelined inputs keep
+    //   the share set by openFiles(), as their background team is running
+    const unsigned int n_fill = (unsigned int)to_fill.size();
+    if(!pipelined) {
+      for(unsigned int j = 0; j < n_fill; j++) {
+        const unsigned int fill_threads = std::max(1u, threads_to_use / n_fill +
+          (j < threads_to_use % n_fill ? 1 : 0));
+        if(inputs.at(to_fill.at(j)).in->SetThreads(fill_threads) != 0) return(-1);
+      }
+    }
+
+    std::vector<int> fill_ret(n_fill, 0);
+    #ifdef _OPENMP
+    // Each input decompresses with a nested team of its share of the threads,
+    //   which needs one more active level than the caller's
+    const int prev_levels = omp_get_max_active_levels();
+    const int need_levels = omp_get_active_level() + 2;
+    if(prev_levels < need_levels) omp_set_max_active_levels(need_levels);
+    #pragma omp parallel for num_threads(std::min(n_fill, threads_to_use)) schedule(dynamic,1)
+    #endif
+    for(unsigned int j = 0; j < n_fill; j++) {
+      fill_ret.at(j) = inputs.at(to_fill.at(j)).in->fillReads();
+    }
+    #ifdef _OPENMP
+    if(prev_levels < need_levels) omp_set_max_active_levels(prev_levels);
+    #endif
+
+    for(unsigned int j = 0; j < n_fill; j++) {
+      pbam_merge_input & input = inputs.at(to_fill.at(j));
+      if(fill_ret.at(j) == -1) {
+        cout << "Error reading " << input.filename << "\n";
+        return(-1);
+      }
+      if(fill_ret.at(j) == 1) {
+        input.needs_fill = false;
+        continue;
+      }
+      // Take all the reads of the batch, which lie back to back
+      input.cursor = 0;
+      if(input.in->supplyBatch(input.batch, input.end) != 0) return(-1);
+      if(input.cursor < input.end) {
+        input.needs_fill = false;
+        if(push_head(to_fill.at(j)) != 0) return(-1);
+      }
+    }
+  }
+}
+
+inline int pbam_merge_in::push_head(const unsigned int input_idx) {
+  pbam_merge_input & input = inputs.at(input_idx);
+  pbam_merge_head head;
+  head.key = read_key(input.batch + input.cursor);
+  head.input_idx = input_idx;
+  if(head.key < input.last_key) {
+    cout << input.filename << " is not coordinate-sorted\n";
+    return(-1);
+  }
+  input.last_key = head.key;
+  heap.push_back(head);
+  std::push_heap(heap.begin(), heap.end(), merge_later);
+  return(0);
+}
+
+#endif
@@ -0,0 +1,474 @@
+/* pbam_multi_in.hpp pbam_multi_in class (reads many BAM files together)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_multi_in
+#define _pbam_multi_in
+
+/*
+  Reads many BAM files using one thread count and one memory cap.
+
+  Each file is read by its own pbam_in, whose buffers are sized from the
+    file size (a small file does not need 500 Mb file buffers). Files are
+    opened in order, as long as the buffers of all open files fit within the
+    memory cap, and each file is closed (freeing its buffers) once read.
+
+  fillReads() fills one batch from the open files, in turn:
+  - If all open files are small (see SetSmallFileSize), up to n_threads of
+      them are filled at the same time, each by its share of the threads.
+      The reads of each file are supplied to its share of the threads.
+  - Otherwise, the next open file is filled using all threads.
+  GetFileIndex() returns the file of the reads supplied to each thread.
+*/
+
+// A BAM file read by pbam_multi_in
+struct pbam_multi_file {
+  std::string filename;
+  size_t file_size;
+  pbam_in * in;             // Opened pbam_in; NULL if not open
+  int state;                // 0 = not yet opened, 1 = open, 2 = finished
+  size_t file_buffer_cap;   // Buffer sizes of the pbam_in
+  size_t data_buffer_cap;
+  unsigned int chunks_per_file_buffer;
+  bool header_read;         // chr_names and chr_lens are stored
+  std::vector<std::string> chr_names;
+  std::vector<uint32_t> chr_lens;
+};
+
+// The reads supplied to a thread: those of thread_id of file file_idx
+struct pbam_multi_slot {
+  int file_idx;             // -1 if no reads
+  unsigned int thread_id;
+};
+
+class pbam_multi_in {
+  public:
+    /*
+      Creates a pbam_multi_in. memory_cap is the total size of the file and
+        data buffers of all open files (default 2 Gb, the same as a single
+        pbam_in with default settings)
+    */
+    pbam_multi_in(
+      const size_t memory_cap = 2e9,
+      const bool read_file_using_multiple_threads = true,
+      const unsigned int crc_check_interval = 1
+    );
+    ~pbam_multi_in();
+
+    /*
+      Declares the BAM files to read, and the number of threads to use.
+      Files are opened by fillReads() as memory allows.
+      Returns 0 if success, or -1 if any file cannot be opened
+    */
+    int openFiles(const std::vector<std::string> & filenames,
+      unsigned int n_threads, const bool use_mmap = false);
+
+    // Closes all files
+    int closeFiles();
+
+    /*
+      Fills a batch of reads from the open files. Files that are finished
+        are closed, and further files opened.
+      Returns -1 if error, and 1 once all files are read. Otherwise, returns 0
+    */
+    int fillReads();
+
+    /*
+      Returns the next read for thread_id, as pbam_in::supplyRead().
+      Reads supplied to each thread by one fillReads() come from one file
+    */
+    pbam1_t supplyRead(const unsigned int thread_id = 0);
+
+    // As supplyRead(), but returns a pbam_view (see pbam_in::supplyView())
+    pbam_view supplyView(const unsigned int thread_id = 0);
+
+    size_t remainingThreadReadsBuffer(const unsigned int thread_id = 0);
+
+    // Returns the index (in the vector given to openFiles()) of the file of
+    //   the reads supplied to thread_id by the last fillReads(); -1 if none
+    int GetFileIndex(const unsigned int thread_id = 0);
+
+    // Returns the number of files, and the name of the given file
+    size_t GetFileCount() {return(files.size());};
+    std::string GetFileName(const unsigned int file_idx);
+
+    /*
+      Returns the chromosome names and lengths of the given file. The header
+        is read if the file has not yet been opened
+      Returns the number of chromosomes, or -1 if error
+    */
+    int obtainChrs(const unsigned int file_idx,
+      std::vector<std::string> & s_chr_names,
+      std::vector<uint32_t> & u32_chr_lens
+    );
+
+    /*
+      Files smaller than this (default 64 Mb) are filled side by side, each
+        using a share of the threads. Larger files are filled using all threads
+    */
+    void SetSmallFileSize(const size_t small_file_size) {
+      small_file_bytes = small_file_size;
+    };
+
+    // Returns the total size of all files
+    size_t GetFileSize() {return(total_size);};
+
+    // Returns the number of bytes decompressed from all files
+    size_t GetProgress();
+
+    // As pbam_in::IncProgress(), over all files
+    size_t IncProgress() {
+      size_t progress = GetProgress();
+      size_t INC = progress - PROGRESS;
+      PROGRESS = progress;
+      return(INC);
+    };
+
+    int GetErrorState() {return(error_state);};
+
+  private:
+// Settings
+    size_t          MEMORY_CAP;
+    bool            multiFileRead;
+    unsigned int    crc_check_interval;
+    size_t          small_file_bytes    = 67108864;
+    unsigned int    threads_to_use      = 1;
+    bool            use_mmap            = false;
+
+// Files
+    std::vector<pbam_multi_file>  files;
+    size_t          total_size;
+    size_t          next_file;        // Next file to open
+    size_t          next_fill;        // Next file to fill (in turn)
+    size_t          memory_in_use;    // Buffers of open files
+    unsigned int    n_open;
+
+// Reads supplied to each thread by the last fillReads()
+    std::vector<pbam_multi_slot>  slots;
+
+    size_t          PROGRESS = 0;
+    int             error_state = 0;
+
+    void            check_threads(unsigned int n_threads_to_check);
+    // Sets the buffer sizes of a file from its size
+    void            plan_buffers(pbam_multi_file & file);
+    size_t          buffer_memory(const pbam_multi_file & file) {
+      return(2 * file.file_buffer_cap + file.data_buffer_cap);
+    };
+    // Opens files while their buffers fit in MEMORY_CAP. Returns 0 if success
+    int             open_files();
+    int             open_file(const size_t file_idx);
+    void            close_file(const size_t file_idx);
+
+// Disable copy construction / assignment (doing so triggers compile errors)
+    pbam_multi_in(const pbam_multi_in &t);
+    pbam_multi_in & operator = (const pbam_multi_in &t);
+};
+
+inline pbam_multi_in::pbam_multi_in(
+    const size_t memory_cap,
+    const bool read_file_using_multiple_threads,
+    const unsigned int crc_check_interval
+) {
+  // Smallest buffers of one pbam_in: 1 Mb file buffers, 2 Mb data buffer
+  MEMORY_CAP = std::max(memory_cap, (size_t)4 * 1048576);
+  multiFileRead = read_file_using_multiple_threads;
+  this->crc_check_interval = crc_check_interval;
+  total_size = 0; next_file = 0; next_fill = 0;
+  memory_in_use = 0; n_open = 0;
+}
+
+inline pbam_multi_in::~pbam_multi_in() {
+  closeFiles();
+}
+
+inline int pbam_multi_in::openFiles(const std::vector<std::string> & filenames,
+    unsigned int n_threads, const bool use_mmap) {
+  closeFiles();
+  check_threads(n_threads);
+  this->use_mmap = use_mmap;
+
+  pbam_multi_file file;
+  file.in = NULL; file.state = 0; file.header_read = false;
+  for(unsigned int i = 0; i < filenames.size(); i++) {
+    std::ifstream IN(filenames.at(i), std::ios::in | std::ifstream::binary);
+    if(IN.fail()) {
+      cout << "Failed to open " << filenames.at(i) << "\n";
+      closeFiles();
+      return(-1);
+    }
+    IN.seekg(0, std::ios_base::end);
+    file.filename = filenames.at(i);
+    file.file_size = (size_t)IN.tellg();
+    IN.close();
+    plan_buffers(file);
+    files.push_back(file);
+    total_size += file.file_size;
+  }
+  return(0);
+}
+
+inline int pbam_multi_in::closeFiles() {
+  for(unsigned int i = 0; i < files.size(); i++) {
+    if(files.at(i).in) delete files.at(i).in;
+  }
+  files.clear();
+  slots.clear();
+  total_size = 0; next_file = 0; next_fill = 0;
+  memory_in_use = 0; n_open = 0;
+  PROGRESS = 0; error_state = 0;
+  return(0);
+}
+
+inline int pbam_multi_in::fillReads() {
+  if(files.size() == 0) {
+    cout << "No BAM files opened\n";
+    error_state = -1;
+    return(-1);
+  }
+  // Check if previous reads are all read:
+  for(unsigned int i = 0; i < slots.size(); i++) {
+    if(remainingThreadReadsBuffer(i) > 0) {
+      cout << "Thread " << i << " has reads remaining. Please debug your code "
+        << "and make sure all threads clear their reads before filling any more reads\n";
+      error_state = -1;
+      return(-1);
+    }
+  }
+  pbam_multi_slot empty_slot = {-1, 0};
+  slots.assign(threads_to_use, empty_slot);
+
+  while(1) {
+    if(open_files() != 0) {
+      error_state = -1;
+      return(-1);
+    }
+    // Open files, in turn from next_fill
+    std::vector<size_t> batch;
+    bool all_small = true;
+    for(size_t k = 0; k < files.size(); k++) {
+      const size_t i = (next_fill + k) % files.size();
+      if(files.at(i).state != 1) continue;
+      batch.push_back(i);
+      if(files.at(i).file_size >= small_file_bytes) all_small = false;
+    }
+    if(batch.size() == 0) return(1);
+    if(!all_small) batch.resize(1);
+    if(batch.size() > threads_to_use) batch.resize(threads_to_use);
+    next_fill = batch.back() + 1;
+
+    // Each file gets an equal share of the threads
+    const unsigned int n_batch = (unsigned int)batch.size();
+    std::vector<unsigned int> batch_threads(n_batch);
+    for(unsigned int j = 0; j < n_batch; j++) {
+      batch_threads.at(j) = threads_to_use / n_batch +
+        (j < threads_to_use % n_batch ? 1 : 0);
+      if(files.at(batch.at(j)).in->SetThreads(batch_threads.at(j)) != 0) {
+        error_state = -1;
+        return(-1);
+      }
+    }
+
+    std::vector<int> batch_ret(n_batch, 0);
+    #ifdef _OPENMP
+    // Each file decompresses with a nested team of its share of the threads,
+    //   which needs one more active level than the caller's
+    const int prev_levels = omp_get_max_active_levels();
+    const int need_levels = omp_get_active_level() + 2;
+    if(prev_levels < need_levels) omp_set_max_active_levels(need_levels);
+    #pragma omp parallel for num_threads(n_batch) schedule(dynamic,1)
+    #endif
+    for(unsigned int j = 0; j < n_batch; j++) {
+      batch_ret.at(j) = files.at(batch.at(j)).in->fillReads();
+    }
+    #ifdef _OPENMP
+    if(prev_levels < need_levels) omp_set_max_active_levels(prev_levels);
+    #endif
+
+    bool has_reads = false;
+    unsigned int slot_cursor = 0;
+    for(unsigned int j = 0; j < n_batch; j++) {
+      const size_t i = batch.at(j);
+      if(batch_ret.at(j) == -1) {
+        cout << "Error reading " << files.at(i).filename << "\n";
+        error_state = -1;
+        return(-1);
+      }
+      if(batch_ret.at(j) == 1) {
+        close_file(i);
+      } else {
+        has_reads = true;
+        for(unsigned int t = 0; t < batch_threads.at(j); t++) {
+          slots.at(slot_cursor + t).file_idx = (int)i;
+          slots.at(slot_cursor + t).thread_id = t;
+        }
+      }
+      slot_cursor += batch_threads.at(j);
+    }
+    if(has_reads) return(0);
+  }
+}
+
+inline pbam1_t pbam_multi_in::supplyRead(const unsigned int thread_id) {
+  if(thread_id >= slots.size()) {
+    cout << "Invalid thread number parsed to supplyRead()\n";
+    return(pbam1_t());
+  }
+  const pbam_multi_slot & slot = slots.at(thread_id);
+  if(slot.file_idx < 0) return(pbam1_t());
+  return(files.at(slot.file_idx).in->supplyRead(slot.thread_id));
+}
+
+inline pbam_view pbam_multi_in::supplyView(const unsigned int thread_id) {
+  if(thread_id >= slots.size()) {
+    cout << "Invalid thread number parsed to supplyView()\n";
+    return(pbam_view());
+  }
+  const pbam_multi_slot & slot = slots.at(thread_id);
+  if(slot.file_idx < 0) return(pbam_view());
+  return(files.at(slot.file_idx).in->supplyView(slot.thread_id));
+}
+
+inline size_t pbam_multi_in::remainingThreadReadsBuffer(
+    const unsigned int thread_id) {
+  if(thread_id >= slots.size()) return(0);
+  const pbam_multi_slot & slot = slots.at(thread_id);
+  if(slot.file_idx < 0) return(0);
+  return(files.at(slot.file_idx).in->remainingThreadReadsBuffer(slot.thread_id));
+}
+
+inline int pbam_multi_in::GetFileIndex(const unsigned int thread_id) {
+  if(thread_id >= slots.size()) return(-1);
+  return(slots.at(thread_id).file_idx);
+}
+
+inline std::string pbam_multi_in::GetFileName(const unsigned int file_idx) {
+  if(file_idx >= files.size()) return("");
+  return(files.at(file_idx).filename);
+}
+
+inline int pbam_multi_in::obtainChrs(const unsigned int file_idx,
+    std::vector<std::string> & s_chr_names,
+    std::vector<uint32_t> & u32_chr_lens
+) {
+  if(file_idx >= files.size()) {
+    cout << "File " << file_idx << " was not given to openFiles()\n";
+    return(-1);
+  }
+  pbam_multi_file & file = files.at(file_idx);
+  if(!file.header_read) {
+    pbam_in inbam(file.file_buffer_cap, file.data_buffer_cap,
+      file.chunks_per_file_buffer, multiFileRead, crc_check_interval);
+    if(inbam.openFile(file.filename, 1) != 0) return(-1);
+    if(inbam.obtainChrs(file.chr_names, file.chr_lens) < 0) return(-1);
+    file.header_read = true;
+  }
+  s_chr_names = file.chr_names;
+  u32_chr_lens = file.chr_lens;
+  return((int)s_chr_names.size());
+}
+
+inline size_t pbam_multi_in::GetProgress() {
+  size_t progress = 0;
+  for(unsigned int i = 0; i < files.size(); i++) {
+    if(files.at(i).state == 2) {
+      progress += files.at(i).file_size;
+    } else if(files.at(i).in) {
+      progress += files.at(i).in->GetProgress();
+    }
+  }
+  return(progress);
+}
+
+// Internals
+
+inline void pbam_multi_in::check_threads(unsigned int n_threads_to_check) {
+  #ifdef _OPENMP
+    if(n_threads_to_check > (unsigned int)omp_get_max_threads()) {
+      threads_to_use = (unsigned int)omp_get_max_threads();
+    } else {
+      threads_to_use = std::max(1u, n_threads_to_check);
+    }
+  #else
+    (void)n_threads_to_check;
+    threads_to_use = 1;
+  #endif
+}
+
+/*
+  Sizes the buffers as pbam_in's defaults: a data buffer twice the size of
+    each of 2 file buffers. A file buffer holds the whole file if possible,
+    and is at most 500 Mb, or a quarter of the memory cap
+*/
+inline void pbam_multi_in::plan_buffers(pbam_multi_file & file) {
+  const size_t min_cap = 1048576;
+  const size_t max_cap = std::max(min_cap, std::min((size_t)5e8, MEMORY_CAP / 4));
+  file.file_buffer_cap = std::max(min_cap,
+    std::min(max_cap, file.file_size + bgzfMaxBlockLength));
+  // Files larger than 5 chunks of 8 Mb are read in chunks, as pbam_in does
+  file.chunks_per_file_buffer = file.file_buffer_cap >= 5 * 8 * min_cap ? 5 : 1;
+  // The data buffer must also hold the largest read
+  file.data_buffer_cap = std::max(2 * file.file_buffer_cap,
+    std::min(16 * min_cap, MEMORY_CAP / 2));
+}
+
+inline int pbam_multi_in::open_files() {
+  while(next_file < files.size() && n_open < threads_to_use) {
+    pbam_multi_file & file = files.at(next_file);
+    if(n_open > 0 && memory_in_use + buffer_memory(file) > MEMORY_CAP) break;
+    if(open_file(next_file) != 0) return(-1);
+    next_file++;
+  }
+  return(0);
+}
+
+inline int pbam_multi_in::open_file(const size_t file_idx) {
+  pbam_multi_file & file = files.at(file_idx);
+  file.in = new pbam_in(file.file_buffer_cap, file.data_buffer_cap,
+    file.chunks_per_file_buffer, multiFileRead, crc_check_interval);
+  if(file.in->openFile(file.filename, threads_to_use, use_mmap) != 0) {
+    cout << "Failed to open " << file.filename << "\n";
+    delete file.in;
+    file.in = NULL;
+    return(-1);
+  }
+  if(!file.header_read) {
+    file.in->obtainChrs(file.chr_names, file.chr_lens);
+    file.header_read = true;
+  }
+  file.state = 1;
+  memory_in_use += buffer_memory(file);
+  n_open++;
+  return(0);
+}
+
+inline void pbam_multi_in::close_file(const size_t file_idx) {
+  pbam_multi_file & file = files.at(file_idx);
+  if(file.in) delete file.in;
+  file.in = NULL;
+  if(file.state == 1) {
+    memory_in_use -= buffer_memory(file);
+    n_open--;
+  }
+  file.state = 2;
+}
+
+#endif
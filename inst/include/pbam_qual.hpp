@@ -0,0 +1,370 @@
+/* pbam_qual.hpp Base quality kernels and pbam_qual_qc (quality statistics)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_qual
+#define _pbam_qual
+
+/*
+  Kernels over the base qualities of a read, read directly from the read's
+    buffer (e.g. pbam1_t::qual() or pbam_view::qual()), without copying.
+  Qualities are Phred scores without the +33 ASCII offset. Reads without
+    qualities have all qualities set to 0xFF; kernels treat these as reads of
+    no bases.
+
+  pbam_qual_summary() uses SSE2 or AVX2 (detected at run time) on x86 CPUs:
+    sums of 16 or 32 qualities at a time by sum of absolute differences, and
+    minimum, maximum and bases below the threshold by byte-wise comparisons.
+    Define OMPBAM_NO_SIMD to always use the scalar loop.
+*/
+
+// Summary of the base qualities of one read
+struct pbam_qual_stats{
+  uint32_t n_bases = 0;     // 0 if the read has no qualities
+  uint64_t sum = 0;
+  uint8_t min = 0;
+  uint8_t max = 0;
+  uint32_t n_below = 0;     // Number of bases with quality below threshold
+
+  double mean() const {return(n_bases > 0 ? (double)sum / n_bases : 0);};
+};
+
+inline bool pbam_qual_missing(const uint8_t * qual, const uint32_t l_seq) {
+  return(l_seq == 0 || qual[0] == 0xFF);
+}
+
+#ifdef OMPBAM_X86_SIMD
+
+inline bool pbam_cpu_has_sse2() {
+  static const bool has_sse2 = __builtin_cpu_supports("sse2");
+  return(has_sse2);
+}
+
+// Adds the minimum, maximum and sums held in vectors to stats
+__attribute__((target("sse2")))
+inline void pbam_qual_reduce_sse2(__m128i v_min, __m128i v_max, 
+    const __m128i v_sum, const __m128i v_below, pbam_qual_stats & stats) {
+  v_min = _mm_min_epu8(v_min, _mm_srli_si128(v_min, 8));
+  v_min = _mm_min_epu8(v_min, _mm_srli_si128(v_min, 4));
+  v_min = _mm_min_epu8(v_min, _mm_srli_si128(v_min, 2));
+  v_min = _mm_min_epu8(v_min, _mm_srli_si128(v_min, 1));
+  v_max = _mm_max_epu8(v_max, _mm_srli_si128(v_max, 8));
+  v_max = _mm_max_epu8(v_max, _mm_srli_si128(v_max, 4));
+  v_max = _mm_max_epu8(v_max, _mm_srli_si128(v_max, 2));
+  v_max = _mm_max_epu8(v_max, _mm_srli_si128(v_max, 1));
+  const uint8_t q_min = (uint8_t)_mm_cvtsi128_si32(v_min);
+  const uint8_t q_max = (uint8_t)_mm_cvtsi128_si32(v_max);
+  if(q_min < stats.min) stats.min = q_min;
+  if(q_max > stats.max) stats.max = q_max;
+
+  // Each 64-bit half holds a partial sum
+  uint64_t sums[2]; uint64_t belows[2];
+  _mm_storeu_si128((__m128i *)sums, v_sum);
+  _mm_storeu_si128((__m128i *)belows, v_below);
+  stats.sum += sums[0] + sums[1];
+  stats.n_below += (uint32_t)(belows[0] + belows[1]);
+}
+
+// Adds the first l_seq qualities (rounded down to a multiple of 16) to stats.
+//   Returns the number of qualities added
+__attribute__((target("sse2")))
+inline size_t pbam_qual_summary_sse2(const uint8_t * qual, const size_t l_seq,
+    const uint8_t threshold, pbam_qual_stats & stats) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i thres = _mm_set1_epi8((char)threshold);
+  __m128i v_min = _mm_set1_epi8((char)0xFF);
+  __m128i v_max = zero;
+  __m128i v_sum = zero;
+  __m128i v_below = zero;
+  size_t i = 0;
+  for(; i + 16 <= l_seq; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(qual + i));
+    v_min = _mm_min_epu8(v_min, v);
+    v_max = _mm_max_epu8(v_max, v);
+    v_sum = _mm_add_epi64(v_sum, _mm_sad_epu8(v, zero));
+    // v >= threshold where max(v, threshold) == v
+    __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(v, thres), v);
+    v_below = _mm_add_epi64(v_below, 
+      _mm_sad_epu8(_mm_andnot_si128(above, one), zero));
+  }
+  if(i > 0) pbam_qual_reduce_sse2(v_min, v_max, v_sum, v_below, stats);
+  return(i);
+}
+
+// As pbam_qual_summary_sse2(), for multiples of 32 qualities
+__attribute__((target("avx2")))
+inline size_t pbam_qual_summary_avx2(const uint8_t * qual, const size_t l_seq,
+    const uint8_t threshold, pbam_qual_stats & stats) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  const __m256i thres = _mm256_set1_epi8((char)threshold);
+  __m256i v_min = _mm256_set1_epi8((char)0xFF);
+  __m256i v_max = zero;
+  __m256i v_sum = zero;
+  __m256i v_below = zero;
+  size_t i = 0;
+  for(; i + 32 <= l_seq; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(qual + i));
+    v_min = _mm256_min_epu8(v_min, v);
+    v_max = _mm256_max_epu8(v_max, v);
+    v_sum = _mm256_add_epi64(v_sum, _mm256_sad_epu8(v, zero));
+    __m256i above = _mm256_cmpeq_epi8(_mm256_max_epu8(v, thres), v);
+    v_below = _mm256_add_epi64(v_below, 
+      _mm256_sad_epu8(_mm256_andnot_si256(above, one), zero));
+  }
+  // Fold the upper 128-bit lane onto the lower one
+  if(i > 0) pbam_qual_reduce_sse2(
+    _mm_min_epu8(_mm256_castsi256_si128(v_min), 
+      _mm256_extracti128_si256(v_min, 1)),
+    _mm_max_epu8(_mm256_castsi256_si128(v_max), 
+      _mm256_extracti128_si256(v_max, 1)),
+    _mm_add_epi64(_mm256_castsi256_si128(v_sum), 
+      _mm256_extracti128_si256(v_sum, 1)),
+    _mm_add_epi64(_mm256_castsi256_si128(v_below), 
+      _mm256_extracti128_si256(v_below, 1)),
+    stats);
+  return(i);
+}
+
+#endif
+
+// Fills stats with the number of bases, sum, minimum and maximum of the
+//   qualities, and the number of bases with quality below threshold
+inline void pbam_qual_summary(const uint8_t * qual, const uint32_t l_seq,
+    const uint8_t threshold, pbam_qual_stats & stats) {
+  stats = pbam_qual_stats();
+  if(pbam_qual_missing(qual, l_seq)) return;
+  stats.n_bases = l_seq;
+  stats.min = 0xFF;
+  size_t i = 0;
+  #ifdef OMPBAM_X86_SIMD
+  if(l_seq >= 32 && pbam_cpu_has_avx2()) {
+    i = pbam_qual_summary_avx2(qual, l_seq, threshold, stats);
+  }
+  if(l_seq - i >= 16 && pbam_cpu_has_sse2()) {
+    i += pbam_qual_summary_sse2(qual + i, l_seq - i, threshold, stats);
+  }
+  #endif
+  for(; i < l_seq; i++) {
+    const uint8_t q = qual[i];
+    stats.sum += q;
+    if(q < stats.min) stats.min = q;
+    if(q > stats.max) stats.max = q;
+    if(q < threshold) stats.n_below++;
+  }
+}
+
+// Error probability of each quality, 10 ^ (-q / 10)
+struct pbam_qual_error_table{
+  double prob[256];
+  pbam_qual_error_table() {
+    for(unsigned int q = 0; q < 256; q++) prob[q] = pow(10.0, -(double)q / 10.0);
+  };
+};
+
+inline const double * pbam_qual_error_probs() {
+  static const pbam_qual_error_table table;
+  return(table.prob);
+}
+
+// Returns the expected number of errors in the read (the sum of the error
+//   probabilities of its bases)
+inline double pbam_qual_expected_errors(const uint8_t * qual, 
+    const uint32_t l_seq) {
+  if(pbam_qual_missing(qual, l_seq)) return(0);
+  const double * prob = pbam_qual_error_probs();
+  // Independent sums, so that additions are not serialized
+  double sum[4] = {0, 0, 0, 0};
+  uint32_t i = 0;
+  for(; i + 4 <= l_seq; i += 4) {
+    sum[0] += prob[qual[i]];
+    sum[1] += prob[qual[i + 1]];
+    sum[2] += prob[qual[i + 2]];
+    sum[3] += prob[qual[i + 3]];
+  }
+  for(; i < l_seq; i++) sum[0] += prob[qual[i]];
+  return((sum[0] + sum[1]) + (sum[2] + sum[3]));
+}
+
+/*
+  Sliding-window trimming: scans windows of window_size bases from the start
+    of the read, and returns the start of the first window whose mean
+    quality is below threshold (i.e. the number of bases to keep).
+  Returns l_seq if no window is below threshold, or if the read has no
+    qualities. Reads shorter than window_size are treated as one window
+*/
+inline uint32_t pbam_qual_trim_pos(const uint8_t * qual, const uint32_t l_seq,
+    const uint32_t window_size, const uint8_t threshold) {
+  if(pbam_qual_missing(qual, l_seq) || window_size == 0) return(l_seq);
+  const uint32_t window = window_size < l_seq ? window_size : l_seq;
+  // Compare window sums, to avoid division
+  const uint64_t min_sum = (uint64_t)threshold * window;
+  uint64_t sum = 0;
+  for(uint32_t i = 0; i < window; i++) sum += qual[i];
+  if(sum < min_sum) return(0);
+  for(uint32_t i = window; i < l_seq; i++) {
+    sum += qual[i];
+    sum -= qual[i - window];
+    if(sum < min_sum) return(i - window + 1);
+  }
+  return(l_seq);
+}
+
+// Adds the qualities of a read to hist, a histogram of 256 bins
+inline void pbam_qual_histogram(const uint8_t * qual, const uint32_t l_seq,
+    uint64_t * hist) {
+  if(pbam_qual_missing(qual, l_seq)) return;
+  for(uint32_t i = 0; i < l_seq; i++) hist[qual[i]]++;
+}
+
+/*
+  Accumulates base quality statistics over many reads. Use one pbam_qual_qc
+    per thread, and merge() them once all reads are added.
+  All statistics are derived from a histogram of qualities, kept as 4
+    interleaved histograms so that runs of the same quality do not wait on
+    one counter.
+*/
+class pbam_qual_qc {
+  public:
+    pbam_qual_qc() {clear();};
+
+    // Adds the base qualities of a read. Reads without qualities are counted
+    //   by reads_missing() only
+    void add(const uint8_t * qual, const uint32_t l_seq);
+    void add(pbam1_t & read);
+    void add(const pbam_view & view);
+
+    // Adds the statistics of another pbam_qual_qc (e.g. of another thread)
+    void merge(const pbam_qual_qc & other);
+
+    void clear();
+
+    uint64_t reads() const {return(n_reads);};
+    uint64_t reads_missing() const {return(n_reads_missing);};
+    uint64_t bases() const;
+    double mean() const;
+    uint8_t min() const;    // 0 if no bases
+    uint8_t max() const;
+    uint64_t n_below(const uint8_t threshold) const;
+    double expected_errors() const;
+
+    // Fills dest with the number of bases of each quality (256 bins)
+    void histogram(std::vector<uint64_t> & dest) const;
+
+  private:
+    uint64_t hist[4][256];
+    uint64_t n_reads;
+    uint64_t n_reads_missing;
+    
+    uint64_t count(const unsigned int q) const {
+      return(hist[0][q] + hist[1][q] + hist[2][q] + hist[3][q]);
+    };
+};
+
+inline void pbam_qual_qc::add(const uint8_t * qual, const uint32_t l_seq) {
+  if(pbam_qual_missing(qual, l_seq)) {
+    n_reads_missing++;
+    return;
+  }
+  n_reads++;
+  uint32_t i = 0;
+  for(; i + 4 <= l_seq; i += 4) {
+    hist[0][qual[i]]++;
+    hist[1][qual[i + 1]]++;
+    hist[2][qual[i + 2]]++;
+    hist[3][qual[i + 3]]++;
+  }
+  for(; i < l_seq; i++) hist[0][qual[i]]++;
+}
+
+inline void pbam_qual_qc::add(pbam1_t & read) {
+  if(!read.validate()) return;
+  add((const uint8_t *)read.qual(), read.l_seq());
+}
+
+inline void pbam_qual_qc::add(const pbam_view & view) {
+  if(!view.valid()) return;
+  add((const uint8_t *)view.qual(), view.l_seq());
+}
+
+inline void pbam_qual_qc::merge(const pbam_qual_qc & other) {
+  for(unsigned int k = 0; k < 4; k++) {
+    for(unsigned int q = 0; q < 256; q++) hist[k][q] += other.hist[k][q];
+  }
+  n_reads += other.n_reads;
+  n_reads_missing += other.n_reads_missing;
+}
+
+inline void pbam_qual_qc::clear() {
+  memset(hist, 0, sizeof(hist));
+  n_reads = 0;
+  n_reads_missing = 0;
+}
+
+inline uint64_t pbam_qual_qc::bases() const {
+  uint64_t n = 0;
+  for(unsigned int q = 0; q < 256; q++) n += count(q);
+  return(n);
+}
+
+inline double pbam_qual_qc::mean() const {
+  uint64_t n = 0; uint64_t sum = 0;
+  for(unsigned int q = 0; q < 256; q++) {
+    n += count(q);
+    sum += (uint64_t)q * count(q);
+  }
+  return(n > 0 ? (double)sum / n : 0);
+}
+
+inline uint8_t pbam_qual_qc::min() const {
+  for(unsigned int q = 0; q < 256; q++) {
+    if(count(q) > 0) return((uint8_t)q);
+  }
+  return(0);
+}
+
+inline uint8_t pbam_qual_qc::max() const {
+  for(unsigned int q = 256; q > 0; q--) {
+    if(count(q - 1) > 0) return((uint8_t)(q - 1));
+  }
+  return(0);
+}
+
+inline uint64_t pbam_qual_qc::n_below(const uint8_t threshold) const {
+  uint64_t n = 0;
+  for(unsigned int q = 0; q < threshold; q++) n += count(q);
+  return(n);
+}
+
+inline double pbam_qual_qc::expected_errors() const {
+  const double * prob = pbam_qual_error_probs();
+  double sum = 0;
+  for(unsigned int q = 0; q < 256; q++) sum += prob[q] * count(q);
+  return(sum);
+}
+
+inline void pbam_qual_qc::histogram(std::vector<uint64_t> & dest) const {
+  dest.resize(256);
+  for(unsigned int q = 0; q < 256; q++) dest.at(q) = count(q);
+}
+
+#endif
@@ -0,0 +1,196 @@
+/* pbam_seq.hpp Sequence decoding kernels (4-bit packed bases to characters)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_seq
+#define _pbam_seq
+
+/*
+  pbam_seq_decode() decodes a BAM sequence of l_seq bases, packed two per
+    byte, to l_seq characters. pbam_seq_revcomp() decodes its reverse
+    complement in the same pass.
+
+  On x86 CPUs supporting AVX2 or SSSE3 (detected at run time), 32 or 16 bytes
+    (64 or 32 bases) are decoded at a time, using a byte shuffle as a lookup
+    table of the 16 base codes. Otherwise, or for the tail, bases are looked
+    up one at a time. Define OMPBAM_NO_SIMD to always use the scalar lookup.
+  
+  The complement of a base code is its 4 bits reversed (A = 1 <-> T = 8,
+    C = 2 <-> G = 4, and so on for ambiguity codes), so the complement table
+    lists the base of each reversed code.
+*/
+
+static const char pbamSeqChars[17] = "=ACMGRSVTWYHKDBN";
+static const char pbamSeqCompChars[17] = "=TGKCYSBAWRDMHVN";
+
+#ifdef OMPBAM_X86_SIMD
+
+inline bool pbam_cpu_has_ssse3() {
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  return(has_ssse3);
+}
+
+inline bool pbam_cpu_has_avx2() {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return(has_avx2);
+}
+
+// Decodes the first n_bytes of seq (rounded down to a multiple of 16) to
+//   dest. Returns the number of bytes decoded
+__attribute__((target("ssse3")))
+inline size_t pbam_seq_decode_ssse3(const uint8_t * seq, const size_t n_bytes,
+    char * dest) {
+  const __m128i table = _mm_loadu_si128((const __m128i *)pbamSeqChars);
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  size_t i = 0;
+  for(; i + 16 <= n_bytes; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(seq + i));
+    __m128i hi = _mm_shuffle_epi8(table, 
+      _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(v, mask));
+    // The first base of each byte is in its high nibble
+    _mm_storeu_si128((__m128i *)(dest + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dest + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return(i);
+}
+
+// Decodes the reverse complement of the last n_bytes of seq (rounded down to
+//   a multiple of 16) to dest. Returns the number of bytes decoded
+__attribute__((target("ssse3")))
+inline size_t pbam_seq_revcomp_ssse3(const uint8_t * seq, const size_t n_bytes,
+    char * dest) {
+  const __m128i table = _mm_loadu_si128((const __m128i *)pbamSeqCompChars);
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  const __m128i reverse = _mm_set_epi8(
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t i = 0;
+  for(; i + 16 <= n_bytes; i += 16) {
+    __m128i v = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)(seq + n_bytes - i - 16)), reverse);
+    __m128i hi = _mm_shuffle_epi8(table, 
+      _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(v, mask));
+    // Reversed, the second base of each byte comes first
+    _mm_storeu_si128((__m128i *)(dest + 2 * i), _mm_unpacklo_epi8(lo, hi));
+    _mm_storeu_si128((__m128i *)(dest + 2 * i + 16), _mm_unpackhi_epi8(lo, hi));
+  }
+  return(i);
+}
+
+// As pbam_seq_decode_ssse3(), for multiples of 32 bytes
+__attribute__((target("avx2")))
+inline size_t pbam_seq_decode_avx2(const uint8_t * seq, const size_t n_bytes,
+    char * dest) {
+  const __m256i table = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i *)pbamSeqChars));
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+  for(; i + 32 <= n_bytes; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(seq + i));
+    __m256i hi = _mm256_shuffle_epi8(table, 
+      _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, mask));
+    // Unpacks work within each 128-bit lane; permute the lanes back in order
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(dest + 2 * i), 
+      _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + 2 * i + 32), 
+      _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return(i);
+}
+
+// As pbam_seq_revcomp_ssse3(), for multiples of 32 bytes
+__attribute__((target("avx2")))
+inline size_t pbam_seq_revcomp_avx2(const uint8_t * seq, const size_t n_bytes,
+    char * dest) {
+  const __m256i table = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i *)pbamSeqCompChars));
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+  const __m256i reverse = _mm256_set_epi8(
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  size_t i = 0;
+  for(; i + 32 <= n_bytes; i += 32) {
+    // Reverse the bytes within each lane, then swap the lanes
+    __m256i v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(
+      _mm256_loadu_si256((const __m256i *)(seq + n_bytes - i - 32)), reverse),
+      0x4E);
+    __m256i hi = _mm256_shuffle_epi8(table, 
+      _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, mask));
+    __m256i a = _mm256_unpacklo_epi8(lo, hi);
+    __m256i b = _mm256_unpackhi_epi8(lo, hi);
+    _mm256_storeu_si256((__m256i *)(dest + 2 * i), 
+      _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + 2 * i + 32), 
+      _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return(i);
+}
+
+#endif
+
+// Writes l_seq characters to dest (no terminating '\0')
+inline void pbam_seq_decode(const uint8_t * seq, const uint32_t l_seq, 
+    char * dest) {
+  const size_t n_bytes = l_seq / 2;   // Bytes holding two bases
+  size_t i = 0;
+  #ifdef OMPBAM_X86_SIMD
+  if(n_bytes >= 32 && pbam_cpu_has_avx2()) {
+    i = pbam_seq_decode_avx2(seq, n_bytes, dest);
+  }
+  if(n_bytes - i >= 16 && pbam_cpu_has_ssse3()) {
+    i += pbam_seq_decode_ssse3(seq + i, n_bytes - i, dest + 2 * i);
+  }
+  #endif
+  for(; i < n_bytes; i++) {
+    dest[2 * i] = pbamSeqChars[seq[i] >> 4];
+    dest[2 * i + 1] = pbamSeqChars[seq[i] & 0x0F];
+  }
+  if(l_seq & 1) dest[l_seq - 1] = pbamSeqChars[seq[n_bytes] >> 4];
+}
+
+// Writes the l_seq characters of the reverse complement to dest
+inline void pbam_seq_revcomp(const uint8_t * seq, const uint32_t l_seq, 
+    char * dest) {
+  const size_t n_bytes = l_seq / 2;
+  // The last base of an odd-length sequence is alone in the last byte
+  if(l_seq & 1) *dest++ = pbamSeqCompChars[seq[n_bytes] >> 4];
+  size_t i = 0;
+  #ifdef OMPBAM_X86_SIMD
+  if(n_bytes >= 32 && pbam_cpu_has_avx2()) {
+    i = pbam_seq_revcomp_avx2(seq, n_bytes, dest);
+  }
+  if(n_bytes - i >= 16 && pbam_cpu_has_ssse3()) {
+    i += pbam_seq_revcomp_ssse3(seq, n_bytes - i, dest + 2 * i);
+  }
+  #endif
+  for(; i < n_bytes; i++) {
+    const uint8_t byte = seq[n_bytes - i - 1];
+    dest[2 * i] = pbamSeqCompChars[byte & 0x0F];
+    dest[2 * i + 1] = pbamSeqCompChars[byte >> 4];
+  }
+}
+
+#endif
@@ -0,0 +1,160 @@
+/* pbam_view.hpp pbam_view class (unchecked view of a read)
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_view
+#define _pbam_view
+
+/*
+  A read-only view of a read in a data buffer, for tight loops over reads.
+  The read is checked once, when the view is made, and the positions of its
+    read name, cigar, sequence, qualities and tags are stored. Getters then
+    read the buffer directly, without validating the read on every call as
+    pbam1_t does.
+  
+  A pbam_view is trivially copyable, and never owns its buffer. Like a
+    pbam1_t that is not realized, it is valid only until the next call to
+    fillReads(). To keep a read, convert it with toRead(true).
+*/
+class pbam_view {
+  public:
+    // An empty (invalid) view
+    pbam_view() {};
+
+    // Views the read at src, or is empty if the read's lengths do not fit
+    //   its block size
+    explicit pbam_view(const char * src);
+
+    // Views the buffer of a (valid) pbam1_t. The view is valid while the
+    //   pbam1_t and its buffer exist
+    explicit pbam_view(const pbam1_t & read);
+
+    // Returns false for empty views
+    bool valid() const {return(read_buffer != NULL);};
+
+    // Returns a pbam1_t of the read; if realize is true, it is copied to its
+    //   own buffer
+    pbam1_t toRead(const bool realize = false) const;
+
+    // ******************************* Getters ********************************
+    // Do not call these on empty views
+    
+    uint32_t block_size() const {return(block_size_val);};
+
+    // Core:
+    int32_t refID() const {return(core()->refID);};
+    int32_t pos() const {return(core()->pos);};
+    uint8_t l_read_name() const {return(core()->l_read_name);};
+    uint8_t mapq() const {return(core()->mapq);};
+    uint16_t bin() const {return(core()->bin);};
+    uint16_t n_cigar_op() const {return(core()->n_cigar_op);};
+    uint32_t flag() const {return(core()->flag);};
+    uint32_t l_seq() const {return(core()->l_seq);};
+    int32_t next_refID() const {return(core()->next_refID);};
+    int32_t next_pos() const {return(core()->next_pos);};
+    int32_t tlen() const {return(core()->tlen);};
+
+    // Direct pointers to variable-length data, as for pbam1_t. Unlike
+    //   pbam1_t::cigar(), cigar() is always the n_cigar_op() operations
+    //   stored in the record, including the kSmN placeholder of long reads
+    //   whose cigar is held in a "CG" tag (see cigar_geometry())
+    const char * record() const {return(read_buffer);};
+    const char * read_name() const {return(read_buffer + 36);};
+    const uint32_t * cigar() const {
+      return((const uint32_t *)(read_buffer + cigar_offset));
+    };
+    const uint8_t * seq() const {
+      return((const uint8_t *)(read_buffer + seq_offset));
+    };
+    const char * qual() const {return(read_buffer + qual_offset);};
+
+    // Write the sequence, or its reverse complement, to a buffer of at least
+    //   l_seq() chars (not terminated by '\0')
+    void seq(char * dest) const {pbam_seq_decode(seq(), l_seq(), dest);};
+    void seq_revcomp(char * dest) const {
+      pbam_seq_revcomp(seq(), l_seq(), dest);
+    };
+    
+    // Fills geom as pbam1_t::cigar_geometry(); returns the number of
+    //   cigar operations
+    int cigar_geometry(pbam_cigar_geometry & geom) const;
+    
+    // Raw tag data, of tag_size() bytes
+    const char * tags() const {return(read_buffer + tag_offset);};
+    uint32_t tag_size() const {return(block_size_val + 4 - tag_offset);};
+    
+  private:
+    const pbam_core_32 * core() const {
+      return((const pbam_core_32 *)(read_buffer + 4));
+    };
+
+    // Offsets are from the start of read_buffer (its block_size)
+    const char * read_buffer = NULL;
+    uint32_t block_size_val = 0;
+    uint32_t cigar_offset = 0;
+    uint32_t seq_offset = 0;
+    uint32_t qual_offset = 0;
+    uint32_t tag_offset = 0;
+};
+
+inline pbam_view::pbam_view(const char * src) {
+  if(!src) return;
+  const uint32_t block_size = *(const uint32_t *)src;
+  const pbam_core_32 * src_core = (const pbam_core_32 *)(src + 4);
+  if(block_size < 32) return;
+  const uint64_t tag_start = 36 + (uint64_t)src_core->l_read_name + 
+    src_core->n_cigar_op * 4 + 
+    ((uint64_t)src_core->l_seq + 1) / 2 + src_core->l_seq;
+  if(tag_start > (uint64_t)block_size + 4) return;
+
+  read_buffer = src;
+  block_size_val = block_size;
+  cigar_offset = 36 + src_core->l_read_name;
+  seq_offset = cigar_offset + src_core->n_cigar_op * 4;
+  qual_offset = seq_offset + (src_core->l_seq + 1) / 2;
+  tag_offset = (uint32_t)tag_start;
+}
+
+inline pbam_view::pbam_view(const pbam1_t & read) {
+  if(read.validate()) *this = pbam_view(read.read_buffer);
+}
+
+inline pbam1_t pbam_view::toRead(const bool realize) const {
+  if(!read_buffer) return(pbam1_t());
+  return(pbam1_t((char *)read_buffer, realize));
+}
+
+inline int pbam_view::cigar_geometry(pbam_cigar_geometry & geom) const {
+  const uint32_t * ops = cigar();
+  // Long reads with a placeholder cigar (kSmN) may hold the cigar in a tag
+  if(n_cigar_op() == 2 && (ops[0] & 15) == 4 && (ops[1] & 15) == 3 &&
+      ops[0] >> 4 == l_seq()) {
+    pbam1_t read = toRead();
+    return(read.cigar_geometry(geom));
+  }
+  geom.build(ops, n_cigar_op(), pos());
+  return(n_cigar_op());
+}
+
+static_assert(std::is_trivially_copyable<pbam_view>::value,
+  "pbam_view must be trivially copyable");
+
+#endif